@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+// helpers for little-endian binary buffers, shared by the wire protocol
+// and the serialized forms of values
+
+// append to the back of a buffer
+inline void buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t len) {
+    buf.insert(buf.end(), data, data + len);
+}
+
+// remove from the front of a buffer
+inline void buf_consume(std::vector<uint8_t> &buf, size_t n) {
+    buf.erase(buf.begin(), buf.begin() + n);
+}
+
+// reads a unsigned 32 byte int from cur into out
+inline bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
+    if (end - cur < 4) {
+        return false;
+    }
+
+    memcpy(&out, cur, 4);
+    cur += 4;
+    return true;
+}
+
+// reads in a string of length len from cur into out
+inline bool read_str(const uint8_t *&cur, const uint8_t *end, size_t len, std::string &out) {
+    if (len > static_cast<size_t>(end - cur)) {
+        return false;
+    }
+    
+    out.assign(cur, cur + len);
+    cur += len;
+    return true;
+}
+
+// reads a unsigned 64 byte int from cur into out
+inline bool read_u64(const uint8_t *&cur, const uint8_t *end, uint64_t &out) {
+    if (end - cur < 8) {
+        return false;
+    }
+
+    memcpy(&out, cur, 8);
+    cur += 8;
+    return true;
+}
+
+// appends a unsigned 32 byte int
+inline void write_u32(std::vector<uint8_t> &buf, uint32_t v) {
+    buf_append(buf, reinterpret_cast<const uint8_t *>(&v), 4);
+}
+
+// appends a unsigned 64 byte int
+inline void write_u64(std::vector<uint8_t> &buf, uint64_t v) {
+    buf_append(buf, reinterpret_cast<const uint8_t *>(&v), 8);
+}
+
+// appends a length-prefixed string
+inline void write_str(std::vector<uint8_t> &buf, const uint8_t *data, size_t len) {
+    write_u32(buf, static_cast<uint32_t>(len));
+    buf_append(buf, data, len);
+}
+
+inline void write_str(std::vector<uint8_t> &buf, const std::string &s) {
+    write_str(buf, reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
+
+// reads a length-prefixed string
+inline bool read_lstr(const uint8_t *&cur, const uint8_t *end, std::string &out) {
+    uint32_t len { 0 };
+    return read_u32(cur, end, len) && read_str(cur, end, len, out);
+}
+
+// appends a double
+inline void write_dbl(std::vector<uint8_t> &buf, double v) {
+    buf_append(buf, reinterpret_cast<const uint8_t *>(&v), 8);
+}
+
+// reads a double from cur into out
+inline bool read_dbl(const uint8_t *&cur, const uint8_t *end, double &out) {
+    if (end - cur < 8) {
+        return false;
+    }
+
+    memcpy(&out, cur, 8);
+    cur += 8;
+    return true;
+}
@@ -0,0 +1,68 @@
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "checksum.h"
+
+// CRC-32C (Castagnoli), the polynomial with a hardware instruction on x86
+
+// byte at a time lookup table for the reflected polynomial 0x82F63B78
+static struct CrcTable {
+    uint32_t t[256];
+    CrcTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c { i };
+            for (int k = 0; k < 8; ++k) {
+                c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+            }
+            t[i] = c;
+        }
+    }
+} g_crc_table;
+
+static uint32_t crc32c_scalar(uint32_t crc, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        crc = g_crc_table.t[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len) {
+    uint64_t c { crc };
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t w { 0 };
+        memcpy(&w, data, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    uint32_t c32 { static_cast<uint32_t>(c) };
+    for (; len > 0; ++data, --len) {
+        c32 = _mm_crc32_u8(c32, *data);
+    }
+    return c32;
+}
+#endif
+
+// implementation for the running CPU
+static struct {
+    uint32_t (*update)(uint32_t, const uint8_t *, size_t);
+    const char *name;
+} g_crc = [] {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        return decltype(g_crc) { &crc32c_sse42, "sse4.2" };
+    }
+#endif
+    return decltype(g_crc) { &crc32c_scalar, "scalar" };
+}();
+
+// extends crc, 0 to start, with data
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len) {
+    return ~g_crc.update(~crc, data, len);
+}
+
+const char *crc32c_impl_name() {
+    return g_crc.name;
+}
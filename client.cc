@@ -8,12 +8,37 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <vector>
 #include <string>
 
-// maximum message payload size
+// maximum request payload size
 const size_t K_MAX_MSG = 4096;
 
+// maximum response payload size
+const size_t K_MAX_RES = 32 << 20;
+
+// bytes of requests the pipe mode encodes ahead of the socket
+const size_t K_PIPE_BUFFER = 1 << 20;
+
+// response statuses, those from RES_ARR on carry a tagged value
+enum {
+    RES_ERR = 1,
+    RES_ARR = 3,
+    RES_PUSH = 4,
+};
+
+// Tags of values in tagged responses
+enum {
+    TAG_NIL = 0,
+    TAG_STR = 1,
+    TAG_INT = 2,
+    TAG_DBL = 3,
+    TAG_ARR = 4,
+};
+
 static void msg(const char *msg) {
     fprintf(stderr, "%s\n", msg);
 }
@@ -59,38 +84,103 @@ static void buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t le
     buf.insert(buf.end(), data, data + len);
 }
 
-// Sends a length-prefixed request to the server
-// Returns 0 on success, -1 on error
-static int32_t send_req(int fd, const std::vector<std::string> &cmd) {
+// Appends a length-prefixed request to a buffer
+static void append_req(std::vector<uint8_t> &buf, const std::vector<std::string> &cmd) {
     uint32_t len = 4;
     for (const std::string &s : cmd) {
         len += 4 + s.size();
     }
 
-    if (len > K_MAX_MSG) {
-        return -1;
-    }
-
-    char wbuf[4 + K_MAX_MSG];
-    memcpy(&wbuf[0], &len, 4);
+    buf_append(buf, (const uint8_t *)&len, 4);
     uint32_t n = cmd.size();
-    memcpy(&wbuf[4], &n, 4);
-    size_t cur = 8;
-    
+    buf_append(buf, (const uint8_t *)&n, 4);
     for (const std::string &s : cmd) {
         uint32_t p = static_cast<uint32_t>(s.size());
-        memcpy(&wbuf[cur], &p, 4);
-        memcpy(&wbuf[cur+4], s.data(), s.size());
-        cur += 4 + s.size();
+        buf_append(buf, (const uint8_t *)&p, 4);
+        buf_append(buf, (const uint8_t *)s.data(), s.size());
+    }
+}
+
+// Sends a length-prefixed request to the server
+// Returns 0 on success, -1 on error
+static int32_t send_req(int fd, const std::vector<std::string> &cmd) {
+    std::vector<uint8_t> wbuf;
+    append_req(wbuf, cmd);
+    if (wbuf.size() > 4 + K_MAX_MSG) {
+        return -1;
     }
 
-    return write_all(fd, wbuf, 4 + len);
+    return write_all(fd, (const char *)wbuf.data(), wbuf.size());
+}
+
+// Prints a tagged value, returns the number of bytes consumed or -1 if malformed
+static int32_t print_tagged(const uint8_t *data, size_t size, int depth) {
+    if (size < 1) {
+        return -1;
+    }
+
+    printf("%*s", depth * 2, "");
+    switch (data[0]) {
+    case TAG_NIL:
+        printf("(nil)\n");
+        return 1;
+    case TAG_STR: {
+        uint32_t len { 0 };
+        if (size < 5) {
+            return -1;
+        }
+        memcpy(&len, &data[1], 4);
+        if (size < 5 + (size_t)len) {
+            return -1;
+        }
+        printf("(str) %.*s\n", len, &data[5]);
+        return 5 + len;
+    }
+    case TAG_INT: {
+        int64_t val { 0 };
+        if (size < 9) {
+            return -1;
+        }
+        memcpy(&val, &data[1], 8);
+        printf("(int) %lld\n", (long long)val);
+        return 9;
+    }
+    case TAG_DBL: {
+        double val { 0 };
+        if (size < 9) {
+            return -1;
+        }
+        memcpy(&val, &data[1], 8);
+        printf("(dbl) %g\n", val);
+        return 9;
+    }
+    case TAG_ARR: {
+        uint32_t n { 0 };
+        if (size < 5) {
+            return -1;
+        }
+        memcpy(&n, &data[1], 4);
+        printf("(arr) len=%u\n", n);
+        size_t cur { 5 };
+        for (uint32_t i = 0; i < n; ++i) {
+            int32_t rv { print_tagged(&data[cur], size - cur, depth + 1) };
+            if (rv < 0) {
+                return rv;
+            }
+            cur += (size_t)rv;
+        }
+        return (int32_t)cur;
+    }
+    default:
+        return -1;
+    }
 }
 
 // Reads a response from the server
 // Returns 0 on success, -1 on error
 static int32_t read_res(int fd) {   
-    char rbuf[4 + K_MAX_MSG];
+    std::vector<char> buf(4 + K_MAX_RES);
+    char *rbuf { buf.data() };
     errno = 0;
     
     // read in the length prefix
@@ -107,7 +197,7 @@ static int32_t read_res(int fd) {
 
     uint32_t len { 0 };
     memcpy(&len, rbuf, 4);
-    if (len > K_MAX_MSG) {
+    if (len > K_MAX_RES) {
         msg("too long");
         return -1;
     }
@@ -126,11 +216,139 @@ static int32_t read_res(int fd) {
         return -1;
     }
     memcpy(&rescode, &rbuf[4], 4);
-    printf("server says: [%u] %.*s\n", rescode, len - 4, &rbuf[8]);
+    if (rescode == RES_ARR || rescode == RES_PUSH) {
+        printf("server says: [%u]\n", rescode);
+        if (print_tagged(reinterpret_cast<uint8_t *>(&rbuf[8]), len - 4, 0) < 0) {
+            msg("bad response");
+            return -1;
+        }
+    } else {
+        printf("server says: [%u] %.*s\n", rescode, len - 4, &rbuf[8]);
+    }
+    fflush(stdout);
 
     return 0;
 }
 
+// splits a line into arguments separated by spaces or tabs
+static void split_line(const char *line, size_t len, std::vector<std::string> &cmd) {
+    cmd.clear();
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r' || line[i] == '\n')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && line[i] != ' ' && line[i] != '\t' && line[i] != '\r' && line[i] != '\n') {
+            i++;
+        }
+        if (i > start) {
+            cmd.emplace_back(line + start, i - start);
+        }
+    }
+}
+
+// counts the complete responses at the front of buf and drops them
+static void count_replies(std::vector<uint8_t> &buf, uint64_t &replies, uint64_t &errors) {
+    size_t cur = 0;
+    while (buf.size() - cur >= 8) {
+        uint32_t len = 0;
+        memcpy(&len, &buf[cur], 4);
+        if (buf.size() - cur < 4 + (size_t)len) {
+            break;
+        }
+        uint32_t rescode = 0;
+        memcpy(&rescode, &buf[cur + 4], 4);
+        replies++;
+        errors += rescode == RES_ERR;
+        cur += 4 + len;
+    }
+    buf.erase(buf.begin(), buf.begin() + cur);
+}
+
+// --pipe [file]: sends the commands of a file, or stdin, one per line,
+// without waiting for replies; requests are written and replies counted
+// as the socket allows, so neither side stalls on a full buffer
+// Returns 0 if every command got a reply
+static int32_t run_pipe(int fd, FILE *in) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    struct timespec start { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    std::vector<uint8_t> wbuf;
+    size_t wpos = 0;
+    std::vector<uint8_t> rbuf;
+    std::vector<std::string> cmd;
+    uint64_t sent = 0;
+    uint64_t replies = 0;
+    uint64_t errors = 0;
+    bool eof = false;
+    char *line = nullptr;
+    size_t cap = 0;
+
+    while (!eof || wpos < wbuf.size() || replies < sent) {
+        // encode the next lines while little is left to write
+        if (wpos == wbuf.size()) {
+            wbuf.clear();
+            wpos = 0;
+        }
+        while (!eof && wbuf.size() - wpos < K_PIPE_BUFFER) {
+            ssize_t n = getline(&line, &cap, in);
+            if (n < 0) {
+                eof = true;
+                break;
+            }
+            split_line(line, (size_t)n, cmd);
+            if (!cmd.empty()) {
+                append_req(wbuf, cmd);
+                sent++;
+            }
+        }
+
+        struct pollfd pfd { fd, POLLIN, 0 };
+        if (wpos < wbuf.size()) {
+            pfd.events |= POLLOUT;
+        }
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("poll");
+        }
+
+        if (pfd.revents & POLLOUT) {
+            ssize_t rv = write(fd, &wbuf[wpos], wbuf.size() - wpos);
+            if (rv < 0 && errno != EAGAIN && errno != EINTR) {
+                msg("write() error");
+                break;
+            }
+            wpos += rv > 0 ? (size_t)rv : 0;
+        }
+        if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) {
+            uint8_t chunk[64 * 1024];
+            ssize_t rv = read(fd, chunk, sizeof(chunk));
+            if (rv == 0 || (rv < 0 && errno != EAGAIN && errno != EINTR)) {
+                msg(rv == 0 ? "EOF" : "read() error");
+                break;
+            }
+            if (rv > 0) {
+                buf_append(rbuf, chunk, (size_t)rv);
+                count_replies(rbuf, replies, errors);
+            }
+        }
+    }
+    free(line);
+
+    struct timespec now { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (double)(now.tv_sec - start.tv_sec) + (double)(now.tv_nsec - start.tv_nsec) / 1e9;
+    printf("sent %llu, replies %llu, errors %llu, %.3fs, %.0f requests/sec\n",
+        (unsigned long long)sent, (unsigned long long)replies, (unsigned long long)errors,
+        secs, secs > 0 ? (double)replies / secs : 0.0);
+    return replies == sent ? 0 : -1;
+}
+
 int main(int argc, char** argv) {
     // create listening socket
     int fd { socket(AF_INET, SOCK_STREAM, 0) };
@@ -148,6 +366,16 @@ int main(int argc, char** argv) {
         die("connect");
     }
 
+    if (argc > 1 && strcmp(argv[1], "--pipe") == 0) {
+        FILE *in = argc > 2 ? fopen(argv[2], "r") : stdin;
+        if (!in) {
+            die("fopen");
+        }
+        int32_t err = run_pipe(fd, in);
+        close(fd);
+        return err ? 1 : 0;
+    }
+
     std::vector<std::string> cmd;
     for (int i = 1; i < argc; ++i) {
         cmd.push_back(argv[i]);
@@ -163,6 +391,11 @@ int main(int argc, char** argv) {
         goto L_DONE;
     }
 
+    // subscribers keep printing event batches until the server goes away
+    if (cmd.size() > 0 && cmd[0] == "subscribe") {
+        while (read_res(fd) == 0) {}
+    }
+
 L_DONE:
     close(fd);
     return 0;
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+#include "config.h"
+
+// finds a parameter by name, returns null if there is none
+ConfigParam *config_find(ConfigTable *table, const std::string &name) {
+    for (size_t i = 0; i < table->size; ++i) {
+        if (name == table->params[i].name) {
+            return &table->params[i];
+        }
+    }
+    return nullptr;
+}
+
+// parses a decimal value with an optional k/m/g suffix (powers of 1024)
+static bool parse_value(const std::string &s, uint64_t &out) {
+    if (s.empty()) {
+        return false;
+    }
+
+    out = 0;
+    size_t i { 0 };
+    for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) {
+        uint64_t next { out * 10 + static_cast<uint64_t>(s[i] - '0') };
+        if (next / 10 != out) {
+            return false; // overflow
+        }
+        out = next;
+    }
+
+    if (i == 0) {
+        return false;
+    }
+    if (i == s.size()) {
+        return true;
+    }
+    if (i + 1 != s.size()) {
+        return false;
+    }
+
+    int shift { 0 };
+    switch (s[i]) {
+    case 'k': case 'K': shift = 10; break;
+    case 'm': case 'M': shift = 20; break;
+    case 'g': case 'G': shift = 30; break;
+    default: return false;
+    }
+
+    if (out > (UINT64_MAX >> shift)) {
+        return false;
+    }
+    out <<= shift;
+    return true;
+}
+
+// sets a parameter from its string form
+// non-live parameters can only be changed at startup
+bool config_set(ConfigParam *param, const std::string &val, bool startup, std::string &err) {
+    if (!param->live && !startup) {
+        err = std::string(param->name) + " can only be set at startup";
+        return false;
+    }
+
+    if (param->str) {
+        *param->str = val;
+        return true;
+    }
+
+    uint64_t v { 0 };
+    if (!parse_value(val, v)) {
+        err = "bad value for " + std::string(param->name);
+        return false;
+    }
+
+    if (v < param->min || v > param->max) {
+        err = std::string(param->name) + " out of range";
+        return false;
+    }
+
+    *param->value = v;
+    return true;
+}
+
+// loads "name value" lines from a file, # starts a comment
+bool config_load_file(ConfigTable *table, const char *path, std::string &err) {
+    FILE *f { fopen(path, "r") };
+    if (!f) {
+        err = std::string("cannot open ") + path;
+        return false;
+    }
+
+    char line[1024];
+    int lineno { 0 };
+    bool ok { true };
+
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+
+        if (char *hash = strchr(line, '#')) {
+            *hash = '\0';
+        }
+
+        char name[256];
+        char val[256];
+        int n { sscanf(line, "%255s %255s", name, val) };
+        if (n <= 0) {
+            continue; // blank line
+        }
+
+        ConfigParam *param { config_find(table, name) };
+        if (n != 2 || !param) {
+            err = std::string(path) + ":" + std::to_string(lineno) + ": bad line";
+            ok = false;
+        } else if (!config_set(param, val, true, err)) {
+            err = std::string(path) + ":" + std::to_string(lineno) + ": " + err;
+            ok = false;
+        }
+    }
+
+    fclose(f);
+    return ok;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// a tunable parameter backed by a global variable
+struct ConfigParam {
+    const char *name;
+    uint64_t *value;
+    uint64_t min;
+    uint64_t max;
+    bool live { true }; // false if it can only be set at startup
+    std::string *str { nullptr }; // set for a string parameter, value and limits are unused
+};
+
+// the set of parameters known to a program
+struct ConfigTable {
+    ConfigParam *params { nullptr };
+    size_t size { 0 };
+};
+
+ConfigParam *config_find(ConfigTable *table, const std::string &name);
+bool config_set(ConfigParam *param, const std::string &val, bool startup, std::string &err);
+bool config_load_file(ConfigTable *table, const char *path, std::string &err);
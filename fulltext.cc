@@ -0,0 +1,500 @@
+#include <string.h>
+#include <algorithm>
+#include <iterator>
+#include "fulltext.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// longer tokens are not indexed
+const size_t K_FT_MAX_TOKEN = 64;
+
+// compaction starts once retired doc ids outnumber live ones and this many
+const size_t K_FT_COMPACT_MIN = 4096;
+
+// bytes after the encoded blocks, so the simd decoder may load 16 bytes anywhere
+const size_t K_FT_PADDING = 16;
+
+// splits text into lowercase runs of letters and digits, bytes >= 0x80 are
+// kept as letters so utf-8 words survive, the result is sorted and unique
+void ft_tokenize(const std::string &text, std::vector<std::string> &out) {
+    out.clear();
+    std::string token;
+    for (size_t i = 0; i <= text.size(); ++i) {
+        unsigned char c { static_cast<unsigned char>(i < text.size() ? text[i] : ' ') };
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+            token.push_back(static_cast<char>(c));
+        } else if (c >= 'A' && c <= 'Z') {
+            token.push_back(static_cast<char>(c - 'A' + 'a'));
+        } else if (!token.empty()) {
+            if (token.size() <= K_FT_MAX_TOKEN) {
+                out.push_back(token);
+            }
+            token.clear();
+        }
+    }
+
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
+// stream-vbyte encodes n values, out needs (n + 3) / 4 + 4 * n bytes
+// returns the bytes written
+static size_t svb_encode(const uint32_t *in, size_t n, uint8_t *out) {
+    uint8_t *ctrl { out };
+    uint8_t *data { out + (n + 3) / 4 };
+    memset(ctrl, 0, (n + 3) / 4);
+
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t v { in[i] };
+        uint32_t len { v < (1u << 8) ? 1u : v < (1u << 16) ? 2u : v < (1u << 24) ? 3u : 4u };
+        ctrl[i / 4] |= static_cast<uint8_t>((len - 1) << (2 * (i % 4)));
+        for (uint32_t b = 0; b < len; ++b) {
+            *data++ = static_cast<uint8_t>(v >> (8 * b));
+        }
+    }
+    return data - out;
+}
+
+// decodes n deltas and adds them up starting from base
+static void svb_decode_scalar(const uint8_t *in, size_t n, uint32_t base, uint32_t *out) {
+    const uint8_t *ctrl { in };
+    const uint8_t *data { in + (n + 3) / 4 };
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t len { ((ctrl[i / 4] >> (2 * (i % 4))) & 3u) + 1 };
+        uint32_t v { 0 };
+        for (uint32_t b = 0; b < len; ++b) {
+            v |= static_cast<uint32_t>(data[b]) << (8 * b);
+        }
+        data += len;
+        base += v;
+        out[i] = base;
+    }
+}
+
+#if defined(__x86_64__)
+// per control byte: the shuffle spreading its 4 values' bytes into 32-bit lanes,
+// and how many data bytes they take
+static struct {
+    uint8_t shuffle[256][16];
+    uint8_t len[256];
+} g_svb = [] {
+    decltype(g_svb) t;
+    for (int c = 0; c < 256; ++c) {
+        uint8_t pos { 0 };
+        for (int lane = 0; lane < 4; ++lane) {
+            int len { ((c >> (2 * lane)) & 3) + 1 };
+            for (int b = 0; b < 4; ++b) {
+                t.shuffle[c][lane * 4 + b] = b < len ? pos++ : 0x80; // 0x80 zeroes the byte
+            }
+        }
+        t.len[c] = pos;
+    }
+    return t;
+}();
+
+// decodes 4 deltas per control byte with one shuffle, then adds them up
+// with a log-step prefix sum; may write up to 3 values past n
+__attribute__((target("ssse3")))
+static void svb_decode_ssse3(const uint8_t *in, size_t n, uint32_t base, uint32_t *out) {
+    const uint8_t *ctrl { in };
+    const uint8_t *data { in + (n + 3) / 4 };
+    __m128i prev { _mm_set1_epi32(static_cast<int>(base)) };
+
+    for (size_t i = 0; i < n; i += 4) {
+        uint8_t c { ctrl[i / 4] };
+        __m128i x { _mm_loadu_si128(reinterpret_cast<const __m128i *>(data)) };
+        x = _mm_shuffle_epi8(x, _mm_loadu_si128(reinterpret_cast<const __m128i *>(g_svb.shuffle[c])));
+        data += g_svb.len[c];
+
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi32(x, prev);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), x);
+        prev = _mm_shuffle_epi32(x, 0xFF);
+    }
+}
+#endif
+
+// block decoder for the running CPU
+static struct {
+    void (*decode)(const uint8_t *, size_t, uint32_t, uint32_t *);
+    const char *name;
+} g_decoder = [] {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        return decltype(g_decoder) { &svb_decode_ssse3, "ssse3" };
+    }
+#endif
+    return decltype(g_decoder) { &svb_decode_scalar, "scalar" };
+}();
+
+const char *ft_decoder_name() {
+    return g_decoder.name;
+}
+
+// encodes the full tail as a new block
+static void postings_seal(FtPostings &p) {
+    uint32_t deltas[K_FT_BLOCK];
+    for (size_t i = 0; i < p.tail.size(); ++i) {
+        deltas[i] = i ? p.tail[i] - p.tail[i - 1] : 0;
+    }
+
+    FtBlock block;
+    block.first = p.tail.front();
+    block.last = p.tail.back();
+    block.count = static_cast<uint32_t>(p.tail.size());
+
+    // the padding moves behind the new block
+    if (!p.data.empty()) {
+        p.data.resize(p.data.size() - K_FT_PADDING);
+    }
+    block.offset = static_cast<uint32_t>(p.data.size());
+    p.data.resize(p.data.size() + (block.count + 3) / 4 + 4 * block.count);
+    size_t len { svb_encode(deltas, block.count, &p.data[block.offset]) };
+    p.data.resize(block.offset + len + K_FT_PADDING, 0);
+
+    p.blocks.push_back(block);
+    p.tail.clear();
+}
+
+// appends a doc id greater than all in the list
+static void postings_add(FtPostings &p, uint32_t id) {
+    p.tail.push_back(id);
+    p.count++;
+    if (p.tail.size() == K_FT_BLOCK) {
+        postings_seal(p);
+    }
+}
+
+// reads a posting list in order, decoding one block at a time
+struct FtCursor {
+    const FtPostings *p { nullptr };
+    size_t block { 0 }; // blocks.size() for the tail
+    const uint32_t *ids { nullptr };
+    size_t n { 0 };
+    size_t pos { 0 }; // exhausted once pos reaches n
+    uint32_t buf[K_FT_BLOCK + 4];
+};
+
+// positions the cursor at the start of a block, returns false if it is empty
+static bool cursor_load(FtCursor &c, size_t block) {
+    const FtPostings &p { *c.p };
+    c.block = block;
+    c.pos = 0;
+    if (block < p.blocks.size()) {
+        const FtBlock &b { p.blocks[block] };
+        g_decoder.decode(&p.data[b.offset], b.count, b.first, c.buf);
+        c.ids = c.buf;
+        c.n = b.count;
+    } else {
+        c.ids = p.tail.data();
+        c.n = p.tail.size();
+    }
+    return c.n > 0;
+}
+
+static bool cursor_next(FtCursor &c) {
+    if (++c.pos < c.n) {
+        return true;
+    }
+    if (c.block < c.p->blocks.size()) {
+        return cursor_load(c, c.block + 1);
+    }
+    return false;
+}
+
+// moves to the first id >= target, galloping over block bounds and then
+// within the block, so skipping far ahead costs O(log distance)
+static bool cursor_seek(FtCursor &c, uint32_t target) {
+    if (c.pos >= c.n) {
+        return false;
+    }
+    if (c.ids[c.pos] >= target) {
+        return true;
+    }
+
+    if (c.ids[c.n - 1] < target) {
+        const std::vector<FtBlock> &blocks { c.p->blocks };
+        if (c.block >= blocks.size()) {
+            c.pos = c.n;
+            return false;
+        }
+
+        // first block ending at or after target, blocks.size() is the tail
+        size_t lo { c.block + 1 };
+        size_t hi { lo };
+        for (size_t step = 1; hi < blocks.size() && blocks[hi].last < target; step *= 2) {
+            lo = hi + 1;
+            hi += step;
+        }
+        hi = std::min(hi, blocks.size());
+        while (lo < hi) {
+            size_t mid { lo + (hi - lo) / 2 };
+            if (blocks[mid].last < target) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (!cursor_load(c, lo) || c.ids[c.n - 1] < target) {
+            c.pos = c.n;
+            return false;
+        }
+    }
+
+    size_t lo { c.pos };
+    size_t hi { lo };
+    for (size_t step = 1; hi < c.n && c.ids[hi] < target; step *= 2) {
+        lo = hi + 1;
+        hi += step;
+    }
+    hi = std::min(hi, c.n);
+    c.pos = std::lower_bound(c.ids + lo, c.ids + hi, target) - c.ids;
+    return true;
+}
+
+// retires the live doc of key
+bool ft_del(FtIndex *index, const std::string &key) {
+    auto it { index->key_docs.find(key) };
+    if (it == index->key_docs.end()) {
+        return false;
+    }
+    std::string().swap(index->doc_keys[it->second]);
+    index->live[it->second] = false;
+    index->key_docs.erase(it);
+    index->retired++;
+    return true;
+}
+
+static bool doc_live(const FtIndex *index, uint32_t id) {
+    return index->live[id];
+}
+
+// rewrites a posting list the running compaction pass has not reached in
+// the pass's doc numbering, without retired doc ids
+static void postings_renumber(FtIndex *index, FtPostings &p) {
+    FtPostings live;
+    live.pass = index->pass;
+    FtCursor c;
+    c.p = &p;
+    for (bool ok = cursor_load(c, 0); ok; ok = cursor_next(c)) {
+        uint32_t id { index->renumber[c.ids[c.pos]] };
+        if (id != UINT32_MAX && doc_live(index, id)) {
+            postings_add(live, id);
+        }
+    }
+    p = std::move(live);
+    index->stale--;
+}
+
+// the postings of a term, renumbered first if the running pass has not yet
+static FtPostings &postings_current(FtIndex *index, FtPostings &p) {
+    if (p.pass != index->pass) {
+        postings_renumber(index, p);
+    }
+    return p;
+}
+
+// indexes the value of key as a new doc, retiring its previous one
+void ft_add(FtIndex *index, const std::string &key, const std::string &text) {
+    ft_del(index, key);
+
+    std::vector<std::string> tokens;
+    ft_tokenize(text, tokens);
+    if (tokens.empty()) {
+        return;
+    }
+
+    uint32_t id { static_cast<uint32_t>(index->doc_keys.size()) };
+    index->doc_keys.push_back(key);
+    index->live.push_back(true);
+    index->key_docs[key] = id;
+    for (const std::string &token : tokens) {
+        auto [it, created] { index->terms.try_emplace(token) };
+        if (created) {
+            it->second.pass = index->pass;
+        }
+        postings_add(postings_current(index, it->second), id);
+    }
+}
+
+// numbers the live docs 0, 1, ... in doc id order, dropping the retired ones
+// from doc_keys at once; posting lists keep the old ids until renumbered
+static void compact_start(FtIndex *index) {
+    index->renumber.assign(index->doc_keys.size(), UINT32_MAX);
+    std::vector<std::string> doc_keys;
+    doc_keys.reserve(index->key_docs.size());
+    for (size_t id = 0; id < index->doc_keys.size(); ++id) {
+        if (index->live[id]) {
+            index->renumber[id] = static_cast<uint32_t>(doc_keys.size());
+            doc_keys.push_back(std::move(index->doc_keys[id]));
+        }
+    }
+    index->doc_keys.swap(doc_keys);
+    index->live.assign(index->doc_keys.size(), true);
+    for (auto &[key, id] : index->key_docs) {
+        id = index->renumber[id];
+    }
+
+    index->pass++;
+    index->stale = index->terms.size();
+    index->compact_pos = 0;
+    index->compact_retired = index->retired;
+}
+
+// compacts the postings of up to about max_terms terms, starting a pass once
+// retired doc ids outnumber live ones; returns false if there is nothing to do
+bool ft_compact_step(FtIndex *index, size_t max_terms) {
+    if (index->compact_pos == (size_t)-1) {
+        if (index->retired < K_FT_COMPACT_MIN || index->retired < index->key_docs.size()) {
+            return false;
+        }
+        compact_start(index);
+    }
+
+    // walks hash buckets so the pass needs no copy of the term list; a rehash
+    // between steps may skip some terms, so the walk restarts until none are
+    // left in the old numbering
+    std::vector<std::string> emptied;
+    size_t done { 0 };
+    auto &terms { index->terms };
+    while (index->stale > 0 && done < max_terms) {
+        if (index->compact_pos >= terms.bucket_count()) {
+            index->compact_pos = 0;
+        }
+        for (auto it = terms.begin(index->compact_pos); it != terms.end(index->compact_pos); ++it) {
+            if (it->second.pass != index->pass) {
+                postings_renumber(index, it->second);
+                if (it->second.count == 0) {
+                    emptied.push_back(it->first);
+                }
+            }
+            done++;
+        }
+        index->compact_pos++;
+    }
+    for (const std::string &term : emptied) {
+        terms.erase(term);
+    }
+
+    if (index->stale == 0) {
+        index->retired -= index->compact_retired;
+        index->compact_pos = (size_t)-1;
+        std::vector<uint32_t>().swap(index->renumber);
+    }
+    return true;
+}
+
+// memory held by posting lists
+size_t ft_postings_bytes(const FtIndex *index) {
+    size_t bytes { 0 };
+    for (auto &[term, p] : index->terms) {
+        bytes += p.data.size() + p.blocks.size() * sizeof(FtBlock) + p.tail.size() * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+// live doc ids in all of lists, at most limit of them, ascending
+// the shortest list leads and the others gallop to its ids
+static void search_and(const FtIndex *index, std::vector<const FtPostings *> &lists,
+    size_t limit, std::vector<uint32_t> &out)
+{
+    std::sort(lists.begin(), lists.end(), [](const FtPostings *a, const FtPostings *b) {
+        return a->count < b->count;
+    });
+
+    std::vector<FtCursor> cursors(lists.size());
+    for (size_t i = 0; i < lists.size(); ++i) {
+        cursors[i].p = lists[i];
+        if (!cursor_load(cursors[i], 0)) {
+            return;
+        }
+    }
+
+    // a single term is copied a block at a time
+    FtCursor &lead { cursors[0] };
+    if (cursors.size() == 1) {
+        do {
+            for (size_t i = 0; i < lead.n && out.size() < limit; ++i) {
+                if (doc_live(index, lead.ids[i])) {
+                    out.push_back(lead.ids[i]);
+                }
+            }
+        } while (out.size() < limit && lead.block < lead.p->blocks.size() && cursor_load(lead, lead.block + 1));
+        return;
+    }
+
+    uint32_t target { lead.ids[lead.pos] };
+    size_t i { 1 };
+    while (out.size() < limit) {
+        if (i == cursors.size()) {
+            if (doc_live(index, target)) {
+                out.push_back(target);
+            }
+            if (!cursor_next(lead)) {
+                return;
+            }
+            target = lead.ids[lead.pos];
+            i = 1;
+            continue;
+        }
+
+        FtCursor &c { cursors[i] };
+        if (!cursor_seek(c, target)) {
+            return;
+        }
+        if (c.ids[c.pos] == target) {
+            i++;
+            continue;
+        }
+
+        // overshot, the lead catches up and everyone starts over
+        if (!cursor_seek(lead, c.ids[c.pos])) {
+            return;
+        }
+        target = lead.ids[lead.pos];
+        i = 1;
+    }
+}
+
+// runs an OR of AND groups of terms, returning up to limit live doc ids, ascending
+void ft_search(FtIndex *index, const std::vector<std::vector<std::string>> &query,
+    size_t limit, std::vector<uint32_t> &out)
+{
+    out.clear();
+    std::vector<uint32_t> group_ids;
+    std::vector<uint32_t> merged;
+    for (const std::vector<std::string> &group : query) {
+        std::vector<const FtPostings *> lists;
+        for (const std::string &term : group) {
+            auto it { index->terms.find(term) };
+            if (it == index->terms.end()) {
+                lists.clear();
+                break;
+            }
+            lists.push_back(&postings_current(index, it->second));
+        }
+        if (lists.empty()) {
+            continue;
+        }
+
+        // the first limit ids of the union come from the first limit of each group
+        group_ids.clear();
+        search_and(index, lists, limit, group_ids);
+        if (out.empty()) {
+            out.swap(group_ids);
+            continue;
+        }
+        merged.clear();
+        std::set_union(out.begin(), out.end(), group_ids.begin(), group_ids.end(),
+            std::back_inserter(merged));
+        if (merged.size() > limit) {
+            merged.resize(limit);
+        }
+        out.swap(merged);
+    }
+}
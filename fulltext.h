@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// doc ids per sealed posting block
+const size_t K_FT_BLOCK = 128;
+
+// a sealed run of doc ids, stored as deltas from first in FtPostings::data
+struct FtBlock {
+    uint32_t first { 0 };
+    uint32_t last { 0 };
+    uint32_t offset { 0 }; // byte offset of the encoded deltas
+    uint32_t count { 0 };
+};
+
+// ascending doc ids containing a term
+// full blocks are stream-vbyte encoded (a control byte of 2-bit lengths per
+// 4 deltas, then the deltas' bytes), the newest ids stay plain in tail
+struct FtPostings {
+    std::vector<FtBlock> blocks;
+    std::vector<uint8_t> data; // followed by 16 bytes of padding for the simd decoder
+    std::vector<uint32_t> tail;
+    size_t count { 0 };
+    uint32_t pass { 0 }; // compaction pass whose doc numbering the ids use
+};
+
+// inverted index over the string values of keys with a given prefix
+// a document is one version of a key's value: every update indexes the value
+// under a new doc id and retires the old one, so postings are append-only
+// each compaction pass renumbers the live docs 0, 1, ... in order, so doc ids
+// stay below the live docs plus those retired since the last pass
+struct FtIndex {
+    std::string prefix;
+    std::unordered_map<std::string, FtPostings> terms;
+    std::vector<std::string> doc_keys;                  // doc id -> key, empty once retired
+    std::vector<bool> live;                             // doc id -> not retired, dense for searches
+    std::unordered_map<std::string, uint32_t> key_docs; // key -> live doc id
+    size_t retired { 0 };  // retired doc ids still in postings
+    // bucket of terms next compacted, -1 if no compaction is running
+    size_t compact_pos { (size_t)-1 };
+    size_t compact_retired { 0 }; // retired ids the running compaction removes
+    uint32_t pass { 0 };          // the running or last compaction pass
+    // doc id before the running pass -> id after it, UINT32_MAX if retired
+    std::vector<uint32_t> renumber;
+    size_t stale { 0 }; // posting lists the running pass has yet to renumber
+};
+
+void ft_tokenize(const std::string &text, std::vector<std::string> &out);
+const char *ft_decoder_name();
+
+void ft_add(FtIndex *index, const std::string &key, const std::string &text);
+bool ft_del(FtIndex *index, const std::string &key);
+bool ft_compact_step(FtIndex *index, size_t max_terms);
+size_t ft_postings_bytes(const FtIndex *index);
+
+void ft_search(FtIndex *index, const std::vector<std::vector<std::string>> &query,
+    size_t limit, std::vector<uint32_t> &out);
@@ -0,0 +1,125 @@
+#include <math.h>
+#include <algorithm>
+#include "geo.h"
+
+const double K_GEO_LAT_MIN = -85.05112878;
+const double K_GEO_LAT_MAX = 85.05112878;
+
+// earth radius and the length of one degree of latitude, in meters
+const double K_EARTH_RADIUS = 6372797.560856;
+const double K_METERS_PER_DEG = K_EARTH_RADIUS * M_PI / 180;
+
+static double deg_rad(double deg) {
+    return deg * M_PI / 180;
+}
+
+// spreads the low 32 bits of v into the even bits of the result
+static uint64_t spread_bits(uint32_t v) {
+    uint64_t x { v };
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+    x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+    x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x << 2)) & 0x3333333333333333ULL;
+    x = (x | (x << 1)) & 0x5555555555555555ULL;
+    return x;
+}
+
+// inverse of spread_bits
+static uint32_t squash_bits(uint64_t x) {
+    x &= 0x5555555555555555ULL;
+    x = (x | (x >> 1)) & 0x3333333333333333ULL;
+    x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+    x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+    x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+    return static_cast<uint32_t>(x);
+}
+
+// latitude bits go into the even positions, longitude bits into the odd ones
+static uint64_t interleave(uint32_t lat_idx, uint32_t lon_idx) {
+    return spread_bits(lat_idx) | (spread_bits(lon_idx) << 1);
+}
+
+// grid index of a coordinate in [min, max] at the finest level
+static uint32_t grid_index(double v, double min, double max) {
+    double cells { static_cast<double>(1u << K_GEO_STEP_MAX) };
+    double idx { (v - min) / (max - min) * cells };
+    return static_cast<uint32_t>(std::min(std::max(idx, 0.0), cells - 1));
+}
+
+// true if the coordinates can be indexed
+bool geo_valid(double lon, double lat) {
+    return lon >= -180 && lon <= 180 && lat >= K_GEO_LAT_MIN && lat <= K_GEO_LAT_MAX;
+}
+
+// 52-bit geohash of a point
+uint64_t geo_encode(double lon, double lat) {
+    return interleave(grid_index(lat, -90, 90), grid_index(lon, -180, 180));
+}
+
+// center of the finest cell of a geohash
+void geo_decode(uint64_t hash, double &lon, double &lat) {
+    double cells { static_cast<double>(1u << K_GEO_STEP_MAX) };
+    lat = (squash_bits(hash) + 0.5) / cells * 180 - 90;
+    lon = (squash_bits(hash >> 1) + 0.5) / cells * 360 - 180;
+}
+
+// great-circle distance in meters (haversine)
+double geo_distance(double lon1, double lat1, double lon2, double lat2) {
+    double u { sin(deg_rad(lat2 - lat1) / 2) };
+    double v { sin(deg_rad(lon2 - lon1) / 2) };
+    double a { u * u + cos(deg_rad(lat1)) * cos(deg_rad(lat2)) * v * v };
+    return 2 * K_EARTH_RADIUS * asin(sqrt(std::min(a, 1.0)));
+}
+
+// computes score ranges covering every point within half_width meters east
+// and west and half_height meters north and south of a center
+// picks the finest level whose cells are at least that large, so the cell of
+// the center and its 8 neighbours cover the area: at most 9 range scans
+void geo_ranges(double lon, double lat, double half_width, double half_height,
+    std::vector<GeoRange> &out)
+{
+    // cells are narrowest at the latitude of the area farthest from the equator
+    double lat_far { std::min(fabs(lat) + half_height / K_METERS_PER_DEG, 90.0) };
+    double lon_scale { cos(deg_rad(lat_far)) };
+
+    int step { K_GEO_STEP_MAX };
+    while (step > 0) {
+        double cell_height { 180.0 / (1u << step) * K_METERS_PER_DEG };
+        double cell_width { 360.0 / (1u << step) * K_METERS_PER_DEG * lon_scale };
+        if (cell_height >= half_height && cell_width >= half_width) {
+            break;
+        }
+        step--;
+    }
+
+    int shift { K_GEO_STEP_MAX - step };
+    int64_t cells { int64_t(1) << step };
+    int64_t lat_idx { grid_index(lat, -90, 90) >> shift };
+    int64_t lon_idx { grid_index(lon, -180, 180) >> shift };
+
+    std::vector<GeoRange> ranges;
+    for (int64_t dy = -1; dy <= 1; ++dy) {
+        int64_t y { lat_idx + dy };
+        if (y < 0 || y >= cells) {
+            continue; // past a pole
+        }
+        for (int64_t dx = -1; dx <= 1; ++dx) {
+            int64_t x { (lon_idx + dx + cells) % cells }; // wraps at the antimeridian
+            uint64_t cell { interleave(static_cast<uint32_t>(y), static_cast<uint32_t>(x)) };
+            ranges.push_back({ cell << (2 * shift), (cell + 1) << (2 * shift) });
+        }
+    }
+
+    // neighbours repeat at coarse levels and are often adjacent, merge them
+    std::sort(ranges.begin(), ranges.end(), [](const GeoRange &a, const GeoRange &b) {
+        return a.min < b.min;
+    });
+    for (const GeoRange &r : ranges) {
+        if (!out.empty() && r.min <= out.back().max) {
+            out.back().max = std::max(out.back().max, r.max);
+        } else {
+            out.push_back(r);
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// bits per coordinate at the finest level, the 52-bit hash fits a double exactly
+const int K_GEO_STEP_MAX = 26;
+
+// range of geohash scores [min, max)
+struct GeoRange {
+    uint64_t min { 0 };
+    uint64_t max { 0 };
+};
+
+bool geo_valid(double lon, double lat);
+uint64_t geo_encode(double lon, double lat);
+void geo_decode(uint64_t hash, double &lon, double &lat);
+double geo_distance(double lon1, double lat1, double lon2, double lat2);
+void geo_ranges(double lon, double lat, double half_width, double half_height,
+    std::vector<GeoRange> &out);
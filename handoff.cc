@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+// fills a unix socket address, returns false if the path is too long
+static bool handoff_addr(const char *path, struct sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+// creates the directory holding handoff sockets, only accessible to this
+// user so no one else can connect to or replace a socket in it
+// returns false if it cannot be created or an existing one is not private
+bool handoff_dir(const char *path) {
+    if (mkdir(path, 0700) && errno != EEXIST) {
+        return false;
+    }
+    struct stat st;
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == geteuid() && !(st.st_mode & 077);
+}
+
+// creates the unix socket a restarting server connects to
+// a stale socket file from a previous process is replaced
+// returns the listening fd, or -1 on error
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (!handoff_addr(path, addr)) {
+        return -1;
+    }
+
+    int fd { socket(AF_UNIX, SOCK_STREAM, 0) };
+    if (fd < 0) {
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// connects to the handoff socket of a running server
+// returns the connected fd, or -1 on error
+int handoff_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (!handoff_addr(path, addr)) {
+        return -1;
+    }
+
+    int fd { socket(AF_UNIX, SOCK_STREAM, 0) };
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// whether the process at the other end of a unix socket runs as this user
+bool handoff_peer_ok(int sock) {
+    struct ucred cred;
+    socklen_t len { sizeof(cred) };
+    return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid();
+}
+
+// sends up to K_HANDOFF_MAX_FDS file descriptors with a 4 byte tag
+bool handoff_send_fds(int sock, const int *fds, size_t n, uint32_t tag) {
+    if (n > K_HANDOFF_MAX_FDS) {
+        return false;
+    }
+
+    struct iovec iov { &tag, sizeof(tag) };
+    struct msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * K_HANDOFF_MAX_FDS));
+    if (n > 0) {
+        msg.msg_control = control.data();
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+        struct cmsghdr *cmsg { CMSG_FIRSTHDR(&msg) };
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+    }
+
+    return sendmsg(sock, &msg, 0) == sizeof(tag);
+}
+
+// receives one message sent by handoff_send_fds, appending its fds
+bool handoff_recv_fds(int sock, std::vector<int> &fds, uint32_t &tag) {
+    struct iovec iov { &tag, sizeof(tag) };
+    struct msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * K_HANDOFF_MAX_FDS));
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(tag) || (msg.msg_flags & MSG_CTRUNC)) {
+        return false;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t n { (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int) };
+        const int *data { reinterpret_cast<const int *>(CMSG_DATA(cmsg)) };
+        fds.insert(fds.end(), data, data + n);
+    }
+    return true;
+}
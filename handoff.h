@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// maximum file descriptors passed in a single message
+const size_t K_HANDOFF_MAX_FDS = 250;
+
+bool handoff_dir(const char *path);
+int handoff_listen(const char *path);
+int handoff_connect(const char *path);
+bool handoff_peer_ok(int sock);
+bool handoff_send_fds(int sock, const int *fds, size_t n, uint32_t tag);
+bool handoff_recv_fds(int sock, std::vector<int> &fds, uint32_t &tag);
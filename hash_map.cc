@@ -1,65 +1,372 @@
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <sys/random.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
 #include "hash_map.h"
 
-// maximum load factor for a hashmap
-const size_t K_MAX_LOAD_FACTOR = 8;
+// maximum load factor for a hashmap, checked at every insert
+size_t g_hash_max_load_factor = 8;
 
-// number of keys to migrate during rehashing
-const size_t K_REHASHING_WORK = 128;
+// number of keys to migrate during rehashing, read at every migration step
+size_t g_hash_rehashing_work = 128;
+
+uint64_t g_hash_seed = [] {
+    uint64_t seed { 0 };
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        seed = static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    }
+    return seed;
+}();
+
+// constants of wyhash (public domain, Wang Yi)
+static const uint64_t K_WY[4] { 0xa0761d6478bd642f, 0xe7037ed1a0b428db, 0x8ebc6af09c88c6e3, 0x589965cc75374cc3 };
+
+// folds the 128-bit product of a and b
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+    __uint128_t r { static_cast<__uint128_t>(a) * b };
+    return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// seeded 64-bit hash of a byte string, wyhash: keys up to 16 bytes take one
+// or two overlapping loads and two multiplies, longer ones are consumed
+// 48 bytes at a time in three independent multiply chains
+uint64_t hash_bytes(const void *data, size_t len) {
+    const uint8_t *p { static_cast<const uint8_t *>(data) };
+    uint64_t seed { g_hash_seed ^ wymix(g_hash_seed ^ K_WY[0], K_WY[1]) };
+    uint64_t a { 0 };
+    uint64_t b { 0 };
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t mid { (len >> 3) << 2 };
+            a = (read32(p) << 32) | read32(p + mid);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[len >> 1]) << 8) | p[len - 1];
+        }
+    } else {
+        size_t i { len };
+        if (i > 48) {
+            uint64_t see1 { seed };
+            uint64_t see2 { seed };
+            do {
+                seed = wymix(read64(p) ^ K_WY[1], read64(p + 8) ^ seed);
+                see1 = wymix(read64(p + 16) ^ K_WY[2], read64(p + 24) ^ see1);
+                see2 = wymix(read64(p + 32) ^ K_WY[3], read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(read64(p) ^ K_WY[1], read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    __uint128_t r { static_cast<__uint128_t>(a ^ K_WY[1]) * (b ^ seed) };
+    a = static_cast<uint64_t>(r);
+    b = static_cast<uint64_t>(r >> 64);
+    return wymix(a ^ K_WY[0] ^ len, b ^ K_WY[1]);
+}
+
+#ifdef HASH_COMPACT
+// a link is a slab reference, leaving 32 filter bits
+const uint32_t K_LINK_BITS = 32;
+const uint32_t K_FILTER_HASH_BITS = 5;
+
+// slab chunks are aligned to their size, so an object finds its chunk by masking
+const size_t K_SLAB_CHUNK = 4 << 20;
+// chunk index, padded to a cache line
+const size_t K_SLAB_HEADER = 64;
+// a reference is chunk << K_SLAB_SLOT_BITS | slot
+const uint32_t K_SLAB_SLOT_BITS = 16;
+
+static struct {
+    size_t obj_size { 0 };
+    size_t slots { 0 }; // objects per chunk
+    // chunk 0 is never allocated, so no reference is 0
+    std::vector<uint8_t *> chunks { nullptr };
+    size_t used { 0 }; // slots handed out of the last chunk
+    uint32_t free_list { 0 }; // freed objects, linked through their first bytes
+    std::once_flag init;
+    std::mutex mu; // for snapshot loading, which creates entries on several threads
+} g_slab;
+
+static inline uint8_t *slab_obj(uint32_t ref) {
+    return g_slab.chunks[ref >> K_SLAB_SLOT_BITS] + K_SLAB_HEADER
+        + (ref & ((1u << K_SLAB_SLOT_BITS) - 1)) * g_slab.obj_size;
+}
+
+static uint32_t slab_ref(const void *ptr) {
+    uintptr_t addr { reinterpret_cast<uintptr_t>(ptr) };
+    uintptr_t base { addr & ~(K_SLAB_CHUNK - 1) };
+    uint32_t chunk { *reinterpret_cast<const uint32_t *>(base) };
+    return chunk << K_SLAB_SLOT_BITS | static_cast<uint32_t>((addr - base - K_SLAB_HEADER) / g_slab.obj_size);
+}
+
+// allocates an object, every object of the process must be of the same size
+void *hash_slab_alloc(size_t size) {
+    std::call_once(g_slab.init, [size] {
+        size_t align { alignof(max_align_t) };
+        g_slab.obj_size = (size + align - 1) / align * align;
+        g_slab.slots = std::min((K_SLAB_CHUNK - K_SLAB_HEADER) / g_slab.obj_size, size_t { 1 } << K_SLAB_SLOT_BITS);
+        g_slab.used = g_slab.slots;
+    });
+    assert(size <= g_slab.obj_size);
+
+    std::lock_guard<std::mutex> lock { g_slab.mu };
+    if (uint32_t ref = g_slab.free_list) {
+        uint8_t *obj { slab_obj(ref) };
+        memcpy(&g_slab.free_list, obj, sizeof(uint32_t));
+        return obj;
+    }
+    if (g_slab.used == g_slab.slots) {
+        if (g_slab.chunks.size() >> (32 - K_SLAB_SLOT_BITS)) {
+            throw std::bad_alloc(); // out of references
+        }
+        uint8_t *chunk { static_cast<uint8_t *>(aligned_alloc(K_SLAB_CHUNK, K_SLAB_CHUNK)) };
+        if (!chunk) {
+            throw std::bad_alloc();
+        }
+        uint32_t index { static_cast<uint32_t>(g_slab.chunks.size()) };
+        memcpy(chunk, &index, sizeof(index));
+        g_slab.chunks.push_back(chunk);
+        g_slab.used = 0;
+    }
+    return g_slab.chunks.back() + K_SLAB_HEADER + g_slab.used++ * g_slab.obj_size;
+}
+
+void hash_slab_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock { g_slab.mu };
+    memcpy(ptr, &g_slab.free_list, sizeof(uint32_t));
+    g_slab.free_list = slab_ref(ptr);
+}
+
+static inline HashNode *link_node(uint64_t link) {
+    return link ? reinterpret_cast<HashNode *>(slab_obj(static_cast<uint32_t>(link))) : nullptr;
+}
+
+static inline uint64_t node_link(HashNode *node) {
+    return slab_ref(node);
+}
+
+static inline uint64_t next_link(const HashNode *node) {
+    return node->next;
+}
+
+static inline void set_next_link(HashNode *node, uint64_t link) {
+    node->next = static_cast<uint32_t>(link);
+}
+#else
+// a link is a pointer, user space addresses fit in 48 bits on x86-64 and aarch64
+const uint32_t K_LINK_BITS = 48;
+const uint32_t K_FILTER_HASH_BITS = 4;
+
+static inline HashNode *link_node(uint64_t link) {
+    return reinterpret_cast<HashNode *>(link);
+}
+
+static inline uint64_t node_link(HashNode *node) {
+    uint64_t link { reinterpret_cast<uint64_t>(node) };
+    assert(link >> K_LINK_BITS == 0);
+    return link;
+}
+
+static inline uint64_t next_link(const HashNode *node) {
+    return reinterpret_cast<uint64_t>(node->next);
+}
+
+static inline void set_next_link(HashNode *node, uint64_t link) {
+    node->next = reinterpret_cast<HashNode *>(link);
+}
+#endif
+
+const uint64_t K_LINK_MASK = (uint64_t { 1 } << K_LINK_BITS) - 1;
+
+// hash bits the filter of a table with mask + 1 buckets is picked by, the
+// ones right above the index since all nodes of a bucket share the index
+// bits; a compact hash has only 32 bits, so from 2^28 buckets on fewer are
+// left and the filter rejects fewer missing keys
+static inline uint32_t filter_hash_bits(size_t mask) {
+    uint32_t index_bits { static_cast<uint32_t>(__builtin_ctzll(mask + 1)) };
+    uint32_t hash_bits { sizeof(HashNode::hash_code) * 8 };
+    return index_bits < hash_bits ? std::min(hash_bits - index_bits, K_FILTER_HASH_BITS) : 0;
+}
+
+// the filter bit of a bucket that a node sets
+static inline uint64_t filter_bit(const HashNode *node, size_t mask) {
+    uint64_t above { uint64_t { node->hash_code } >> __builtin_ctzll(mask + 1) };
+    return uint64_t { 1 } << (K_LINK_BITS + (above & ((1u << K_FILTER_HASH_BITS) - 1)));
+}
+
+static inline HashNode *bucket_head(uint64_t bucket) {
+    return link_node(bucket & K_LINK_MASK);
+}
+
+static inline HashNode *node_next(const HashNode *node) {
+    return link_node(next_link(node));
+}
 
 // initialize hash table
 void hash_init(HashTable *hash_table, size_t n) {
     assert(n > 0 && ((n - 1) & n) == 0); // check that n is a power of 2
-    hash_table->table = (HashNode **)calloc(n, sizeof(HashNode *));
+    hash_table->table = (uint64_t *)calloc(n, sizeof(uint64_t));
     hash_table->mask = n - 1;
-    hash_table->size = n; 
+    hash_table->size = 0;
 }
 
-// insert hash node into hash table
-void hash_insert(HashTable *hash_table, HashNode *hash_node) {
-    size_t pos = hash_node->hash_code & hash_table->mask;
-    HashNode *next = hash_table->table[pos];
-    hash_node->next = next;
-    hash_table->table[pos] = hash_node;
+// links hash node, whose link is given, at the front of its bucket
+static void bucket_push(HashTable *hash_table, HashNode *hash_node, uint64_t link) {
+    uint64_t &bucket { hash_table->table[hash_node->hash_code & hash_table->mask] };
+    set_next_link(hash_node, bucket & K_LINK_MASK);
+    bucket = (bucket & ~K_LINK_MASK) | filter_bit(hash_node, hash_table->mask) | link;
+}
+
+// insert hash node, whose link is given, into hash table
+static void hash_insert(HashTable *hash_table, HashNode *hash_node, uint64_t link) {
+    bucket_push(hash_table, hash_node, link);
     hash_table->size++; 
 }
 
-// finds and returns the address of the node if key exists in the hash table
-static HashNode **hash_lookup(HashTable *hash_table, HashNode *key, bool (*eq)(HashNode*, HashNode*)) {
+// finds and returns the node if key exists in the hash table
+// prev, if given, is set to the node before it in the chain, null for the first
+static HashNode *hash_lookup(HashTable *hash_table, HashNode *key, bool (*eq)(HashNode*, HashNode*), HashNode **prev) {
     if (!hash_table->table) {
         return nullptr;
     }
 
-    size_t pos = key->hash_code & hash_table->mask;
-
-    HashNode** curr_addr = &hash_table->table[pos];
-    HashNode* curr_node = *curr_addr;
+    uint64_t bucket { hash_table->table[key->hash_code & hash_table->mask] };
+    if (!(bucket & filter_bit(key, hash_table->mask))) {
+        return nullptr; // no node of the chain has the key's filter bit
+    }
 
-    while (curr_node != nullptr) {
+    HashNode *before { nullptr };
+    for (HashNode *curr_node = bucket_head(bucket); curr_node != nullptr; curr_node = node_next(curr_node)) {
         if (curr_node->hash_code == key->hash_code && eq(curr_node, key)) {
-            // return the actual address for deletion instances
-            return curr_addr; 
+            // the previous node is needed for deletion instances
+            if (prev) {
+                *prev = before;
+            }
+            return curr_node;
         }
-
-        curr_addr = &curr_node->next;
-        curr_node = *curr_addr;
+        before = curr_node;
     }
 
     return nullptr;
 }
 
-static HashNode* hash_detach(HashTable *table, HashNode **node_addr) {
-    HashNode *node = *node_addr;
-    *node_addr = node->next;
+// unlinks a node found by hash_lookup, and rebuilds the filter of its
+// bucket from the nodes that are left
+static HashNode* hash_detach(HashTable *table, HashNode *node, HashNode *prev) {
+    uint64_t &bucket { table->table[node->hash_code & table->mask] };
+    if (prev) {
+        set_next_link(prev, next_link(node));
+    } else {
+        bucket = (bucket & ~K_LINK_MASK) | next_link(node);
+    }
+
+    uint64_t filter { 0 };
+    for (HashNode *curr = bucket_head(bucket); curr != nullptr; curr = node_next(curr)) {
+        filter |= filter_bit(curr, table->mask);
+    }
+    bucket = (bucket & K_LINK_MASK) | filter;
     table->size--;
     return node;
 }
 
+// unlinks the first node of a bucket and returns its link
+// the filter keeps the node's bit, which only costs a walk of the chain
+static uint64_t hash_pop(HashTable *table, size_t pos) {
+    uint64_t &bucket { table->table[pos] };
+    uint64_t link { bucket & K_LINK_MASK };
+    bucket = (bucket & ~K_LINK_MASK) | next_link(link_node(link));
+    table->size--;
+    return link;
+}
+
+// tables at least this large get their successor allocated off-thread,
+// smaller ones are cheap enough to calloc in place
+const size_t K_PREALLOC_MIN_BUCKETS = 1 << 16;
+
+// fraction of the rehash threshold, in percent, at which allocation starts
+const size_t K_PREALLOC_AT_PERCENT = 75;
+
+struct HashPrealloc {
+    size_t n { 0 };
+    uint64_t *table { nullptr };
+    bool failed { false }; // out of memory, the rehash allocates in place
+    std::thread thread;
+};
+
+// allocates a table of n buckets and writes every page of it, so the
+// faults happen on the helper thread rather than during migration
+static void prealloc_run(HashPrealloc *prealloc) {
+    size_t bytes { prealloc->n * sizeof(uint64_t) };
+    prealloc->table = static_cast<uint64_t *>(malloc(bytes));
+    if (prealloc->table) {
+        memset(prealloc->table, 0, bytes);
+    } else {
+        prealloc->failed = true;
+    }
+}
+// starts allocating the next table once the load nears the rehash threshold
+static void hash_map_prealloc(HashMap *hash_map, size_t threshold) {
+    HashTable &newer { hash_map->newer };
+    if (hash_map->prealloc || newer.mask + 1 < K_PREALLOC_MIN_BUCKETS
+        || newer.size < threshold / 100 * K_PREALLOC_AT_PERCENT) {
+        return;
+    }
+    HashPrealloc *prealloc { new HashPrealloc() };
+    prealloc->n = (newer.mask + 1) * 2;
+    prealloc->thread = std::thread(&prealloc_run, prealloc);
+    hash_map->prealloc = prealloc;
+}
+
 // handles rehashing the hashmap when it's overloaded
+// the new table is the preallocated one if there is one, waiting for it if
+// the helper has not finished: that is never slower than allocating here
 static void hash_map_rehash(HashMap *hash_map) {
+    size_t n { (hash_map->newer.mask + 1) * 2 };
     hash_map->older = hash_map->newer;
-    hash_init(&hash_map->newer, (hash_map->newer.mask + 1) * 2);
+    HashPrealloc *prealloc { hash_map->prealloc };
+    if (prealloc) {
+        prealloc->thread.join();
+    }
+    if (prealloc && !prealloc->failed) {
+        // sized when the current table was, which has not changed since
+        hash_map->newer.table = prealloc->table;
+        hash_map->newer.mask = n - 1;
+        hash_map->newer.size = 0;
+    } else {
+        hash_init(&hash_map->newer, n);
+    }
+    delete prealloc;
+    hash_map->prealloc = nullptr;
     hash_map->migrate_pos = 0;
 }
 
@@ -67,18 +374,16 @@ static void hash_map_rehash(HashMap *hash_map) {
 void hash_map_migrate(HashMap *hash_map) {
     size_t migrated { 0 };
 
-    while (migrated < K_REHASHING_WORK && hash_map->older.size > 0) {
-        HashNode **node_addr { &hash_map->older.table[hash_map->migrate_pos] };
-
-        // if empty node, skip it
-        if (!*node_addr) {
+    while (migrated < g_hash_rehashing_work && hash_map->older.size > 0) {
+        // if empty bucket, skip it
+        if (!(hash_map->older.table[hash_map->migrate_pos] & K_LINK_MASK)) {
             hash_map->migrate_pos++;
             continue;
         }
 
         // remove from older, and insert into newer
-        HashNode* node { hash_detach(&hash_map->older, node_addr) };
-        hash_insert(&hash_map->newer, node);
+        uint64_t link { hash_pop(&hash_map->older, hash_map->migrate_pos) };
+        hash_insert(&hash_map->newer, link_node(link), link);
         migrated++;
     }
 
@@ -96,14 +401,14 @@ HashNode *hash_map_lookup(HashMap *hash_map, HashNode *key, bool (*eq)(HashNode
     // progressive migration
     hash_map_migrate(hash_map);
     
-    HashNode **node_addr = hash_lookup(&hash_map->newer, key, eq);
+    HashNode *node = hash_lookup(&hash_map->newer, key, eq, nullptr);
 
     // if not in newer, check if in older
-    if (!node_addr) {
-        node_addr = hash_lookup(&hash_map->older, key, eq);
+    if (!node) {
+        node = hash_lookup(&hash_map->older, key, eq, nullptr);
     }
 
-    return node_addr ? *node_addr : nullptr;
+    return node;
 }
 
 // handles deleting a key from a hashmap
@@ -112,14 +417,16 @@ HashNode *hash_map_delete(HashMap *hash_map, HashNode *key, bool (*eq)(HashNode
     // progressive migrating
     hash_map_migrate(hash_map);
 
+    HashNode *prev { nullptr };
+
     // check newer
-    if (HashNode **node_addr = hash_lookup(&hash_map->newer, key, eq)) {
-        return hash_detach(&hash_map->newer, node_addr);
+    if (HashNode *node = hash_lookup(&hash_map->newer, key, eq, &prev)) {
+        return hash_detach(&hash_map->newer, node, prev);
     }
     
     // check older
-    if (HashNode **node_addr = hash_lookup(&hash_map->older, key, eq)) {
-        return hash_detach(&hash_map->older, node_addr);
+    if (HashNode *node = hash_lookup(&hash_map->older, key, eq, &prev)) {
+        return hash_detach(&hash_map->older, node, prev);
     }
 
     return nullptr;
@@ -132,16 +439,267 @@ void hash_map_insert(HashMap *hash_map, HashNode *node) {
         hash_init(&hash_map->newer, 4);
     }
 
-    hash_insert(&hash_map->newer, node);
+    hash_insert(&hash_map->newer, node, node_link(node));
 
     // rehash if too much keys in newer table
     if (!hash_map->older.table) {
-        size_t threshold { (hash_map->newer.mask + 1) * K_MAX_LOAD_FACTOR };
+        size_t threshold { (hash_map->newer.mask + 1) * g_hash_max_load_factor };
         if (hash_map->newer.size >= threshold) {
             hash_map_rehash(hash_map);
+        } else {
+            hash_map_prealloc(hash_map, threshold);
         }
     }
 
     // progressive migration
     hash_map_migrate(hash_map);
-}
\ No newline at end of file
+}
+
+// moves every node of a table into another and frees the emptied table
+static void hash_move(HashTable *from, HashTable *to) {
+    for (size_t i = 0; from->table && i <= from->mask; ++i) {
+        while (from->table[i] & K_LINK_MASK) {
+            uint64_t link { hash_pop(from, i) };
+            hash_insert(to, link_node(link), link);
+        }
+    }
+    free(from->table);
+    *from = HashTable{};
+}
+
+// sizes the hashmap so it holds n keys without growing
+// keys already present are moved into the new table at once rather than
+// migrated incrementally, reserving less than the current size does nothing
+void hash_map_reserve(HashMap *hash_map, size_t n) {
+    size_t load_factor { g_hash_max_load_factor > 0 ? g_hash_max_load_factor : 1 };
+    // stops before the array's size in bytes overflows, calloc refuses it then
+    size_t buckets { 4 };
+    while (buckets <= n / load_factor && buckets < SIZE_MAX / sizeof(uint64_t) / 2) {
+        buckets *= 2;
+    }
+    if (hash_map->newer.table && hash_map->newer.mask + 1 >= buckets) {
+        return;
+    }
+
+    // a table being preallocated is for the old size
+    if (HashPrealloc *prealloc = hash_map->prealloc) {
+        prealloc->thread.join();
+        free(prealloc->table);
+        delete prealloc;
+        hash_map->prealloc = nullptr;
+    }
+
+    // out of memory, the map grows as keys are inserted instead
+    HashTable table;
+    hash_init(&table, buckets);
+    if (!table.table) {
+        return;
+    }
+    hash_move(&hash_map->newer, &table);
+    hash_move(&hash_map->older, &table);
+    hash_map->newer = table;
+    hash_map->migrate_pos = 0;
+}
+
+// inserts node into a hashmap sized by hash_map_reserve, with no load
+// check and no migration step: keys beyond the reservation lengthen chains
+// until the next hash_map_insert grows the table
+void hash_map_insert_bulk(HashMap *hash_map, HashNode *node) {
+    if (!hash_map->newer.table) {
+        hash_init(&hash_map->newer, 4);
+    }
+    hash_insert(&hash_map->newer, node, node_link(node));
+}
+
+// fewer nodes than this per thread are inserted by the calling thread alone
+const size_t K_PARALLEL_MIN_NODES = 64 * 1024;
+
+// calls f(0) .. f(threads - 1), each on its own thread but the first
+template <typename F>
+static void run_threads(size_t threads, F f) {
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; ++t) {
+        pool.emplace_back(f, t);
+    }
+    f(0);
+    for (std::thread &thread : pool) {
+        thread.join();
+    }
+}
+
+// inserts n nodes using up to threads threads, for loading a known set of keys
+// the table is reserved for all of them, then the nodes are grouped by the
+// range of buckets they fall in and each range is filled by one thread, so
+// no bucket is written by two
+void hash_map_insert_parallel(HashMap *hash_map, HashNode **nodes, size_t n, size_t threads) {
+    hash_map_reserve(hash_map, hash_map_size(hash_map) + n);
+    if (hash_map->older.table) {
+        hash_move(&hash_map->older, &hash_map->newer);
+        hash_map->migrate_pos = 0;
+    }
+    HashTable *table { &hash_map->newer };
+
+    threads = std::min({ threads, n / K_PARALLEL_MIN_NODES, table->mask + 1, size_t { UINT16_MAX } });
+    if (threads <= 1) {
+        for (size_t i = 0; i < n; ++i) {
+            hash_map_insert_bulk(hash_map, nodes[i]);
+        }
+        return;
+    }
+
+    // thread t counts the ranges of the nodes in slice t, counts[t * threads + range]
+    uint32_t bits { static_cast<uint32_t>(__builtin_ctzll(table->mask + 1)) };
+    std::vector<uint16_t> ranges(n);
+    std::vector<size_t> counts(threads * threads);
+    auto slice_begin = [n, threads](size_t t) { return n / threads * t + std::min(t, n % threads); };
+    run_threads(threads, [&](size_t t) {
+        for (size_t i = slice_begin(t); i < slice_begin(t + 1); ++i) {
+            size_t range { ((nodes[i]->hash_code & table->mask) * threads) >> bits };
+            ranges[i] = static_cast<uint16_t>(range);
+            counts[t * threads + range]++;
+        }
+    });
+
+    // where each slice's nodes of each range go, ranges in order
+    std::vector<size_t> starts(threads + 1);
+    std::vector<size_t> offsets(threads * threads);
+    size_t pos { 0 };
+    for (size_t range = 0; range < threads; ++range) {
+        starts[range] = pos;
+        for (size_t t = 0; t < threads; ++t) {
+            offsets[t * threads + range] = pos;
+            pos += counts[t * threads + range];
+        }
+    }
+    starts[threads] = pos;
+
+    std::vector<HashNode *> grouped(n);
+    run_threads(threads, [&](size_t t) {
+        for (size_t i = slice_begin(t); i < slice_begin(t + 1); ++i) {
+            grouped[offsets[t * threads + ranges[i]]++] = nodes[i];
+        }
+    });
+    run_threads(threads, [&](size_t range) {
+        for (size_t i = starts[range]; i < starts[range + 1]; ++i) {
+            bucket_push(table, grouped[i], node_link(grouped[i]));
+        }
+    });
+    table->size += n;
+}
+
+// calls f on every node in a hash table until it returns false
+static bool hash_foreach(HashTable *hash_table, bool (*f)(HashNode *, void *), void *arg) {
+    for (size_t i = 0; hash_table->table && i <= hash_table->mask; ++i) {
+        for (HashNode *node = bucket_head(hash_table->table[i]); node != nullptr; node = node_next(node)) {
+            if (!f(node, arg)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// calls f on every node in the hashmap until it returns false
+// the hashmap must not be modified by f
+void hash_map_foreach(HashMap *hash_map, bool (*f)(HashNode *, void *), void *arg) {
+    hash_foreach(&hash_map->newer, f, arg) && hash_foreach(&hash_map->older, f, arg);
+}
+
+// number of keys in the hashmap
+size_t hash_map_size(HashMap *hash_map) {
+    return hash_map->newer.size + hash_map->older.size;
+}
+
+// reverses the bits of v
+static uint64_t rev_bits(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555) | ((v & 0x5555555555555555) << 1);
+    v = ((v >> 2) & 0x3333333333333333) | ((v & 0x3333333333333333) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0F) | ((v & 0x0F0F0F0F0F0F0F0F) << 4);
+    return __builtin_bswap64(v);
+}
+
+// increments the cursor in reversed bit order above mask
+static uint64_t scan_next(uint64_t cursor, size_t mask) {
+    cursor |= ~static_cast<uint64_t>(mask);
+    return rev_bits(rev_bits(cursor) + 1);
+}
+
+static void scan_bucket(HashTable *hash_table, size_t pos, void (*f)(HashNode *, void *), void *arg) {
+    for (HashNode *node = bucket_head(hash_table->table[pos]); node != nullptr; node = node_next(node)) {
+        f(node, arg);
+    }
+}
+
+// visits one bucket of the smaller table and the buckets of the larger one
+// its keys migrate to, calling f on every node; start with cursor 0 and pass
+// the returned cursor back until it is 0 again
+// the cursor counts in reversed bit order, so buckets visited before a resize
+// map to buckets that are visited before the cursor after it: every key present
+// for the whole scan is seen at least once, some may be seen twice
+// f must not modify the hashmap, the hashmap may change between calls
+uint64_t hash_map_scan(HashMap *hash_map, uint64_t cursor, void (*f)(HashNode *, void *), void *arg) {
+    HashTable *small { &hash_map->newer };
+    HashTable *large { &hash_map->older };
+    if (!large->table) {
+        if (!small->table) {
+            return 0;
+        }
+        scan_bucket(small, cursor & small->mask, f, arg);
+        return scan_next(cursor, small->mask);
+    }
+    if (small->mask > large->mask) {
+        std::swap(small, large);
+    }
+
+    scan_bucket(small, cursor & small->mask, f, arg);
+    do {
+        scan_bucket(large, cursor & large->mask, f, arg);
+        cursor = scan_next(cursor, large->mask);
+    } while (cursor & (small->mask ^ large->mask));
+    return cursor;
+}
+
+static void table_chains(HashTable *hash_table, size_t *hist, size_t n) {
+    for (size_t pos = 0; hash_table->table && pos <= hash_table->mask; ++pos) {
+        size_t len { 0 };
+        for (HashNode *node = bucket_head(hash_table->table[pos]); node != nullptr; node = node_next(node)) {
+            len++;
+        }
+        hist[len < n ? len : n - 1]++;
+    }
+}
+
+// counts the buckets of both tables by chain length into hist[0..n),
+// the last slot counting chains of n - 1 keys or more
+void hash_map_chains(HashMap *hash_map, size_t *hist, size_t n) {
+    memset(hist, 0, n * sizeof(size_t));
+    table_chains(&hash_map->newer, hist, n);
+    table_chains(&hash_map->older, hist, n);
+}
+
+// bytes of the bucket arrays and of the nodes embedded in the keys
+size_t hash_map_index_bytes(HashMap *hash_map) {
+    size_t buckets { 0 };
+    if (hash_map->newer.table) {
+        buckets += hash_map->newer.mask + 1;
+    }
+    if (hash_map->older.table) {
+        buckets += hash_map->older.mask + 1;
+    }
+    return buckets * sizeof(uint64_t) + hash_map_size(hash_map) * sizeof(HashNode);
+}
+
+// hash bits the filter of the newest table is picked by, fewer than the
+// layout's own once a compact table outgrows the hash
+size_t hash_map_filter_bits(HashMap *hash_map) {
+    return hash_map->newer.table ? filter_hash_bits(hash_map->newer.mask) : K_FILTER_HASH_BITS;
+}
+
+// name of the node layout compiled in
+const char *hash_map_layout() {
+#ifdef HASH_COMPACT
+    return "compact";
+#else
+    return "pointer";
+#endif
+}
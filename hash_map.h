@@ -3,26 +3,68 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// tunables, changes take effect at the next insert or migration step
+extern size_t g_hash_max_load_factor;
+extern size_t g_hash_rehashing_work;
+
+// random per process, so colliding keys cannot be precomputed
+extern uint64_t g_hash_seed;
+
+uint64_t hash_bytes(const void *data, size_t len);
+
+#ifdef HASH_COMPACT
+// compact layout: nodes link by 32-bit references into a slab instead of by
+// pointers, and keep the low half of the hash, 8 bytes instead of 16
+// a node must be the first member of an object from hash_slab_alloc
+struct HashNode {
+    uint32_t next { 0 }; // slab reference of the next node, 0 for none
+    uint32_t hash_code { 0 }; // low bits of the hash value
+};
+
+// objects of one size, addressed by the references nodes link with
+// freed slots are reused but the slab's memory is never returned
+// safe to call from several threads
+void *hash_slab_alloc(size_t size);
+void hash_slab_free(void *ptr);
+#else
 // hashtable node, must be embedded into the payload
 struct HashNode {
     HashNode *next;
     uint64_t hash_code { 0 }; // hash value
 };
+#endif
 
 // fix-sized hashtable
+// a bucket holds the link to its first node in the low bits and, in the
+// bits a link leaves unused, one bit per value of the hash bits above the
+// index of its nodes so most missing keys are rejected without walking the chain
 struct HashTable {
-    HashNode **table { nullptr };
+    uint64_t *table { nullptr };
     size_t mask { 0 }; // power of 2 of the array size
     size_t size = { 0 }; // number of keys in the table
 };
 
+// the next table of a growing hashmap, being allocated on a helper thread
+struct HashPrealloc;
+
 // Re-sizable hashmap
 struct HashMap {
     HashTable newer;
     HashTable older;
     size_t migrate_pos { 0 };
+    HashPrealloc *prealloc { nullptr };
 };
 
 HashNode *hash_map_lookup(HashMap *hash_map, HashNode *key, bool (*eq)(HashNode *, HashNode *));
 HashNode *hash_map_delete(HashMap *hash_map, HashNode *key, bool (*eq)(HashNode *, HashNode *));
-void hash_map_insert(HashMap *hash_map, HashNode *node);
\ No newline at end of file
+void hash_map_insert(HashMap *hash_map, HashNode *node);
+void hash_map_reserve(HashMap *hash_map, size_t n);
+void hash_map_insert_bulk(HashMap *hash_map, HashNode *node);
+void hash_map_insert_parallel(HashMap *hash_map, HashNode **nodes, size_t n, size_t threads);
+void hash_map_foreach(HashMap *hash_map, bool (*f)(HashNode *, void *), void *arg);
+size_t hash_map_size(HashMap *hash_map);
+uint64_t hash_map_scan(HashMap *hash_map, uint64_t cursor, void (*f)(HashNode *, void *), void *arg);
+void hash_map_chains(HashMap *hash_map, size_t *hist, size_t n);
+size_t hash_map_index_bytes(HashMap *hash_map);
+size_t hash_map_filter_bits(HashMap *hash_map);
+const char *hash_map_layout();
@@ -0,0 +1,62 @@
+#include "heap.h"
+
+static size_t heap_parent(size_t i) {
+    return (i + 1) / 2 - 1;
+}
+
+static size_t heap_left(size_t i) {
+    return i * 2 + 1;
+}
+
+static size_t heap_right(size_t i) {
+    return i * 2 + 2;
+}
+
+// moves the item at pos up while it is smaller than its parent
+static void heap_up(HeapItem *heap, size_t pos) {
+    HeapItem item { heap[pos] };
+    while (pos > 0 && heap[heap_parent(pos)].val > item.val) {
+        heap[pos] = heap[heap_parent(pos)];
+        *heap[pos].ref = pos;
+        pos = heap_parent(pos);
+    }
+    heap[pos] = item;
+    *heap[pos].ref = pos;
+}
+
+// moves the item at pos down while it is larger than one of its children
+static void heap_down(HeapItem *heap, size_t pos, size_t len) {
+    HeapItem item { heap[pos] };
+    while (true) {
+        size_t l { heap_left(pos) };
+        size_t r { heap_right(pos) };
+        size_t min_pos { pos };
+        uint64_t min_val { item.val };
+
+        if (l < len && heap[l].val < min_val) {
+            min_pos = l;
+            min_val = heap[l].val;
+        }
+        if (r < len && heap[r].val < min_val) {
+            min_pos = r;
+        }
+        if (min_pos == pos) {
+            break;
+        }
+
+        heap[pos] = heap[min_pos];
+        *heap[pos].ref = pos;
+        pos = min_pos;
+    }
+    heap[pos] = item;
+    *heap[pos].ref = pos;
+}
+
+// restores the heap order after the item at pos was added or changed
+void heap_update(HeapItem *heap, size_t pos, size_t len) {
+    if (pos > 0 && heap[heap_parent(pos)].val > heap[pos].val) {
+        heap_up(heap, pos);
+    } else {
+        heap_down(heap, pos, len);
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// binary min-heap item, ref points back to where the owner keeps its position
+struct HeapItem {
+    uint64_t val { 0 };
+    size_t *ref { nullptr };
+};
+
+void heap_update(HeapItem *heap, size_t pos, size_t len);
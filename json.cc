@@ -0,0 +1,624 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <charconv>
+#include "json.h"
+#include "buffer.h"
+
+// recursive descent parser over text[pos..]
+struct JsonParser {
+    const char *cur { nullptr };
+    const char *end { nullptr };
+    uint32_t max_depth { 0 };
+};
+
+static void skip_space(JsonParser &p) {
+    while (p.cur < p.end && (*p.cur == ' ' || *p.cur == '\t' || *p.cur == '\n' || *p.cur == '\r')) {
+        p.cur++;
+    }
+}
+
+static bool parse_literal(JsonParser &p, const char *word) {
+    size_t len { strlen(word) };
+    if (static_cast<size_t>(p.end - p.cur) < len || memcmp(p.cur, word, len) != 0) {
+        return false;
+    }
+    p.cur += len;
+    return true;
+}
+
+static bool parse_hex4(JsonParser &p, uint32_t &out) {
+    if (p.end - p.cur < 4) {
+        return false;
+    }
+    out = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c { *p.cur++ };
+        out <<= 4;
+        if (c >= '0' && c <= '9') {
+            out |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            out |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            out |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void put_utf8(std::string &out, uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+}
+
+// parses a quoted string, p.cur being on the opening quote
+static bool parse_string(JsonParser &p, std::string &out) {
+    p.cur++;
+    while (true) {
+        // copy the run up to the next quote, escape or control character
+        const char *start { p.cur };
+        while (p.cur < p.end && *p.cur != '"' && *p.cur != '\\' && static_cast<uint8_t>(*p.cur) >= 0x20) {
+            p.cur++;
+        }
+        out.append(start, p.cur);
+        if (p.cur == p.end || static_cast<uint8_t>(*p.cur) < 0x20) {
+            return false;
+        }
+        if (*p.cur++ == '"') {
+            return true;
+        }
+
+        if (p.cur == p.end) {
+            return false;
+        }
+        char c { *p.cur++ };
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            out.push_back(c);
+            break;
+        case 'b':
+            out.push_back('\b');
+            break;
+        case 'f':
+            out.push_back('\f');
+            break;
+        case 'n':
+            out.push_back('\n');
+            break;
+        case 'r':
+            out.push_back('\r');
+            break;
+        case 't':
+            out.push_back('\t');
+            break;
+        case 'u': {
+            uint32_t cp { 0 };
+            if (!parse_hex4(p, cp)) {
+                return false;
+            }
+            // a high surrogate must be followed by an escaped low one
+            if (cp >= 0xD800 && cp < 0xDC00) {
+                uint32_t lo { 0 };
+                if (!parse_literal(p, "\\u") || !parse_hex4(p, lo) || lo < 0xDC00 || lo >= 0xE000) {
+                    return false;
+                }
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            } else if (cp >= 0xDC00 && cp < 0xE000) {
+                return false;
+            }
+            put_utf8(out, cp);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+}
+
+static bool is_digit(const JsonParser &p) {
+    return p.cur < p.end && *p.cur >= '0' && *p.cur <= '9';
+}
+
+// checks the number grammar, then converts
+static bool parse_number(JsonParser &p, double &out) {
+    const char *start { p.cur };
+    if (p.cur < p.end && *p.cur == '-') {
+        p.cur++;
+    }
+    if (!is_digit(p)) {
+        return false;
+    }
+    if (*p.cur++ != '0') {
+        while (is_digit(p)) {
+            p.cur++;
+        }
+    }
+    if (p.cur < p.end && *p.cur == '.') {
+        p.cur++;
+        if (!is_digit(p)) {
+            return false;
+        }
+        while (is_digit(p)) {
+            p.cur++;
+        }
+    }
+    if (p.cur < p.end && (*p.cur == 'e' || *p.cur == 'E')) {
+        p.cur++;
+        if (p.cur < p.end && (*p.cur == '+' || *p.cur == '-')) {
+            p.cur++;
+        }
+        if (!is_digit(p)) {
+            return false;
+        }
+        while (is_digit(p)) {
+            p.cur++;
+        }
+    }
+
+    // from_chars rounds correctly without the copy strtod needs for a terminator
+    auto res { std::from_chars(start, p.cur, out) };
+    return res.ec == std::errc() && isfinite(out);
+}
+
+static bool parse_value(JsonParser &p, uint32_t depth, JsonNode &out) {
+    skip_space(p);
+    if (p.cur == p.end) {
+        return false;
+    }
+
+    switch (*p.cur) {
+    case 'n':
+        out.type = JSON_NULL;
+        return parse_literal(p, "null");
+    case 'f':
+        out.type = JSON_FALSE;
+        return parse_literal(p, "false");
+    case 't':
+        out.type = JSON_TRUE;
+        return parse_literal(p, "true");
+    case '"':
+        out.type = JSON_STR;
+        out.str = new std::string();
+        return parse_string(p, *out.str);
+    case '[': {
+        if (depth >= p.max_depth) {
+            return false;
+        }
+        p.cur++;
+        out.type = JSON_ARR;
+        out.arr = new std::vector<JsonNode>();
+        out.arr->reserve(4);
+        skip_space(p);
+        if (p.cur < p.end && *p.cur == ']') {
+            p.cur++;
+            return true;
+        }
+        while (true) {
+            out.arr->emplace_back();
+            if (!parse_value(p, depth + 1, out.arr->back())) {
+                return false;
+            }
+            skip_space(p);
+            if (p.cur == p.end) {
+                return false;
+            }
+            char c { *p.cur++ };
+            if (c == ']') {
+                return true;
+            } else if (c != ',') {
+                return false;
+            }
+        }
+    }
+    case '{': {
+        if (depth >= p.max_depth) {
+            return false;
+        }
+        p.cur++;
+        out.type = JSON_OBJ;
+        out.obj = new std::vector<JsonMember>();
+        out.obj->reserve(4);
+        skip_space(p);
+        if (p.cur < p.end && *p.cur == '}') {
+            p.cur++;
+            return true;
+        }
+        while (true) {
+            skip_space(p);
+            if (p.cur == p.end || *p.cur != '"') {
+                return false;
+            }
+            out.obj->emplace_back();
+            JsonMember &m { out.obj->back() };
+            if (!parse_string(p, m.key)) {
+                return false;
+            }
+            skip_space(p);
+            if (p.cur == p.end || *p.cur++ != ':') {
+                return false;
+            }
+            if (!parse_value(p, depth + 1, m.value)) {
+                return false;
+            }
+            skip_space(p);
+            if (p.cur == p.end) {
+                return false;
+            }
+            char c { *p.cur++ };
+            if (c == '}') {
+                return true;
+            } else if (c != ',') {
+                return false;
+            }
+        }
+    }
+    default:
+        out.type = JSON_NUM;
+        return parse_number(p, out.num);
+    }
+}
+
+// parses a whole document nested at most max_depth containers deep
+// on failure out is left as null with nothing allocated
+bool json_parse(const std::string &text, uint32_t max_depth, JsonNode &out) {
+    JsonParser p { text.data(), text.data() + text.size(), max_depth };
+    out = JsonNode();
+    bool ok { parse_value(p, 0, out) };
+    skip_space(p);
+    if (!ok || p.cur != p.end) {
+        json_free(out);
+        return false;
+    }
+    return true;
+}
+
+// frees the payload of a value, turning it into null
+void json_free(JsonNode &node) {
+    switch (node.type) {
+    case JSON_STR:
+        delete node.str;
+        break;
+    case JSON_ARR:
+        for (JsonNode &item : *node.arr) {
+            json_free(item);
+        }
+        delete node.arr;
+        break;
+    case JSON_OBJ:
+        for (JsonMember &m : *node.obj) {
+            json_free(m.value);
+        }
+        delete node.obj;
+        break;
+    }
+    node = JsonNode();
+}
+
+static void serialize_string(const std::string &s, std::string &out) {
+    out.push_back('"');
+    const char *cur { s.data() };
+    const char *end { cur + s.size() };
+    while (cur < end) {
+        // copy the run that needs no escaping in one go
+        const char *start { cur };
+        while (cur < end && *cur != '"' && *cur != '\\' && static_cast<uint8_t>(*cur) >= 0x20) {
+            cur++;
+        }
+        out.append(start, cur);
+        if (cur == end) {
+            break;
+        }
+
+        char c { *cur++ };
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (c == '\n') {
+            out.append("\\n");
+        } else if (c == '\t') {
+            out.append("\\t");
+        } else if (c == '\r') {
+            out.append("\\r");
+        } else {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", static_cast<uint8_t>(c));
+            out.append(buf);
+        }
+    }
+    out.push_back('"');
+}
+
+// the shortest text that reads back as the same double
+static void serialize_number(double v, std::string &out) {
+    char buf[32];
+    auto res { std::to_chars(buf, buf + sizeof(buf), v) };
+    out.append(buf, res.ptr);
+}
+
+// appends the compact text of a value
+void json_serialize(const JsonNode &node, std::string &out) {
+    switch (node.type) {
+    case JSON_NULL:
+        out.append("null");
+        break;
+    case JSON_FALSE:
+        out.append("false");
+        break;
+    case JSON_TRUE:
+        out.append("true");
+        break;
+    case JSON_NUM:
+        serialize_number(node.num, out);
+        break;
+    case JSON_STR:
+        serialize_string(*node.str, out);
+        break;
+    case JSON_ARR:
+        out.push_back('[');
+        for (size_t i = 0; i < node.arr->size(); ++i) {
+            if (i > 0) {
+                out.push_back(',');
+            }
+            json_serialize((*node.arr)[i], out);
+        }
+        out.push_back(']');
+        break;
+    case JSON_OBJ:
+        out.push_back('{');
+        for (size_t i = 0; i < node.obj->size(); ++i) {
+            if (i > 0) {
+                out.push_back(',');
+            }
+            serialize_string((*node.obj)[i].key, out);
+            out.push_back(':');
+            json_serialize((*node.obj)[i].value, out);
+        }
+        out.push_back('}');
+        break;
+    }
+}
+
+const char *json_type_name(const JsonNode &node) {
+    switch (node.type) {
+    case JSON_NULL:
+        return "null";
+    case JSON_FALSE:
+    case JSON_TRUE:
+        return "boolean";
+    case JSON_NUM:
+        return "number";
+    case JSON_STR:
+        return "string";
+    case JSON_ARR:
+        return "array";
+    default:
+        return "object";
+    }
+}
+
+// parses "$" followed by steps like .name, [3], [-1] or ["name"]
+bool json_parse_path(const std::string &path, std::vector<JsonStep> &out) {
+    if (path.empty() || path[0] != '$') {
+        return false;
+    }
+
+    size_t pos { 1 };
+    while (pos < path.size()) {
+        JsonStep step;
+        if (path[pos] == '.') {
+            size_t start { ++pos };
+            while (pos < path.size() && path[pos] != '.' && path[pos] != '[') {
+                pos++;
+            }
+            if (pos == start) {
+                return false;
+            }
+            step.key = path.substr(start, pos - start);
+        } else if (path[pos] == '[' && pos + 1 < path.size() && (path[pos + 1] == '"' || path[pos + 1] == '\'')) {
+            char quote { path[pos + 1] };
+            size_t start { pos + 2 };
+            size_t close { path.find(quote, start) };
+            if (close == std::string::npos || close + 1 >= path.size() || path[close + 1] != ']') {
+                return false;
+            }
+            step.key = path.substr(start, close - start);
+            pos = close + 2;
+        } else if (path[pos] == '[') {
+            size_t close { path.find(']', pos) };
+            if (close == std::string::npos) {
+                return false;
+            }
+            std::string num { path.substr(pos + 1, close - pos - 1) };
+            char *end { nullptr };
+            step.is_index = true;
+            step.index = strtoll(num.c_str(), &end, 10);
+            if (num.empty() || *end != '\0') {
+                return false;
+            }
+            pos = close + 1;
+        } else {
+            return false;
+        }
+        out.push_back(std::move(step));
+    }
+    return out.size() < K_JSON_MAX_DEPTH;
+}
+
+// resolves one step against a container, null if it does not apply
+static JsonNode *find_child(JsonNode *node, const JsonStep &step) {
+    if (step.is_index && node->type == JSON_ARR) {
+        int64_t size { static_cast<int64_t>(node->arr->size()) };
+        int64_t i { step.index < 0 ? step.index + size : step.index };
+        return i >= 0 && i < size ? &(*node->arr)[i] : nullptr;
+    }
+    if (!step.is_index && node->type == JSON_OBJ) {
+        // members are few per object in practice, a scan beats a side index
+        for (JsonMember &m : *node->obj) {
+            if (m.key == step.key) {
+                return &m.value;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// finds the value at a path, null if it does not exist
+JsonNode *json_find(JsonNode *root, const std::vector<JsonStep> &path) {
+    JsonNode *node { root };
+    for (size_t i = 0; i < path.size() && node; ++i) {
+        node = find_child(node, path[i]);
+    }
+    return node;
+}
+
+// stores value at a path, replacing what is there
+// a missing last step adds an object member or appends at index size to an array
+// takes ownership of value on success, returns false if the parent does not exist
+bool json_set(JsonNode *root, const std::vector<JsonStep> &path, JsonNode &value) {
+    if (path.empty()) {
+        json_free(*root);
+        *root = value;
+        value = JsonNode();
+        return true;
+    }
+
+    std::vector<JsonStep> parent_path { path.begin(), path.end() - 1 };
+    JsonNode *parent { json_find(root, parent_path) };
+    if (!parent) {
+        return false;
+    }
+
+    const JsonStep &last { path.back() };
+    if (JsonNode *node = find_child(parent, last)) {
+        json_free(*node);
+        *node = value;
+    } else if (last.is_index && parent->type == JSON_ARR && last.index == static_cast<int64_t>(parent->arr->size())) {
+        parent->arr->push_back(value);
+    } else if (!last.is_index && parent->type == JSON_OBJ) {
+        parent->obj->push_back({ last.key, value });
+    } else {
+        return false;
+    }
+    value = JsonNode();
+    return true;
+}
+
+// removes the value at a non-root path, returns false if it does not exist
+bool json_del(JsonNode *root, const std::vector<JsonStep> &path) {
+    if (path.empty()) {
+        return false;
+    }
+    std::vector<JsonStep> parent_path { path.begin(), path.end() - 1 };
+    JsonNode *parent { json_find(root, parent_path) };
+    JsonNode *node { parent ? find_child(parent, path.back()) : nullptr };
+    if (!node) {
+        return false;
+    }
+
+    json_free(*node);
+    if (parent->type == JSON_ARR) {
+        parent->arr->erase(parent->arr->begin() + (node - parent->arr->data()));
+    } else {
+        auto it { parent->obj->begin() };
+        while (&it->value != node) {
+            ++it;
+        }
+        parent->obj->erase(it);
+    }
+    return true;
+}
+
+// serializes the tree as type tags followed by payloads, in document order
+void json_encode(const JsonNode &node, std::vector<uint8_t> &out) {
+    out.push_back(static_cast<uint8_t>(node.type));
+    switch (node.type) {
+    case JSON_NUM:
+        write_dbl(out, node.num);
+        break;
+    case JSON_STR:
+        write_str(out, *node.str);
+        break;
+    case JSON_ARR:
+        write_u32(out, static_cast<uint32_t>(node.arr->size()));
+        for (const JsonNode &item : *node.arr) {
+            json_encode(item, out);
+        }
+        break;
+    case JSON_OBJ:
+        write_u32(out, static_cast<uint32_t>(node.obj->size()));
+        for (const JsonMember &m : *node.obj) {
+            write_str(out, m.key);
+            json_encode(m.value, out);
+        }
+        break;
+    }
+}
+
+static bool decode_value(const uint8_t *&cur, const uint8_t *end, uint32_t depth, JsonNode &out) {
+    if (cur == end || *cur > JSON_OBJ) {
+        return false;
+    }
+    out.type = *cur++;
+    uint32_t n { 0 };
+    switch (out.type) {
+    case JSON_NUM:
+        return read_dbl(cur, end, out.num);
+    case JSON_STR:
+        out.str = new std::string();
+        return read_lstr(cur, end, *out.str);
+    case JSON_ARR:
+        out.arr = new std::vector<JsonNode>();
+        if (depth == 0 || !read_u32(cur, end, n)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            out.arr->emplace_back();
+            if (!decode_value(cur, end, depth - 1, out.arr->back())) {
+                return false;
+            }
+        }
+        return true;
+    case JSON_OBJ:
+        out.obj = new std::vector<JsonMember>();
+        if (depth == 0 || !read_u32(cur, end, n)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            out.obj->emplace_back();
+            JsonMember &m { out.obj->back() };
+            if (!read_lstr(cur, end, m.key) || !decode_value(cur, end, depth - 1, m.value)) {
+                return false;
+            }
+        }
+        return true;
+    default:
+        return true;
+    }
+}
+
+// loads a tree serialized by json_encode, nested at most depth containers deep
+bool json_decode(const uint8_t *&cur, const uint8_t *end, uint32_t depth, JsonNode &out) {
+    out = JsonNode();
+    if (!decode_value(cur, end, depth, out)) {
+        json_free(out);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// nesting limit of documents, which keeps the recursive walks off deep stacks
+const uint32_t K_JSON_MAX_DEPTH = 128;
+
+// value kinds
+enum {
+    JSON_NULL = 0,
+    JSON_FALSE = 1,
+    JSON_TRUE = 2,
+    JSON_NUM = 3,
+    JSON_STR = 4,
+    JSON_ARR = 5,
+    JSON_OBJ = 6,
+};
+
+struct JsonMember;
+
+// a parsed value, 16 bytes with the payload selected by type
+// containers and strings are owned, freed by json_free
+struct JsonNode {
+    uint32_t type { JSON_NULL };
+    union {
+        double num { 0 };
+        std::string *str;
+        std::vector<JsonNode> *arr;
+        std::vector<JsonMember> *obj; // members in document order
+    };
+};
+
+struct JsonMember {
+    std::string key;
+    JsonNode value;
+};
+
+// one step of a path: .key, ["key"] or [index], negative indexes count from the end
+struct JsonStep {
+    bool is_index { false };
+    std::string key;
+    int64_t index { 0 };
+};
+
+bool json_parse(const std::string &text, uint32_t max_depth, JsonNode &out);
+void json_free(JsonNode &node);
+void json_serialize(const JsonNode &node, std::string &out);
+const char *json_type_name(const JsonNode &node);
+
+bool json_parse_path(const std::string &path, std::vector<JsonStep> &out);
+JsonNode *json_find(JsonNode *root, const std::vector<JsonStep> &path);
+bool json_set(JsonNode *root, const std::vector<JsonStep> &path, JsonNode &value);
+bool json_del(JsonNode *root, const std::vector<JsonStep> &path);
+
+void json_encode(const JsonNode &node, std::vector<uint8_t> &out);
+bool json_decode(const uint8_t *&cur, const uint8_t *end, uint32_t depth, JsonNode &out);
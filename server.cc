@@ -5,6 +5,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <limits.h>
 // system
 #include <fcntl.h>
 #include <poll.h>
@@ -12,35 +15,242 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <dirent.h>
 // C++
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <map>
+#include <set>
+#include <thread>
+#include <unordered_set>
+#include <unordered_map>
 
 #include "hash_map.h"
+#include "config.h"
+#include "handoff.h"
+#include "heap.h"
+#include "buffer.h"
+#include "stream.h"
+#include "zset.h"
+#include "geo.h"
+#include "vector_index.h"
+#include "fulltext.h"
+#include "timeseries.h"
+#include "json.h"
+#include "sketch.h"
+#include "checksum.h"
 
 #define container_of(ptr, T, member) \
     ((T *)((char *)ptr - offsetof(T, member)))
 
-// maximum allowed message size
-const size_t K_MAX_MSG = 32 << 20;
+// Scheduling modes for connections with leftover requests
+enum {
+    SCHED_ROUND_ROBIN = 0, // serve in turn, rotating who goes first
+    SCHED_SMALL_FIRST = 1, // serve the connection with the smallest next request first
+};
+
+// Keyspace event classes, also the bits of the notify-events parameter
+enum {
+    NOTIFY_SET = 1 << 0,
+    NOTIFY_DEL = 1 << 1,
+    NOTIFY_EXPIRED = 1 << 2,
+    NOTIFY_EVICTED = 1 << 3,
+};
+
+// runtime configuration, names and limits are in g_config_params
+static struct {
+    uint64_t port { 1234 };
+    // maximum allowed message size
+    uint64_t max_msg { 32 << 20 };
+    // maximum allowed arguments for a command
+    uint64_t max_args { 200 * 1000 };
+    // bytes read from a socket at once
+    uint64_t read_buffer { 64 * 1024 };
+    // scheduling units a connection may spend per event loop iteration
+    uint64_t sched_budget { 128 };
+    // a request costs one unit, plus one unit for every this many bytes
+    uint64_t sched_unit_bytes { 4 * 1024 };
+    uint64_t sched_mode { SCHED_ROUND_ROBIN };
+    // per-connection rate limits, 0 means unlimited
+    uint64_t ratelimit_ops { 0 };
+    uint64_t ratelimit_bytes { 0 };
+    // pass client connections to the new process on restart
+    uint64_t handoff_clients { 1 };
+    // keyspace events published to subscribers, 0 disables notifications
+    uint64_t notify_events { 0 };
+    // subscribers with more unsent data than this are disconnected
+    uint64_t notify_max_buffer { 32 << 20 };
+    // maximum keys expired per event loop iteration
+    uint64_t expire_work { 2000 };
+    // candidates kept by vsearch, higher improves recall at the cost of speed
+    uint64_t vector_ef { 64 };
+    // bytes of keys and values full-text indexed per event loop iteration
+    uint64_t ft_index_work { 64 * 1024 };
+    // keys examined per event loop iteration by delprefix and delpattern
+    uint64_t delete_work { 1000 };
+    // records loaded per event loop iteration by import
+    uint64_t import_work { 10000 };
+    // threads decoding a snapshot on --takeover, 0 for one per core
+    uint64_t load_threads { 0 };
+    // keys examined per event loop iteration by bgsave
+    uint64_t save_work { 10000 };
+    // milliseconds a sync waits for more followers to share its save pass
+    uint64_t repl_sync_delay { 0 };
+    // followers with more unsent writes than this are disconnected
+    uint64_t repl_max_buffer { 256 << 20 };
+    // seconds between checkpoints once one was taken, 0 for only on request
+    uint64_t checkpoint_interval { 0 };
+    // deltas written on top of a base before the next checkpoint is a base
+    uint64_t checkpoint_deltas { 24 };
+    // milliseconds a get that misses holds the lease to fill the key, and a
+    // deleted string is served stale, 0 disables leases
+    uint64_t lease_ttl { 0 };
+    // directory the files named by bgsave, checkpoint and import are in
+    std::string dir { "." };
+} g_config;
+
+static ConfigParam g_config_params[] = {
+    { "port", &g_config.port, 1, 65535, false },
+    { "max-msg", &g_config.max_msg, 4096, 1ull << 31 },
+    { "max-args", &g_config.max_args, 1, 1ull << 31 },
+    { "read-buffer", &g_config.read_buffer, 4096, 64 << 20 },
+    { "sched-budget", &g_config.sched_budget, 1, UINT32_MAX },
+    { "sched-unit-bytes", &g_config.sched_unit_bytes, 1, UINT32_MAX },
+    { "sched-mode", &g_config.sched_mode, SCHED_ROUND_ROBIN, SCHED_SMALL_FIRST },
+    { "ratelimit-ops", &g_config.ratelimit_ops, 0, UINT64_MAX },
+    { "ratelimit-bytes", &g_config.ratelimit_bytes, 0, UINT64_MAX },
+    { "handoff-clients", &g_config.handoff_clients, 0, 1 },
+    { "notify-events", &g_config.notify_events, 0, NOTIFY_SET | NOTIFY_DEL | NOTIFY_EXPIRED | NOTIFY_EVICTED },
+    { "notify-max-buffer", &g_config.notify_max_buffer, 4096, UINT64_MAX },
+    { "expire-work", &g_config.expire_work, 1, UINT32_MAX },
+    { "vector-ef", &g_config.vector_ef, 1, 1 << 16 },
+    { "ft-index-work", &g_config.ft_index_work, 1, UINT64_MAX },
+    { "delete-work", &g_config.delete_work, 1, UINT32_MAX },
+    { "import-work", &g_config.import_work, 1, UINT32_MAX },
+    { "load-threads", &g_config.load_threads, 0, 1024 },
+    { "save-work", &g_config.save_work, 1, UINT32_MAX },
+    { "repl-sync-delay", &g_config.repl_sync_delay, 0, 3600 * 1000 },
+    { "repl-max-buffer", &g_config.repl_max_buffer, 1 << 20, UINT64_MAX },
+    { "checkpoint-interval", &g_config.checkpoint_interval, 0, UINT32_MAX },
+    { "checkpoint-deltas", &g_config.checkpoint_deltas, 0, UINT32_MAX },
+    { "lease-ttl", &g_config.lease_ttl, 0, 3600 * 1000 },
+    { "dir", nullptr, 0, 0, false, &g_config.dir },
+    { "hash-max-load-factor", &g_hash_max_load_factor, 1, 1024 },
+    { "hash-rehashing-work", &g_hash_rehashing_work, 1, UINT32_MAX },
+};
 
-// maximum allowed arguments for a command
-const size_t K_MAX_ARGS = 200 * 1000;
+static ConfigTable g_config_table {
+    g_config_params, sizeof(g_config_params) / sizeof(g_config_params[0])
+};
 
-static std::map<std::string, std::string> g_data;
+// token bucket holding at most one second worth of tokens
+struct TokenBucket {
+    double tokens { 0 };
+    uint64_t last_us { 0 };
+};
 
-// TODO: replace g_data with this implementation
 // top-level hashmap
 static struct {
-    HashMap* db;
-} g_data_2;
+    HashMap db;
+    // expiration times of keys with a TTL
+    std::vector<HeapItem> heap;
+} g_data;
+
+// Value types
+enum {
+    T_STR = 0,
+    T_STREAM = 1,
+    T_ZSET = 2,
+    T_VECSET = 3,
+    T_TS = 4,
+    T_JSON = 5,
+    T_CMS = 6,
+    T_TOPK = 7,
+};
+
+// the value a key had before a write, kept for snapshots opened before it
+struct EntryVersion {
+    uint64_t saved_at { 0 }; // version of the newest snapshot when saved
+    bool existed { false };
+    uint32_t type { 0 };
+    std::vector<uint8_t> value; // as serialized by entry_encode_value
+    EntryVersion *next { nullptr };
+};
+
+struct Entry;
+
+// the right to fill a missing key, and the value it had if it was a deleted string
+struct Lease {
+    Entry *ent { nullptr }; // the entry of the key
+    uint64_t token { 0 };   // 0 until a get misses
+    uint64_t until_us { 0 };
+    size_t heap_idx { (size_t)-1 }; // position in g_leases, -1 until armed
+    bool has_stale { false };
+    std::string stale;
+};
 
 // key-value entry pair
 struct Entry {
     struct HashNode node;
     std::string key;
+    uint32_t type { T_STR };
     std::string value;
+    // payload of the other types, selected by type
+    union {
+        Stream *stream { nullptr };
+        ZSet *zset;
+        VecIndex *vec;
+        TimeSeries *ts;
+        JsonNode *json;
+        CmsSketch *cms;
+        TopK *topk;
+    };
+    // position in the TTL heap, -1 if the key does not expire
+    size_t heap_idx { (size_t)-1 };
+    // values the key had when open snapshots were taken, newest first
+    EntryVersion *versions { nullptr };
+    // set while the key is missing and a lease on it is out
+    Lease *lease { nullptr };
+    // deleted but kept in the keyspace for the snapshots or the lease that still see it
+    bool deleted { false };
+    // equal to the save's epoch once written by it, or if created after it began
+    uint32_t save_epoch { 0 };
+#ifdef HASH_COMPACT
+    // the keyspace links entries by their slab references, node first
+    static void *operator new(size_t size) { return hash_slab_alloc(size); }
+    static void operator delete(void *ptr) { hash_slab_free(ptr); }
+#endif
+};
+
+// keyspace events of the current event loop iteration, delivered as one batch
+static struct {
+    std::vector<std::pair<uint32_t, std::string>> events;
+    // the latest event of each key in the batch
+    std::unordered_map<std::string, uint32_t> last;
+    size_t subscribers { 0 };
+} g_notify;
+
+// states of a follower's link to its primary
+enum {
+    LINK_ACK = 0, // sync sent, waiting for the reply
+    LINK_HEADER = 1, // receiving the snapshot: its header,
+    LINK_CHUNKS = 2, // its chunks,
+    LINK_TRAILER = 3, // and the text index definitions
+    LINK_STREAM = 4, // executing the writes of the primary
+};
+
+// states of a follower connection on its primary
+enum {
+    REPL_NONE = 0, // not a follower
+    REPL_WAIT = 1, // asked for a sync, waiting for the next save pass
+    REPL_SYNC = 2, // receiving the snapshot of the save pass
+    REPL_STREAM = 3, // receiving writes as they are executed
 };
 
 // Representation for a single client connection
@@ -50,16 +260,191 @@ struct Conn {
     bool want_read { false }; 
     bool want_write { false };
     bool want_close { false };
+    // complete requests are left over after the connection used up its budget
+    bool has_pending { false };
+    // rate limiting, reads are paused until throttled_until_us
+    TokenBucket ops_bucket;
+    TokenBucket bytes_bucket;
+    uint64_t throttled_until_us { 0 };
+    // receives keyspace events for keys starting with sub_prefix
+    bool subscribed { false };
+    std::string sub_prefix;
+    // a blocking command waits for a write to one of block_keys, then its
+    // request (kept buffered, resolved into block_cmd) runs again
+    bool blocked { false };
+    bool block_timed_out { false };
+    uint64_t block_deadline_us { 0 };
+    std::vector<std::string> block_keys;
+    std::vector<std::string> block_cmd;
+    // a follower, writes made while its snapshot is sent wait in repl_backlog
+    uint32_t repl_state { REPL_NONE };
+    std::vector<uint8_t> repl_backlog;
+    // ids of the snapshots it opened, closed with it
+    std::vector<uint64_t> snapshots;
     // input and output buffers
     std::vector<uint8_t> incoming;   
     std::vector<uint8_t> outgoing; 
 };
 
+// connections blocked on each key
+static std::unordered_map<std::string, std::vector<Conn *>> g_blocked;
+
+// a full-text index and the keys it has yet to catch up on
+// writes only queue their key, the event loop indexes a bounded amount per iteration
+struct TextIndex {
+    FtIndex ft;
+    std::deque<std::string> pending;
+    std::unordered_set<std::string> queued;
+    // keys that existed before the index are found by a keyspace scan
+    bool scanning { true };
+    uint64_t scan_cursor { 0 };
+    bool compacting { false };
+};
+
+// full-text indexes by name
+static std::map<std::string, TextIndex *> g_text_indexes;
+
+// a background deletion of the keys matching a prefix or glob pattern
+// keys written while it runs are deleted too if the scan reaches them
+struct DeleteTask {
+    std::string pattern;
+    bool is_prefix { false };
+    bool running { true };
+    bool cancelled { false };
+    uint64_t cursor { 0 };
+    uint64_t scanned { 0 };
+    uint64_t deleted { 0 };
+};
+
+// deletion tasks by id, finished ones are kept for a while to report on
+static std::map<uint64_t, DeleteTask *> g_delete_tasks;
+static uint64_t g_next_delete_task { 1 };
+
+// a background load of string keys from a local file of records
+// (klen u32, key, vlen u32, value), little-endian like the protocol
+struct ImportTask {
+    std::string path;
+    int fd { -1 };
+    bool running { true };
+    std::string error;
+    uint64_t file_size { 0 };
+    std::vector<uint8_t> buf; // read but not yet loaded
+    size_t buf_pos { 0 };
+    bool eof { false };
+    uint64_t keys { 0 };
+    uint64_t bytes { 0 }; // of the records loaded
+};
+
+// import tasks by id, finished ones are kept for a while to report on
+static std::map<uint64_t, ImportTask *> g_import_tasks;
+static uint64_t g_next_import_task { 1 };
+
+// snapshot header
+const uint32_t K_SNAPSHOT_MAGIC = 0x42444b4d; // "MKDB"
+const uint32_t K_SNAPSHOT_VERSION = 8;
+// most keys per chunk, the unit snapshot loading decodes in parallel
+const uint64_t K_SNAPSHOT_CHUNK_KEYS = 64 * 1024;
+// smallest encoded key: key length, ttl and type
+const size_t K_SNAPSHOT_MIN_ENTRY = 4 + 8 + 4;
+// delta checkpoint header, its records are chunked like a snapshot's
+const uint32_t K_DELTA_MAGIC = 0x4c444b4d; // "MKDL"
+// type of a delta record for a key deleted since the previous checkpoint
+const uint32_t K_DELTA_DELETED = UINT32_MAX;
+
+// what a save pass writes
+enum {
+    SAVE_FILE = 0, // a snapshot for bgsave or followers
+    SAVE_BASE = 1, // a snapshot starting a series of checkpoints
+    SAVE_DELTA = 2, // the keys of g_checkpoint.keys
+};
+
+// a fork-less save of the keyspace, as of the moment it started, to a file
+// and to the followers syncing from it
+// the event loop writes the keys in slices of a keyspace scan, and a key about
+// to change before the scan reaches it is written first, with its old value
+static struct {
+    bool running { false };
+    uint32_t kind { SAVE_FILE };
+    uint32_t epoch { 0 }; // entries written by the current save carry it
+    std::string path; // empty if the save only goes to followers
+    int fd { -1 }; // of path.tmp, renamed to path once complete
+    uint64_t cursor { 0 };
+    uint64_t nkeys { 0 }; // when it started, each is written exactly once
+    uint64_t written { 0 };
+    uint64_t preimages { 0 }; // keys written ahead of the scan
+    std::vector<uint8_t> buf; // the chunk being written, behind its header
+    uint64_t chunk_keys { 0 };
+    std::string error; // of the last save
+} g_bgsave;
+
+// incremental checkpoints to a directory: a base snapshot, then deltas with
+// the keys written since the previous checkpoint, changed or deleted
+// the files are <series>.base and <series>.<seq>.delta, the series being
+// the time its base was started in milliseconds
+static struct {
+    std::string dir;
+    uint64_t series { 0 };
+    uint64_t seq { 0 }; // of the last delta
+    // dirty holds every key written since the last checkpoint began, a
+    // checkpoint without it is a base
+    bool tracking { false };
+    std::unordered_set<std::string> dirty;
+    // the keys of the delta being written, and those it has yet to write
+    std::vector<std::string> keys;
+    std::unordered_set<std::string> pending;
+    uint64_t last_us { 0 }; // when the last checkpoint began
+} g_checkpoint;
+
+// replication: a follower connects to its primary and asks for a sync, the
+// primary streams it a snapshot from a save pass, followed by the writes it
+// executes from then on; no reads, writes or snapshots touch the disk
+static struct {
+    // primary side: the connections of followers, in any REPL_ state
+    std::vector<Conn *> followers;
+    uint64_t wait_since_us { 0 }; // when the oldest waiting follower asked
+    // follower side: the primary and the connection to it, host is empty
+    // unless this server is a follower
+    std::string host;
+    uint64_t port { 0 };
+    Conn *link { nullptr };
+    uint32_t link_state { 0 };
+    uint64_t keys_left { 0 }; // of the snapshot being received
+    uint64_t retry_at_us { 0 };
+    uint64_t syncs { 0 }; // full syncs completed
+} g_repl;
+
+// consistent views of the keyspace: a snapshot sees the values keys had when
+// it was opened, writes save the previous value in Entry::versions first
+static struct {
+    std::map<uint64_t, uint64_t> snapshots; // id -> version
+    std::set<uint64_t> open_versions;
+    uint64_t version { 0 };  // of the newest snapshot
+    uint64_t next_id { 1 };
+    std::vector<Entry *> versioned; // entries with saved versions
+    size_t tombstones { 0 };        // deleted entries kept in the keyspace
+} g_mvcc;
+
+// leases handed out or stale values kept, a min-heap by when they end
+static std::vector<HeapItem> g_leases;
+static uint64_t g_next_lease { 1 };
+
 // Possible Response statuses
 enum {
     RES_OK = 0,
     RES_ERR = 1, // error
     RES_NX = 2, // key not found
+    RES_ARR = 3, // data is a tagged array
+    RES_PUSH = 4, // unsolicited keyspace event batch, data is a tagged array
+    RES_STALE = 5, // value of a deleted string key, while another client fills it
+};
+
+// Tags of values in RES_ARR and RES_PUSH data
+enum {
+    TAG_NIL = 0,
+    TAG_STR = 1, // len str
+    TAG_INT = 2, // int64
+    TAG_DBL = 3, // double
+    TAG_ARR = 4, // n value1 value2 ...
 };
 
 // Representation for a server response
@@ -82,6 +467,56 @@ static void die(const char *msg) {
     abort();
 }
 
+// current time from a monotonic clock in microseconds
+static uint64_t get_monotonic_usec() {
+    struct timespec tv { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+// current wall clock time in milliseconds
+static uint64_t get_realtime_msec() {
+    struct timespec tv { 0, 0 };
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000000;
+}
+
+// milliseconds until a deadline for poll, rounded up, at most INT_MAX so
+// far-off deadlines don't wrap to a timeout of 0
+static int poll_wait_ms(uint64_t at_us, uint64_t now_us) {
+    uint64_t ms { (std::max(at_us, now_us) - now_us + 999) / 1000 };
+    return static_cast<int>(std::min<uint64_t>(ms, INT_MAX));
+}
+
+// refills the bucket without taking from it
+// returns 0 if the bucket has tokens left, else the microseconds until it does
+static uint64_t bucket_wait(TokenBucket &bucket, uint64_t rate, uint64_t now_us) {
+    if (rate == 0) {
+        return 0;
+    }
+
+    if (bucket.last_us == 0) {
+        bucket.tokens = static_cast<double>(rate); // start with a full bucket
+    } else {
+        double refill { static_cast<double>(now_us - bucket.last_us) * rate / 1e6 };
+        bucket.tokens = std::min(bucket.tokens + refill, static_cast<double>(rate));
+    }
+    bucket.last_us = now_us;
+
+    if (bucket.tokens <= 0) {
+        return static_cast<uint64_t>(-bucket.tokens * 1e6 / rate) + 1;
+    }
+    return 0;
+}
+
+// takes cost tokens from a bucket bucket_wait let through
+// a request larger than the bucket puts it into debt
+static void bucket_take(TokenBucket &bucket, uint64_t rate, double cost) {
+    if (rate != 0) {
+        bucket.tokens -= cost;
+    }
+}
+
 // set a file descriptor to non-blocking mode 
 static void fd_set_nb(int fd) {
     errno = 0;
@@ -108,36 +543,26 @@ static bool entry_eq(HashNode *lhs, HashNode *rhs) {
     return le->key == re->key;
 }
 
-// append to the back of a buffer
-static void buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t len) {
-    buf.insert(buf.end(), data, data + len);
+// hash code of a key in the top-level hashmap
+static uint64_t key_hash(const std::string &key) {
+    return hash_bytes(key.data(), key.size());
 }
 
-// remove from the front of a buffer
-static void buf_consume(std::vector<uint8_t> &buf, size_t n) {
-    buf.erase(buf.begin(), buf.begin() + n);
-}
-
-// reads a unsigned 32 byte int from cur into out
-static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
-    if (cur + 4 > end) {
-        return false;
-    }
+// finds the entry for a key, including deleted ones kept for snapshots
+static Entry *entry_lookup_any(const std::string &key) {
+    Entry probe;
+    probe.key = key;
+    probe.node.hash_code = key_hash(key);
 
-    memcpy(&out, cur, 4);
-    cur += 4;
-    return true;
+    HashNode *node { hash_map_lookup(&g_data.db, &probe.node, &entry_eq) };
+    return node ? container_of(node, Entry, node) : nullptr;
 }
 
-// reads in a string of length len from cur into out
-static bool read_str(const uint8_t *&cur, const uint8_t *end, size_t len, std::string &out) {
-    if (cur + len > end) {
-        return false;
-    }
-    
-    out.assign(cur, cur + len);
-    cur += len;
-    return true;
+// finds the entry for a key even if its TTL has passed, for bookkeeping
+// that must not change the keyspace, returns null if it does not exist
+static Entry *entry_peek(const std::string &key) {
+    Entry *ent { entry_lookup_any(key) };
+    return ent && !ent->deleted ? ent : nullptr;
 }
 
 // parses a request that contains a list of strings
@@ -151,7 +576,7 @@ static int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::stri
         return -1;
     }
 
-    if (nstr > K_MAX_ARGS) {
+    if (nstr > g_config.max_args) {
         return -1;
     }
 
@@ -176,212 +601,5084 @@ static int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::stri
     return 0;
 }
 
-// handles a single database request and stores into out
-// 3 cases: get, set, del
-static void do_request(std::vector<std::string> &cmd, Response &out) {
-    if (cmd.size() == 2 && cmd[0] == "get") {
-        auto it { g_data.find(cmd[1]) };
-        if (it == g_data.end()) {
-            out.status = RES_NX; // not found
-            return;
-        }
-        const std::string &val = it->second;
-        out.data.assign(val.begin(), val.end());
-    } else if (cmd.size() == 3 && cmd[0] == "set") {
-        g_data[cmd[1]].swap(cmd[2]);
-    } else if (cmd.size() == 2 && cmd[0] == "del") {
-        g_data.erase(cmd[1]);
-    } else {
-        out.status = RES_ERR; // unrecognized command
-    }
+// appends a tagged integer
+static void out_int(std::vector<uint8_t> &buf, int64_t v) {
+    buf.push_back(TAG_INT);
+    write_u64(buf, static_cast<uint64_t>(v));
 }
 
-// serialize the response
-static void make_response(const Response &resp, std::vector<uint8_t> &out) {
-    uint32_t resp_len { 4 + static_cast<uint32_t>(resp.data.size())};
-    buf_append(out, reinterpret_cast<const uint8_t *>(&resp_len), 4);
-    buf_append(out, reinterpret_cast<const uint8_t *>(&resp.status), 4);
-    buf_append(out, resp.data.data(), resp.data.size());
+// appends a tagged double
+static void out_dbl(std::vector<uint8_t> &buf, double v) {
+    buf.push_back(TAG_DBL);
+    write_dbl(buf, v);
 }
 
-// handles one client request
-static bool try_one_request(Conn *conn) {
-    // grab the length
-    if (conn->incoming.size() < 4) {
-        return false;
-    }
+// appends a tagged string
+static void out_str(std::vector<uint8_t> &buf, const uint8_t *data, size_t len) {
+    buf.push_back(TAG_STR);
+    write_str(buf, data, len);
+}
 
-    uint32_t len { 0 };
-    memcpy(&len, conn->incoming.data(), 4);
+static void out_str(std::vector<uint8_t> &buf, const std::string &s) {
+    out_str(buf, reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
 
-    if (len > K_MAX_MSG) {
-        msg("too long");
-        conn->want_close = true;
-        return false;
+// appends the header of a tagged array of n values
+static void out_arr(std::vector<uint8_t> &buf, uint32_t n) {
+    buf.push_back(TAG_ARR);
+    write_u32(buf, n);
+}
+
+// starts an array whose size is not known yet, returns a context for out_end_arr
+static size_t out_begin_arr(std::vector<uint8_t> &buf) {
+    out_arr(buf, 0);
+    return buf.size() - 4;
+}
+
+// fills in the size of an array started with out_begin_arr
+static void out_end_arr(std::vector<uint8_t> &buf, size_t ctx, uint32_t n) {
+    assert(buf[ctx - 1] == TAG_ARR);
+    memcpy(&buf[ctx], &n, 4);
+}
+
+// queues a keyspace event for the current batch
+// an event repeating the key's latest one in the batch is dropped, so
+// set, set is delivered as set but set, del, set as all three
+static void notify(uint32_t event, const std::string &key) {
+    if (!(g_config.notify_events & event) || g_notify.subscribers == 0) {
+        return;
     }
 
-    // grab the request body
-    if (4 + len > conn->incoming.size()) {
-        return false;
+    auto [it, added] { g_notify.last.try_emplace(key, event) };
+    if (added || it->second != event) {
+        it->second = event;
+        g_notify.events.emplace_back(event, key);
     }
+}
 
-    const uint8_t *request { &conn->incoming[4] };
+// queues a changed key for the full-text indexes covering it
+static void text_touch(const std::string &key) {
+    for (auto &[name, ti] : g_text_indexes) {
+        if (key.compare(0, ti->ft.prefix.size(), ti->ft.prefix) == 0 && ti->queued.insert(key).second) {
+            ti->pending.push_back(key);
+        }
+    }
+}
 
-    // parse the request
-    std::vector<std::string> cmd;
-    if (parse_req(request, len, cmd) < 0) {
-        conn->want_close = true;
-        return false;
+static const char *notify_name(uint32_t event) {
+    switch (event) {
+    case NOTIFY_SET: return "set";
+    case NOTIFY_DEL: return "del";
+    case NOTIFY_EXPIRED: return "expired";
+    case NOTIFY_EVICTED: return "evicted";
     }
+    return "?";
+}
 
-    // execute the request
-    Response resp;
-    do_request(cmd, resp);
+// sets the expiration time of an entry, ttl_ms < 0 removes it
+static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
+    std::vector<HeapItem> &heap { g_data.heap };
 
-    // serialize the response
-    make_response(resp, conn->outgoing);
+    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
+        // move the last item into the hole
+        size_t pos { ent->heap_idx };
+        heap[pos] = heap.back();
+        heap.pop_back();
+        if (pos < heap.size()) {
+            heap_update(heap.data(), pos, heap.size());
+        }
+        ent->heap_idx = (size_t)-1;
+    } else if (ttl_ms >= 0) {
+        size_t pos { ent->heap_idx };
+        if (pos == (size_t)-1) {
+            pos = heap.size();
+            heap.push_back(HeapItem());
+        }
+        heap[pos].val = get_monotonic_usec() + static_cast<uint64_t>(ttl_ms) * 1000;
+        heap[pos].ref = &ent->heap_idx;
+        heap_update(heap.data(), pos, heap.size());
+    }
+}
 
-    buf_consume(conn->incoming, 4 + len);
+// milliseconds until the entry expires, -1 if it has no TTL
+static int64_t entry_ttl(Entry *ent) {
+    if (ent->heap_idx == (size_t)-1) {
+        return -1;
+    }
 
-    return true;
+    uint64_t expire_at { g_data.heap[ent->heap_idx].val };
+    uint64_t now_us { get_monotonic_usec() };
+    return expire_at > now_us ? static_cast<int64_t>((expire_at - now_us) / 1000) : 0;
 }
 
-// accepts a new client connection on given file descriptor
-// sets the fd to non-blocking mode and creates the Conn object
-static Conn *handle_accept(int fd) {
-    struct sockaddr_in client_addr { {} };
-    socklen_t addrlen { sizeof(client_addr) };
-    
-    int connfd = accept(fd, reinterpret_cast<struct sockaddr *>(&client_addr), &addrlen);
-    if (connfd < 0) {
-        msg_errno("accept() error");
-        return NULL;
+// frees the payload of a non-string entry, turning it into an empty string
+static void entry_reset(Entry *ent) {
+    switch (ent->type) {
+    case T_STREAM:
+        delete ent->stream;
+        break;
+    case T_ZSET:
+        delete ent->zset;
+        break;
+    case T_VECSET:
+        delete ent->vec;
+        break;
+    case T_TS:
+        delete ent->ts;
+        break;
+    case T_JSON:
+        json_free(*ent->json);
+        delete ent->json;
+        break;
+    case T_CMS:
+        delete ent->cms;
+        break;
+    case T_TOPK:
+        delete ent->topk;
+        break;
     }
+    ent->type = T_STR;
+    ent->stream = nullptr;
+    ent->value.clear();
+}
 
-    // just for debugging
-    uint32_t ip { client_addr.sin_addr.s_addr };
-    fprintf(stderr, "new client from %u.%u.%u.%u:%u\n",
-        ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
-        ntohs(client_addr.sin_port)
-    );
+// serializes the value of an entry according to its type
+static void entry_encode_value(Entry *ent, std::vector<uint8_t> &out) {
+    switch (ent->type) {
+    case T_STR:
+        write_str(out, ent->value);
+        break;
+    case T_STREAM:
+        stream_encode(ent->stream, out);
+        break;
+    case T_ZSET:
+        zset_encode(ent->zset, out);
+        break;
+    case T_VECSET:
+        vec_encode(ent->vec, out);
+        break;
+    case T_TS:
+        ts_encode(ent->ts, out);
+        break;
+    case T_JSON:
+        json_encode(*ent->json, out);
+        break;
+    case T_CMS:
+        cms_encode(ent->cms, out);
+        break;
+    case T_TOPK:
+        topk_encode(ent->topk, out);
+        break;
+    }
+}
 
-    fd_set_nb(connfd);
+// loads a value serialized by entry_encode_value into a new entry
+static bool entry_decode_value(const uint8_t *&cur, const uint8_t *end, uint32_t type, Entry *ent) {
+    ent->type = type;
+    switch (type) {
+    case T_STR:
+        return read_lstr(cur, end, ent->value);
+    case T_STREAM:
+        ent->stream = new Stream();
+        return stream_decode(cur, end, ent->stream);
+    case T_ZSET:
+        ent->zset = new ZSet();
+        return zset_decode(cur, end, ent->zset);
+    case T_VECSET:
+        ent->vec = new VecIndex();
+        return vec_decode(cur, end, ent->vec);
+    case T_TS:
+        ent->ts = new TimeSeries();
+        return ts_decode(cur, end, ent->ts);
+    case T_JSON:
+        ent->json = new JsonNode();
+        return json_decode(cur, end, K_JSON_MAX_DEPTH, *ent->json);
+    case T_CMS:
+        ent->cms = new CmsSketch();
+        return cms_decode(cur, end, ent->cms);
+    case T_TOPK:
+        ent->topk = new TopK();
+        return topk_decode(cur, end, ent->topk);
+    default:
+        ent->type = T_STR;
+        return false;
+    }
+}
 
-    Conn *conn { new Conn() };
-    conn->fd = connfd;
-    conn->want_read = true; 
-    return conn;
+// TTLs are stored in snapshots as the wall clock time they run out, in
+// milliseconds, so a file loaded later doesn't extend them by the downtime
+static uint64_t ttl_to_expire_at(int64_t ttl_ms) {
+    return ttl_ms < 0 ? UINT64_MAX : get_realtime_msec() + static_cast<uint64_t>(ttl_ms);
 }
 
-// handles writing responses
-static void handle_write(Conn *conn) {
-    assert(conn->outgoing.size() > 0);
-    ssize_t rv { write(conn->fd, conn->outgoing.data(), conn->outgoing.size()) };
-    
-    // a partial write
-    if (rv < 0 && errno == EAGAIN) {
-        return;
-    }
-    
-    if (rv < 0) {
-        msg_errno("write() error");
-        conn->want_close = true;
-        return;
+// the TTL left until a stored expiry time, -1 for none and 0 if it passed
+static int64_t expire_at_to_ttl(uint64_t expire_at_ms) {
+    if (expire_at_ms == UINT64_MAX) {
+        return -1;
     }
+    uint64_t now_ms { get_realtime_msec() };
+    return expire_at_ms > now_ms ? static_cast<int64_t>(std::min<uint64_t>(expire_at_ms - now_ms, INT64_MAX / 1000)) : 0;
+}
 
-    buf_consume(conn->outgoing, static_cast<size_t>(rv));
+// appends a key of a snapshot: klen key expire_at_ms type value
+static void snapshot_write_entry(std::vector<uint8_t> &out, Entry *ent) {
+    write_str(out, ent->key);
+    write_u64(out, ttl_to_expire_at(entry_ttl(ent)));
+    write_u32(out, ent->type);
+    entry_encode_value(ent, out);
+}
 
-    if (conn->outgoing.size() == 0) { 
-        conn->want_read = true;
-        conn->want_write = false;
+// writes n bytes to fd, returns false on error
+static bool write_all(int fd, const uint8_t *data, size_t n) {
+    while (n > 0) {
+        ssize_t rv { write(fd, data, n) };
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        n -= static_cast<size_t>(rv);
+        data += rv;
     }
+    return true;
 }
 
-// handles reading requests
-static void handle_read(Conn *conn) {
-    uint8_t buf[64 * 1024];
-    ssize_t rv { read(conn->fd, buf, sizeof(buf)) };
-    
-    // partial read
-    if (rv < 0 && errno == EAGAIN) {
-        return;
-    }
-    
-    if (rv < 0) {
-        msg_errno("read() error");
+// bytes a background save buffers before writing them to its file
+const size_t K_BGSAVE_BUFFER = 1 << 20;
+// snapshot bytes a syncing follower may have unsent before the save waits
+// for it, so the slowest follower paces the pass
+const size_t K_REPL_SYNC_WINDOW = 8 << 20;
+
+// checks the unsent data of a follower after adding to it, a follower that
+// doesn't keep up is disconnected and syncs again
+static void follower_queued(Conn *conn) {
+    if (conn->outgoing.size() + conn->repl_backlog.size() > g_config.repl_max_buffer) {
+        msg("follower too slow");
         conn->want_close = true;
+        shutdown(conn->fd, SHUT_RDWR);
         return;
     }
+    if (!conn->outgoing.empty()) {
+        conn->want_read = false;
+        conn->want_write = true;
+    }
+}
 
-    if (rv == 0) {
-        if (conn->incoming.size() == 0) {
-            msg("client closed");
-        } else {
-            msg("unexpected EOF");
+// stops the background save, if it failed its file is removed, followers
+// still syncing from it are disconnected, and the checkpoint it was is
+// taken again: the keys of a delta go to the next one, a base is redone
+static void bgsave_stop(const char *error) {
+    if (g_bgsave.fd >= 0) {
+        close(g_bgsave.fd);
+    }
+    g_bgsave.fd = -1;
+    g_bgsave.running = false;
+    std::vector<uint8_t>().swap(g_bgsave.buf);
+    if (g_bgsave.kind == SAVE_DELTA) {
+        if (error) {
+            for (std::string &key : g_checkpoint.keys) {
+                g_checkpoint.dirty.insert(std::move(key));
+            }
         }
-        conn->want_close = true;
+        std::vector<std::string>().swap(g_checkpoint.keys);
+        std::unordered_set<std::string>().swap(g_checkpoint.pending);
+    }
+    if (!error) {
         return;
     }
+    if (g_bgsave.kind == SAVE_BASE) {
+        g_checkpoint.tracking = false;
+    } else if (g_bgsave.kind == SAVE_DELTA) {
+        g_checkpoint.seq--;
+    }
+    g_bgsave.error = error;
+    if (!g_bgsave.path.empty()) {
+        unlink((g_bgsave.path + ".tmp").c_str());
+    }
+    for (Conn *conn : g_repl.followers) {
+        if (conn->repl_state == REPL_SYNC) {
+            conn->want_close = true;
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+}
 
-    buf_append(conn->incoming, buf, static_cast<size_t>(rv));
-
-    while (try_one_request(conn)) {}
+// writes bytes of the save to its file, and as one frame framed like a
+// response to each follower syncing from it
+static bool bgsave_emit(const uint8_t *data, size_t n) {
+    if (g_bgsave.fd >= 0 && !write_all(g_bgsave.fd, data, n)) {
+        bgsave_stop(strerror(errno));
+        return false;
+    }
+    for (Conn *conn : g_repl.followers) {
+        if (conn->repl_state == REPL_SYNC && !conn->want_close) {
+            write_u32(conn->outgoing, static_cast<uint32_t>(4 + n));
+            write_u32(conn->outgoing, RES_OK);
+            buf_append(conn->outgoing, data, n);
+            follower_queued(conn);
+        }
+    }
+    return true;
+}
 
-    if (conn->outgoing.size() > 0) {
-        conn->want_read = false;
-        conn->want_write = true;
+// fills in the header of the chunk being written and writes it out
+static bool bgsave_end_chunk() {
+    uint64_t len { g_bgsave.buf.size() - 16 };
+    memcpy(g_bgsave.buf.data(), &len, 8);
+    memcpy(g_bgsave.buf.data() + 8, &g_bgsave.chunk_keys, 8);
+    g_bgsave.chunk_keys = 0;
+    bool ok { bgsave_emit(g_bgsave.buf.data(), g_bgsave.buf.size()) };
+    g_bgsave.buf.clear();
+    return ok;
+}
 
-        return handle_write(conn);
+// starts a record of the background save, behind the chunk header if it is
+// the first of its chunk
+static std::vector<uint8_t> &bgsave_begin_record() {
+    if (g_bgsave.chunk_keys == 0) {
+        g_bgsave.buf.resize(16);
     }
+    return g_bgsave.buf;
 }
 
-int main() {
-    // create listening socket
-    int fd { socket(AF_INET, SOCK_STREAM, 0) };
-    if (fd < 0) {
-        die("socket()");
+// counts a record of the background save, a chunk ends once it has
+// K_SNAPSHOT_CHUNK_KEYS records or K_BGSAVE_BUFFER bytes
+static void bgsave_end_record() {
+    g_bgsave.written++;
+    if (++g_bgsave.chunk_keys == K_SNAPSHOT_CHUNK_KEYS || g_bgsave.buf.size() >= K_BGSAVE_BUFFER) {
+        bgsave_end_chunk();
     }
-    int val { 1 };
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+}
 
-    // bind
-    struct sockaddr_in addr { {} };
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(0);
-    int rv { bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) };
-    if (rv) {
-        die("bind()");
-    }
+// adds an entry to the background save
+static void bgsave_write_entry(Entry *ent) {
+    snapshot_write_entry(bgsave_begin_record(), ent);
+    ent->save_epoch = g_bgsave.epoch;
+    bgsave_end_record();
+}
 
-    // set the listen fd to nonblocking mode
-    fd_set_nb(fd);
+// adds a key of a delta checkpoint: its entry, or a record saying it is gone
+static void bgsave_write_key(const std::string &key) {
+    if (Entry *ent = entry_peek(key)) {
+        return bgsave_write_entry(ent);
+    }
+    std::vector<uint8_t> &buf { bgsave_begin_record() };
+    write_str(buf, key);
+    write_u64(buf, static_cast<uint64_t>(-1));
+    write_u32(buf, K_DELTA_DELETED);
+    bgsave_end_record();
+}
 
-    rv = listen(fd, SOMAXCONN);
-    if (rv) {
-        die("listen()");
+// sends a write to the followers as a request, a follower still receiving
+// its snapshot gets it once the snapshot is complete
+static void repl_feed(const std::vector<std::string> &cmd) {
+    if (g_repl.followers.empty()) {
+        return;
     }
+    static std::vector<uint8_t> req;
+    req.clear();
+    write_u32(req, 0);
+    write_u32(req, static_cast<uint32_t>(cmd.size()));
+    for (const std::string &s : cmd) {
+        write_str(req, s);
+    }
+    uint32_t len { static_cast<uint32_t>(req.size() - 4) };
+    memcpy(req.data(), &len, 4);
 
-    // map of all client connections indexed by their fd
+    for (Conn *conn : g_repl.followers) {
+        if (conn->want_close || conn->repl_state == REPL_WAIT) {
+            continue;
+        }
+        buf_append(conn->repl_state == REPL_SYNC ? conn->repl_backlog : conn->outgoing, req.data(), req.size());
+        follower_queued(conn);
+    }
+}
+
+// writes the current value of a key the background save has not written
+// yet, call before writing to the key
+// keys created since the save began are marked written when created
+static void bgsave_before_write(const std::string &key) {
+    if (!g_bgsave.running) {
+        return;
+    }
+    if (g_bgsave.kind == SAVE_DELTA) {
+        if (g_checkpoint.pending.erase(key)) {
+            g_bgsave.preimages++;
+            bgsave_write_key(key);
+        }
+        return;
+    }
+    Entry *ent { entry_peek(key) };
+    if (ent && ent->save_epoch != g_bgsave.epoch) {
+        g_bgsave.preimages++;
+        bgsave_write_entry(ent);
+    }
+}
+
+// adds a deleted entry for a key that does not exist
+static Entry *entry_create_deleted(const std::string &key) {
+    Entry *ent { new Entry() };
+    ent->key = key;
+    ent->node.hash_code = key_hash(key);
+    ent->deleted = true;
+    hash_map_insert(&g_data.db, &ent->node);
+    g_mvcc.tombstones++;
+    return ent;
+}
+
+// saves the current value of a key for the open snapshots that have not
+// seen it change yet, call before writing to the key
+// a key that does not exist gets a deleted entry holding that fact
+// the background save and checkpoint tracking hook in here too
+static void mvcc_save(const std::string &key) {
+    bgsave_before_write(key);
+    if (g_checkpoint.tracking) {
+        g_checkpoint.dirty.insert(key);
+    }
+    if (g_mvcc.snapshots.empty()) {
+        return;
+    }
+    Entry *ent { entry_lookup_any(key) };
+    if (ent && ent->versions && ent->versions->saved_at >= g_mvcc.version) {
+        return; // saved since the newest snapshot was opened
+    }
+    if (!ent) {
+        ent = entry_create_deleted(key);
+    }
+
+    EntryVersion *version { new EntryVersion() };
+    version->saved_at = g_mvcc.version;
+    version->existed = !ent->deleted;
+    if (version->existed) {
+        version->type = ent->type;
+        entry_encode_value(ent, version->value);
+    }
+    if (!ent->versions) {
+        g_mvcc.versioned.push_back(ent);
+    }
+    version->next = ent->versions;
+    ent->versions = version;
+}
+
+// ends the lease on an entry, taking it out of g_leases
+static void lease_free(Entry *ent) {
+    size_t pos { ent->lease->heap_idx };
+    if (pos != (size_t)-1) {
+        // move the last item into the hole
+        g_leases[pos] = g_leases.back();
+        g_leases.pop_back();
+        if (pos < g_leases.size()) {
+            heap_update(g_leases.data(), pos, g_leases.size());
+        }
+    }
+    delete ent->lease;
+    ent->lease = nullptr;
+}
+
+// adds an empty string entry for a key that does not exist yet
+static Entry *entry_create(std::string &key) {
+    // revive a deleted entry kept for snapshots, a key has one node
+    // either way the key is new to a background save in progress
+    // and a write ends the lease on it
+    if (Entry *ent = entry_lookup_any(key); ent && ent->deleted) {
+        ent->deleted = false;
+        ent->save_epoch = g_bgsave.epoch;
+        g_mvcc.tombstones--;
+        if (ent->lease) {
+            lease_free(ent);
+        }
+        return ent;
+    }
+    Entry *ent { new Entry() };
+    ent->key.swap(key);
+    ent->node.hash_code = key_hash(ent->key);
+    ent->save_epoch = g_bgsave.epoch;
+    hash_map_insert(&g_data.db, &ent->node);
+    return ent;
+}
+
+// leases are handed out by a primary, a follower could not take the fill
+static bool leases_on() {
+    return g_config.lease_ttl && g_repl.host.empty();
+}
+
+// puts the lease on an entry in g_leases, or moves it, to end at until_us
+static void lease_queue(Entry *ent, uint64_t until_us) {
+    Lease *lease { ent->lease };
+    lease->ent = ent;
+    lease->until_us = until_us;
+    size_t pos { lease->heap_idx };
+    if (pos == (size_t)-1) {
+        pos = g_leases.size();
+        g_leases.push_back(HeapItem());
+    }
+    g_leases[pos].val = lease->until_us;
+    g_leases[pos].ref = &lease->heap_idx;
+    heap_update(g_leases.data(), pos, g_leases.size());
+}
+
+// starts or extends the lease on a missing key, expired by process_leases
+static void lease_arm(Entry *ent) {
+    lease_queue(ent, get_monotonic_usec() + g_config.lease_ttl * 1000);
+}
+
+// unlinks an entry from the keyspace and frees it
+// with snapshots open it stays as a deleted entry holding its old value,
+// with leases on a string stays as one holding it for the stale gets
+static void entry_remove(Entry *ent) {
+    text_touch(ent->key);
+    mvcc_save(ent->key);
+    entry_set_ttl(ent, -1);
+    if (leases_on() && ent->type == T_STR) {
+        ent->lease = new Lease();
+        ent->lease->has_stale = true;
+        ent->lease->stale.swap(ent->value);
+        lease_arm(ent);
+    }
+    entry_reset(ent);
+    if (ent->versions || ent->lease) {
+        ent->deleted = true;
+        g_mvcc.tombstones++;
+        return;
+    }
+    hash_map_delete(&g_data.db, &ent->node, &entry_eq);
+    delete ent;
+}
+
+// removes a key whose TTL has passed
+static void entry_expire(Entry *ent) {
+    notify(NOTIFY_EXPIRED, ent->key);
+    if (!g_repl.followers.empty()) {
+        repl_feed({ "del", ent->key });
+    }
+    entry_remove(ent);
+}
+
+// removes keys whose TTL has passed, at most expire-work keys per call
+static void process_expired() {
+    // followers leave that to the primary's del, as entry_lookup does
+    if (!g_repl.host.empty()) {
+        return;
+    }
+    uint64_t now_us { get_monotonic_usec() };
+    std::vector<HeapItem> &heap { g_data.heap };
+
+    for (size_t n = 0; n < g_config.expire_work && !heap.empty() && heap[0].val <= now_us; ++n) {
+        entry_expire(container_of(heap[0].ref, Entry, heap_idx));
+    }
+}
+
+// finds the entry for a key, returns null if it does not exist
+// a key whose TTL has passed is removed here rather than served until
+// process_expired gets to it; followers leave that to the primary's del
+static Entry *entry_lookup(const std::string &key) {
+    Entry *ent { entry_peek(key) };
+    if (ent && ent->heap_idx != (size_t)-1 && g_repl.host.empty()
+        && g_data.heap[ent->heap_idx].val <= get_monotonic_usec()) {
+        entry_expire(ent);
+        return nullptr;
+    }
+    return ent;
+}
+
+// ends the lease on a key, and frees the deleted entry if nothing else keeps it
+static void lease_drop(Entry *ent) {
+    lease_free(ent);
+    if (ent->deleted && !ent->versions) {
+        hash_map_delete(&g_data.db, &ent->node, &entry_eq);
+        g_mvcc.tombstones--;
+        delete ent;
+    }
+}
+
+// ends the leases whose time is over, at most expire-work per call
+static void process_leases() {
+    uint64_t now_us { get_monotonic_usec() };
+    for (size_t n = 0; n < g_config.expire_work && !g_leases.empty() && g_leases[0].val <= now_us; ++n) {
+        lease_drop(container_of(g_leases[0].ref, Lease, heap_idx)->ent);
+    }
+}
+
+// milliseconds until the oldest lease ends, -1 if there is none
+static int lease_timeout_ms(uint64_t now_us) {
+    if (g_leases.empty()) {
+        return -1;
+    }
+    return poll_wait_ms(g_leases[0].val, now_us);
+}
+
+// terms whose postings are compacted per iteration, once indexing is done
+const size_t K_TEXT_COMPACT_TERMS = 64;
+
+// queues keys of a text index found by its keyspace scan
+struct TextScan {
+    TextIndex *ti { nullptr };
+    size_t work { 0 };
+};
+
+static void text_scan_cb(HashNode *node, void *arg) {
+    TextScan &scan { *static_cast<TextScan *>(arg) };
+    Entry *ent { container_of(node, Entry, node) };
+    TextIndex *ti { scan.ti };
+    if (ent->deleted) {
+        return;
+    }
+    scan.work += ent->key.size();
+    if (ent->key.compare(0, ti->ft.prefix.size(), ti->ft.prefix) == 0 && ti->queued.insert(ent->key).second) {
+        ti->pending.push_back(ent->key);
+    }
+}
+
+// whether the text indexes have work left for the next iteration
+static bool text_indexes_busy() {
+    for (auto &[name, ti] : g_text_indexes) {
+        if (ti->scanning || !ti->pending.empty() || ti->compacting) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// brings text indexes up to date: scans the keyspace for new indexes, then
+// indexes queued keys, about ft-index-work bytes of keys and values per call
+static void process_text_indexes() {
+    size_t work { 0 };
+    for (auto &[name, ti] : g_text_indexes) {
+        TextScan scan { ti, 0 };
+        while (ti->scanning && scan.work + work < g_config.ft_index_work) {
+            ti->scan_cursor = hash_map_scan(&g_data.db, ti->scan_cursor, &text_scan_cb, &scan);
+            scan.work++;
+            ti->scanning = ti->scan_cursor != 0;
+        }
+        work += scan.work;
+
+        while (!ti->pending.empty() && work < g_config.ft_index_work) {
+            std::string key { std::move(ti->pending.front()) };
+            ti->pending.pop_front();
+            ti->queued.erase(key);
+
+            Entry *ent { entry_peek(key) };
+            if (ent && ent->type == T_STR) {
+                ft_add(&ti->ft, key, ent->value);
+                work += ent->value.size();
+            } else {
+                ft_del(&ti->ft, key);
+            }
+            work += key.size();
+        }
+
+        if (work < g_config.ft_index_work) {
+            ti->compacting = ft_compact_step(&ti->ft, K_TEXT_COMPACT_TERMS);
+        }
+    }
+}
+
+// finished deletion tasks whose progress can still be read
+const size_t K_DELETE_TASKS_KEPT = 16;
+
+// matches s against a glob pattern of *, ?, [abc], [a-z], [^abc] and \ escapes
+static bool glob_match(const std::string &pat, const std::string &s) {
+    size_t p { 0 };
+    size_t i { 0 };
+    size_t star_p { std::string::npos }; // pattern position after the last *
+    size_t star_i { 0 };                 // where the last * resumes matching in s
+    while (i < s.size()) {
+        bool matched { false };
+        size_t next { p + 1 };
+        if (p < pat.size()) {
+            char c { pat[p] };
+            if (c == '*') {
+                star_p = ++p;
+                star_i = i;
+                continue;
+            } else if (c == '?') {
+                matched = true;
+            } else if (c == '[') {
+                size_t q { p + 1 };
+                bool negate { q < pat.size() && pat[q] == '^' };
+                q += negate;
+                bool in_set { false };
+                while (q < pat.size() && pat[q] != ']') {
+                    if (pat[q] == '\\' && q + 1 < pat.size()) {
+                        q++;
+                    }
+                    if (q + 2 < pat.size() && pat[q + 1] == '-' && pat[q + 2] != ']') {
+                        in_set |= s[i] >= pat[q] && s[i] <= pat[q + 2];
+                        q += 3;
+                    } else {
+                        in_set |= s[i] == pat[q];
+                        q++;
+                    }
+                }
+                matched = q < pat.size() && in_set != negate;
+                next = q + 1;
+            } else {
+                if (c == '\\' && p + 1 < pat.size()) {
+                    c = pat[++p];
+                    next = p + 1;
+                }
+                matched = c == s[i];
+            }
+        }
+        if (matched) {
+            p = next;
+            i++;
+        } else if (star_p != std::string::npos) {
+            // let the last * swallow one more character
+            p = star_p;
+            i = ++star_i;
+        } else {
+            return false;
+        }
+    }
+    while (p < pat.size() && pat[p] == '*') {
+        p++;
+    }
+    return p == pat.size();
+}
+
+// collects the entries of a deletion task found by its keyspace scan
+struct DeleteScan {
+    DeleteTask *task { nullptr };
+    std::vector<Entry *> found;
+};
+
+static void delete_scan_cb(HashNode *node, void *arg) {
+    DeleteScan &scan { *static_cast<DeleteScan *>(arg) };
+    Entry *ent { container_of(node, Entry, node) };
+    DeleteTask *task { scan.task };
+    task->scanned++;
+    if (ent->deleted) {
+        return;
+    }
+    bool match { task->is_prefix ? ent->key.compare(0, task->pattern.size(), task->pattern) == 0
+                                 : glob_match(task->pattern, ent->key) };
+    if (match) {
+        scan.found.push_back(ent);
+    }
+}
+
+// whether a deletion task has work left for the next iteration
+static bool delete_tasks_busy() {
+    for (auto &[id, task] : g_delete_tasks) {
+        if (task->running) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// drops the oldest finished tasks beyond K_DELETE_TASKS_KEPT
+static void delete_tasks_trim() {
+    size_t finished { 0 };
+    for (auto &[id, task] : g_delete_tasks) {
+        finished += !task->running;
+    }
+    for (auto it = g_delete_tasks.begin(); it != g_delete_tasks.end() && finished > K_DELETE_TASKS_KEPT;) {
+        if (it->second->running) {
+            ++it;
+            continue;
+        }
+        delete it->second;
+        it = g_delete_tasks.erase(it);
+        finished--;
+    }
+}
+
+// advances the deletion tasks by about delete-work scanned keys per call,
+// shared between the running tasks
+static void process_delete_tasks() {
+    uint64_t work { 0 };
+    bool finished { false };
+    for (auto &[id, task] : g_delete_tasks) {
+        DeleteScan scan { task, {} };
+        while (task->running && work < g_config.delete_work) {
+            uint64_t scanned { task->scanned };
+            task->cursor = hash_map_scan(&g_data.db, task->cursor, &delete_scan_cb, &scan);
+            work += 1 + task->scanned - scanned;
+            task->running = task->cursor != 0;
+            finished |= !task->running;
+
+            // the scan must not modify the map, so delete once it returns
+            for (Entry *ent : scan.found) {
+                notify(NOTIFY_DEL, ent->key);
+                if (!g_repl.followers.empty()) {
+                    repl_feed({ "del", ent->key });
+                }
+                entry_remove(ent);
+            }
+            task->deleted += scan.found.size();
+            scan.found.clear();
+        }
+    }
+    if (finished) {
+        delete_tasks_trim();
+    }
+}
+
+// parses a non-negative decimal integer
+static bool str2u64(const std::string &s, uint64_t &out) {
+    if (s.empty() || s.size() > 19) {
+        return false;
+    }
+
+    out = 0;
+    for (char c : s) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        out = out * 10 + static_cast<uint64_t>(c - '0');
+    }
+    return true;
+}
+
+// parses a finite double
+static bool str2dbl(const std::string &s, double &out) {
+    char *end { nullptr };
+    out = strtod(s.c_str(), &end);
+    return !s.empty() && end == s.c_str() + s.size() && isfinite(out);
+}
+
+// formats a double so that it parses back to the same value
+static std::string dbl2str(double v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", v);
+    return buf;
+}
+
+// sets an error status with a message
+static void out_err(Response &out, const std::string &msg) {
+    out.status = RES_ERR;
+    out.data.assign(msg.begin(), msg.end());
+}
+
+// parks a connection until one of keys is written or timeout_ms passes
+// (0 waits forever), its current request runs again as cmd once woken
+static void conn_block(Conn *conn, std::vector<std::string> &cmd,
+    const std::vector<std::string> &keys, uint64_t timeout_ms)
+{
+    conn->blocked = true;
+    // a request blocking again after a wake keeps the deadline it had
+    if (!conn->block_deadline_us) {
+        conn->block_deadline_us = timeout_ms ? get_monotonic_usec() + timeout_ms * 1000 : UINT64_MAX;
+    }
+    conn->block_keys = keys;
+    conn->block_cmd.swap(cmd);
+    for (const std::string &key : keys) {
+        g_blocked[key].push_back(conn);
+    }
+}
+
+// takes a connection off the blocked lists
+static void conn_unblock(Conn *conn) {
+    for (const std::string &key : conn->block_keys) {
+        auto it { g_blocked.find(key) };
+        if (it == g_blocked.end()) {
+            continue;
+        }
+        std::vector<Conn *> &conns { it->second };
+        conns.erase(std::remove(conns.begin(), conns.end(), conn), conns.end());
+        if (conns.empty()) {
+            g_blocked.erase(it);
+        }
+    }
+    conn->blocked = false;
+    conn->block_keys.clear();
+}
+
+// lets connections blocked on key retry their request
+static void wake_blocked(const std::string &key) {
+    auto it { g_blocked.find(key) };
+    if (it == g_blocked.end()) {
+        return;
+    }
+
+    std::vector<Conn *> conns;
+    conns.swap(it->second);
+    g_blocked.erase(it);
+    for (Conn *conn : conns) {
+        conn_unblock(conn);
+    }
+}
+
+// a get of a missing key with leases on: the first miss is RES_NX with a
+// token for set, the ones after it while the lease is out get RES_STALE
+// with the value of a deleted string, or RES_NX without a token to retry
+static void lease_get(const std::string &key, Response &out) {
+    out.status = RES_NX;
+    Entry *ent { entry_lookup_any(key) };
+    if (!ent) {
+        ent = entry_create_deleted(key);
+    }
+    if (!ent->lease) {
+        ent->lease = new Lease();
+    }
+    Lease *lease { ent->lease };
+    uint64_t now_us { get_monotonic_usec() };
+    if (lease->until_us && lease->until_us <= now_us) {
+        // over but not dropped yet, the stale value goes with it
+        lease->token = 0;
+        lease->has_stale = false;
+        lease->stale.clear();
+    }
+    if (lease->token) {
+        if (lease->has_stale) {
+            out.status = RES_STALE;
+            out.data.assign(lease->stale.begin(), lease->stale.end());
+        }
+        return;
+    }
+    lease->token = g_next_lease++;
+    lease_arm(ent);
+    std::string token { std::to_string(lease->token) };
+    out.data.assign(token.begin(), token.end());
+}
+
+// get <key>
+static void do_get(std::vector<std::string> &cmd, Response &out) {
+    Entry *ent { entry_lookup(cmd[1]) };
+    if (!ent && leases_on()) {
+        return lease_get(cmd[1], out);
+    }
+    if (!ent) {
+        out.status = RES_NX; // not found
+        return;
+    }
+    if (ent->type != T_STR) {
+        return out_err(out, "WRONGTYPE");
+    }
+    out.data.assign(ent->value.begin(), ent->value.end());
+}
+
+// sets a string value and clears any TTL
+static void set_value(std::string &key, std::string &value) {
+    notify(NOTIFY_SET, key);
+    text_touch(key);
+
+    Entry *ent { entry_lookup(key) };
+    if (ent) {
+        entry_reset(ent);
+        entry_set_ttl(ent, -1);
+    } else {
+        ent = entry_create(key);
+    }
+    ent->value.swap(value);
+}
+
+// set <key> <value> [<token>]
+// with the token of a get's lease, fills the key only while the lease is
+// held: not if it ended or the key was written since
+// tokens start at 1, a lease kept only for a stale value has none to match
+static void do_set(std::vector<std::string> &cmd, Response &out) {
+    if (cmd.size() == 4) {
+        Entry *ent { entry_lookup_any(cmd[1]) };
+        uint64_t token { 0 };
+        if (!str2u64(cmd[3], token) || token == 0 || token >= g_next_lease
+            || !ent || !ent->lease || ent->lease->token != token
+            || ent->lease->until_us <= get_monotonic_usec()) {
+            return out_err(out, "lease lost");
+        }
+    }
+    set_value(cmd[1], cmd[2]);
+}
+
+// mset <key> <value> [<key> <value> ...]
+static void do_mset(std::vector<std::string> &cmd, Response &) {
+    for (size_t i = 1; i + 1 < cmd.size(); i += 2) {
+        set_value(cmd[i], cmd[i + 1]);
+    }
+}
+
+// del <key>
+static void do_del(std::vector<std::string> &cmd, Response &) {
+    if (Entry *ent = entry_lookup(cmd[1])) {
+        notify(NOTIFY_DEL, ent->key);
+        entry_remove(ent);
+    }
+}
+
+// pexpire <key> <ms>
+static void do_pexpire(std::vector<std::string> &cmd, Response &out) {
+    uint64_t ttl_ms { 0 };
+    if (!str2u64(cmd[2], ttl_ms) || ttl_ms > INT64_MAX / 1000) {
+        return out_err(out, "expect a TTL in milliseconds");
+    }
+
+    Entry *ent { entry_lookup(cmd[1]) };
+    if (!ent) {
+        out.status = RES_NX;
+        return;
+    }
+    entry_set_ttl(ent, static_cast<int64_t>(ttl_ms));
+}
+
+// pttl <key>
+// replies with the remaining milliseconds, -1 if the key does not expire
+static void do_pttl(std::vector<std::string> &cmd, Response &out) {
+    Entry *ent { entry_lookup(cmd[1]) };
+    if (!ent) {
+        out.status = RES_NX;
+        return;
+    }
+
+    std::string ttl { std::to_string(entry_ttl(ent)) };
+    out.data.assign(ttl.begin(), ttl.end());
+}
+
+// subscribe [<prefix>]
+// keyspace events for matching keys are pushed to this connection in
+// batches, one RES_PUSH message of (event, key) pairs per loop iteration
+static void do_subscribe(Conn *conn, std::vector<std::string> &cmd, Response &) {
+    if (!conn->subscribed) {
+        g_notify.subscribers++;
+    }
+    conn->subscribed = true;
+    conn->sub_prefix = cmd.size() > 1 ? cmd[1] : "";
+}
+
+// unsubscribe
+static void do_unsubscribe(Conn *conn, std::vector<std::string> &, Response &) {
+    if (conn->subscribed) {
+        g_notify.subscribers--;
+    }
+    conn->subscribed = false;
+    conn->sub_prefix.clear();
+}
+
+// appends stream entries as [[id, field1, value1, ...], ...]
+static void out_stream_entries(std::vector<uint8_t> &buf, const std::vector<StreamEntry> &entries) {
+    out_arr(buf, static_cast<uint32_t>(entries.size()));
+    for (const StreamEntry &ent : entries) {
+        out_arr(buf, static_cast<uint32_t>(1 + 2 * ent.fields.size()));
+        out_str(buf, stream_format_id(ent.id));
+        for (auto &[field, value] : ent.fields) {
+            out_str(buf, field);
+            out_str(buf, value);
+        }
+    }
+}
+
+// finds the entry at key if it holds the given type
+// returns null and sets an error reply if key holds another type
+static Entry *lookup_typed(const std::string &key, uint32_t type, Response &out, bool &found) {
+    Entry *ent { entry_lookup(key) };
+    found = ent != nullptr;
+    if (!ent) {
+        return nullptr;
+    }
+    if (ent->type != type) {
+        out_err(out, "WRONGTYPE");
+        return nullptr;
+    }
+    return ent;
+}
+
+// finds the stream stored at key, see lookup_typed
+static Stream *stream_lookup(const std::string &key, Response &out, bool &found) {
+    Entry *ent { lookup_typed(key, T_STREAM, out, found) };
+    return ent ? ent->stream : nullptr;
+}
+
+// xadd <key> <id|*> <field> <value> [<field> <value> ...]
+static void do_xadd(std::vector<std::string> &cmd, Response &out) {
+    StreamID id;
+    bool auto_id { cmd[2] == "*" };
+    if (!auto_id && !stream_parse_id(cmd[2], 0, id)) {
+        return out_err(out, "bad stream id");
+    }
+
+    bool found { false };
+    Stream *stream { stream_lookup(cmd[1], out, found) };
+    if (found && !stream) {
+        return;
+    }
+
+    std::vector<std::pair<std::string, std::string>> fields;
+    for (size_t i = 3; i + 1 < cmd.size(); i += 2) {
+        fields.emplace_back(std::move(cmd[i]), std::move(cmd[i + 1]));
+    }
+
+    // a new stream is only created once the id is known to be valid
+    Stream tmp;
+    StreamID added;
+    if (!stream_add(stream ? stream : &tmp, auto_id ? nullptr : &id, get_realtime_msec(), fields, added)) {
+        return out_err(out, "stream id must be greater than the last one");
+    }
+    if (!stream) {
+        std::string key { cmd[1] };
+        Entry *ent { entry_create(key) };
+        ent->type = T_STREAM;
+        ent->stream = new Stream(std::move(tmp));
+    }
+
+    notify(NOTIFY_SET, cmd[1]);
+    wake_blocked(cmd[1]);
+
+    std::string reply { stream_format_id(added) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// xlen <key>
+static void do_xlen(std::vector<std::string> &cmd, Response &out) {
+    bool found { false };
+    Stream *stream { stream_lookup(cmd[1], out, found) };
+    if (found && !stream) {
+        return;
+    }
+
+    std::string len { std::to_string(stream ? stream->length : 0) };
+    out.data.assign(len.begin(), len.end());
+}
+
+// parses a range bound, "-" and "+" are the smallest and largest ids
+static bool parse_range_id(const std::string &s, bool is_end, StreamID &out) {
+    if (s == "-") {
+        out = StreamID { 0, 0 };
+        return true;
+    }
+    if (s == "+") {
+        out = StreamID { UINT64_MAX, UINT64_MAX };
+        return true;
+    }
+    return stream_parse_id(s, is_end ? UINT64_MAX : 0, out);
+}
+
+// xrange <key> <start> <end> [count <n>]
+static void do_xrange(std::vector<std::string> &cmd, Response &out) {
+    StreamID start;
+    StreamID end;
+    uint64_t count { UINT64_MAX };
+    if (!parse_range_id(cmd[2], false, start) || !parse_range_id(cmd[3], true, end)) {
+        return out_err(out, "bad stream id");
+    }
+    if (cmd.size() == 6 && (cmd[4] != "count" || !str2u64(cmd[5], count))) {
+        return out_err(out, "syntax error");
+    }
+
+    bool found { false };
+    Stream *stream { stream_lookup(cmd[1], out, found) };
+    if (found && !stream) {
+        return;
+    }
+
+    std::vector<StreamEntry> entries;
+    if (stream) {
+        stream_range(stream, start, end, count, entries);
+    }
+    out.status = RES_ARR;
+    out_stream_entries(out.data, entries);
+}
+
+// options of xread and xreadgroup: [count <n>] [block <ms>] streams <key>... <id>...
+struct XReadArgs {
+    uint64_t count { UINT64_MAX };
+    bool block { false };
+    uint64_t block_ms { 0 };
+    std::vector<std::string> keys;
+    std::vector<std::string> ids;
+};
+
+static bool parse_xread_args(std::vector<std::string> &cmd, size_t pos, XReadArgs &args) {
+    for (; pos + 1 < cmd.size() && cmd[pos] != "streams"; pos += 2) {
+        if (cmd[pos] == "count" && str2u64(cmd[pos + 1], args.count)) {
+            continue;
+        }
+        if (cmd[pos] == "block" && str2u64(cmd[pos + 1], args.block_ms)) {
+            args.block = true;
+            continue;
+        }
+        return false;
+    }
+
+    if (pos >= cmd.size() || cmd[pos] != "streams") {
+        return false;
+    }
+    pos++;
+
+    size_t n { (cmd.size() - pos) / 2 };
+    if (n == 0 || (cmd.size() - pos) % 2 != 0) {
+        return false;
+    }
+    args.keys.assign(cmd.begin() + pos, cmd.begin() + pos + n);
+    args.ids.assign(cmd.begin() + pos + n, cmd.end());
+    return true;
+}
+
+// xread [count <n>] [block <ms>] streams <key>... <id>...
+// replies with [[key, entries], ...] for streams with entries after id,
+// "$" means entries added from now on
+static void do_xread(Conn *conn, std::vector<std::string> &cmd, Response &out) {
+    XReadArgs args;
+    if (!parse_xread_args(cmd, 1, args)) {
+        return out_err(out, "syntax error");
+    }
+
+    std::vector<std::pair<std::string, std::vector<StreamEntry>>> results;
+    for (size_t i = 0; i < args.keys.size(); ++i) {
+        bool found { false };
+        Stream *stream { stream_lookup(args.keys[i], out, found) };
+        if (found && !stream) {
+            return;
+        }
+
+        // pin "$" so a retry after blocking returns what arrived meanwhile
+        StreamID after;
+        if (args.ids[i] == "$") {
+            after = stream ? stream->last_id : StreamID {};
+            cmd[cmd.size() - args.keys.size() + i] = stream_format_id(after);
+        } else if (!stream_parse_id(args.ids[i], 0, after)) {
+            return out_err(out, "bad stream id");
+        }
+        if (!stream) {
+            continue;
+        }
+
+        StreamID start { after.ms, after.seq + 1 };
+        if (after.seq == UINT64_MAX) {
+            start = StreamID { after.ms + 1, 0 };
+        }
+
+        std::vector<StreamEntry> entries;
+        stream_range(stream, start, StreamID { UINT64_MAX, UINT64_MAX }, args.count, entries);
+        if (!entries.empty()) {
+            results.emplace_back(args.keys[i], std::move(entries));
+        }
+    }
+
+    if (results.empty()) {
+        if (args.block && !conn->block_timed_out) {
+            return conn_block(conn, cmd, args.keys, args.block_ms);
+        }
+        out.status = RES_NX;
+        return;
+    }
+
+    out.status = RES_ARR;
+    out_arr(out.data, static_cast<uint32_t>(results.size()));
+    for (auto &[key, entries] : results) {
+        out_arr(out.data, 2);
+        out_str(out.data, key);
+        out_stream_entries(out.data, entries);
+    }
+}
+
+// xgroup create <key> <group> <id|$> [mkstream]
+static void do_xgroup(std::vector<std::string> &cmd, Response &out) {
+    if (cmd[1] != "create" || (cmd.size() == 6 && cmd[5] != "mkstream")) {
+        return out_err(out, "syntax error");
+    }
+
+    bool found { false };
+    Stream *stream { stream_lookup(cmd[2], out, found) };
+    if (found && !stream) {
+        return;
+    }
+
+    StreamID start;
+    if (cmd[4] != "$" && !stream_parse_id(cmd[4], 0, start)) {
+        return out_err(out, "bad stream id");
+    }
+
+    if (!stream) {
+        if (cmd.size() != 6) {
+            out.status = RES_NX;
+            return;
+        }
+        std::string key { cmd[2] };
+        Entry *ent { entry_create(key) };
+        ent->type = T_STREAM;
+        ent->stream = stream = new Stream();
+    }
+
+    if (stream->groups.count(cmd[3])) {
+        return out_err(out, "group exists");
+    }
+    stream->groups[cmd[3]].last_delivered = cmd[4] == "$" ? stream->last_id : start;
+}
+
+// xreadgroup group <group> <consumer> [count <n>] [block <ms>] streams <key>... <id>...
+// ">" delivers new entries and adds them to the pending entries list,
+// any other id re-reads the consumer's pending entries after it
+static void do_xreadgroup(Conn *conn, std::vector<std::string> &cmd, Response &out) {
+    XReadArgs args;
+    if (cmd[1] != "group" || !parse_xread_args(cmd, 4, args)) {
+        return out_err(out, "syntax error");
+    }
+
+    const std::string &group_name { cmd[2] };
+    const std::string &consumer { cmd[3] };
+    uint64_t now_ms { get_realtime_msec() };
+
+    std::vector<std::pair<std::string, std::vector<StreamEntry>>> results;
+    for (size_t i = 0; i < args.keys.size(); ++i) {
+        bool found { false };
+        Stream *stream { stream_lookup(args.keys[i], out, found) };
+        if (!stream) {
+            if (!found) {
+                out_err(out, "no such stream");
+            }
+            return;
+        }
+
+        auto group { stream->groups.find(group_name) };
+        if (group == stream->groups.end()) {
+            return out_err(out, "no such group");
+        }
+
+        std::vector<StreamEntry> entries;
+        if (args.ids[i] == ">") {
+            stream_read_group(stream, &group->second, consumer, args.count, now_ms, entries);
+        } else {
+            StreamID after;
+            if (!stream_parse_id(args.ids[i], 0, after)) {
+                return out_err(out, "bad stream id");
+            }
+            // pending history is replied even if it is empty
+            stream_read_pending(stream, &group->second, consumer, after, args.count, entries);
+            results.emplace_back(args.keys[i], std::move(entries));
+            continue;
+        }
+        if (!entries.empty()) {
+            results.emplace_back(args.keys[i], std::move(entries));
+        }
+    }
+
+    if (results.empty()) {
+        if (args.block && !conn->block_timed_out) {
+            return conn_block(conn, cmd, args.keys, args.block_ms);
+        }
+        out.status = RES_NX;
+        return;
+    }
+
+    out.status = RES_ARR;
+    out_arr(out.data, static_cast<uint32_t>(results.size()));
+    for (auto &[key, entries] : results) {
+        out_arr(out.data, 2);
+        out_str(out.data, key);
+        out_stream_entries(out.data, entries);
+    }
+}
+
+// finds the consumer group of the stream at key, sets the reply if missing
+static StreamGroup *group_lookup(const std::string &key, const std::string &name, Response &out) {
+    bool found { false };
+    Stream *stream { stream_lookup(key, out, found) };
+    if (!stream) {
+        if (!found) {
+            out.status = RES_NX;
+        }
+        return nullptr;
+    }
+
+    auto it { stream->groups.find(name) };
+    if (it == stream->groups.end()) {
+        out_err(out, "no such group");
+        return nullptr;
+    }
+    return &it->second;
+}
+
+// xack <key> <group> <id> [<id> ...]
+// replies with the number of entries removed from the pending entries list
+static void do_xack(std::vector<std::string> &cmd, Response &out) {
+    StreamGroup *group { group_lookup(cmd[1], cmd[2], out) };
+    if (!group) {
+        return;
+    }
+
+    size_t acked { 0 };
+    for (size_t i = 3; i < cmd.size(); ++i) {
+        StreamID id;
+        if (!stream_parse_id(cmd[i], 0, id)) {
+            return out_err(out, "bad stream id");
+        }
+        acked += group->pending.erase(id);
+    }
+
+    std::string reply { std::to_string(acked) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// xpending <key> <group> [count <n>]
+// replies with [[id, consumer, idle_ms, deliveries], ...]
+static void do_xpending(std::vector<std::string> &cmd, Response &out) {
+    uint64_t count { UINT64_MAX };
+    if (cmd.size() == 5 && (cmd[3] != "count" || !str2u64(cmd[4], count))) {
+        return out_err(out, "syntax error");
+    }
+
+    StreamGroup *group { group_lookup(cmd[1], cmd[2], out) };
+    if (!group) {
+        return;
+    }
+
+    uint64_t now_ms { get_realtime_msec() };
+    out.status = RES_ARR;
+    size_t ctx { out_begin_arr(out.data) };
+    uint32_t n { 0 };
+    for (auto it = group->pending.begin(); it != group->pending.end() && n < count; ++it, ++n) {
+        const StreamPending &pending { it->second };
+        out_arr(out.data, 4);
+        out_str(out.data, stream_format_id(it->first));
+        out_str(out.data, pending.consumer);
+        out_int(out.data, static_cast<int64_t>(now_ms > pending.delivered_ms ? now_ms - pending.delivered_ms : 0));
+        out_int(out.data, pending.deliveries);
+    }
+    out_end_arr(out.data, ctx, n);
+}
+
+// finds the sorted set at key, or creates it if create is set
+// returns null and sets the reply if it is missing or key holds another type
+static ZSet *zset_lookup_key(std::string &key, bool create, Response &out) {
+    bool found { false };
+    Entry *ent { lookup_typed(key, T_ZSET, out, found) };
+    if (ent) {
+        return ent->zset;
+    }
+    if (found) {
+        return nullptr;
+    }
+    if (!create) {
+        out.status = RES_NX;
+        return nullptr;
+    }
+
+    std::string name { key };
+    ent = entry_create(name);
+    ent->type = T_ZSET;
+    ent->zset = new ZSet();
+    return ent->zset;
+}
+
+// zadd <key> <score> <name> [<score> <name> ...]
+// replies with the number of names added
+static void do_zadd(std::vector<std::string> &cmd, Response &out) {
+    std::vector<double> scores;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        double score { 0 };
+        if (!str2dbl(cmd[i], score)) {
+            return out_err(out, "expect a number");
+        }
+        scores.push_back(score);
+    }
+
+    ZSet *zset { zset_lookup_key(cmd[1], true, out) };
+    if (!zset) {
+        return;
+    }
+
+    size_t added { 0 };
+    for (size_t i = 2; i + 1 < cmd.size(); i += 2) {
+        added += zset_add(zset, cmd[i + 1], scores[(i - 2) / 2]);
+    }
+    notify(NOTIFY_SET, cmd[1]);
+
+    std::string reply { std::to_string(added) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// zscore <key> <name>
+static void do_zscore(std::vector<std::string> &cmd, Response &out) {
+    ZSet *zset { zset_lookup_key(cmd[1], false, out) };
+    double score { 0 };
+    if (!zset) {
+        return;
+    }
+    if (!zset_lookup(zset, cmd[2], score)) {
+        out.status = RES_NX;
+        return;
+    }
+
+    std::string reply { dbl2str(score) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// zrem <key> <name>
+static void do_zrem(std::vector<std::string> &cmd, Response &out) {
+    ZSet *zset { zset_lookup_key(cmd[1], false, out) };
+    if (!zset) {
+        return;
+    }
+
+    bool removed { zset_del(zset, cmd[2]) };
+    if (removed) {
+        notify(NOTIFY_SET, cmd[1]);
+    }
+    out.data.push_back(removed ? '1' : '0');
+}
+
+// zcard <key>
+static void do_zcard(std::vector<std::string> &cmd, Response &out) {
+    ZSet *zset { zset_lookup_key(cmd[1], false, out) };
+    if (!zset) {
+        return;
+    }
+
+    std::string reply { std::to_string(zset_size(zset)) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// appends (name, score) pairs while counting the values written
+struct ZSetOut {
+    std::vector<uint8_t> *buf { nullptr };
+    uint32_t n { 0 };
+};
+
+static bool out_zset_pair(const std::string &name, double score, void *arg) {
+    ZSetOut &zout { *static_cast<ZSetOut *>(arg) };
+    out_str(*zout.buf, name);
+    out_dbl(*zout.buf, score);
+    zout.n += 2;
+    return true;
+}
+
+// zrangebyscore <key> <min> <max> [count <n>]
+// replies with [name1, score1, name2, score2, ...]
+static void do_zrangebyscore(std::vector<std::string> &cmd, Response &out) {
+    double min { 0 };
+    double max { 0 };
+    uint64_t count { UINT64_MAX };
+    if (!str2dbl(cmd[2], min) || !str2dbl(cmd[3], max)) {
+        return out_err(out, "expect a number");
+    }
+    if (cmd.size() == 6 && (cmd[4] != "count" || !str2u64(cmd[5], count))) {
+        return out_err(out, "syntax error");
+    }
+
+    ZSet *zset { zset_lookup_key(cmd[1], false, out) };
+    if (!zset) {
+        return;
+    }
+
+    out.status = RES_ARR;
+    ZSetOut zout { &out.data, 0 };
+    size_t ctx { out_begin_arr(out.data) };
+    zset_range(zset, min, max, count, &out_zset_pair, &zout);
+    out_end_arr(out.data, ctx, zout.n);
+}
+
+// parses a distance unit, returning meters per unit
+static bool parse_geo_unit(const std::string &unit, double &meters) {
+    if (unit == "m") {
+        meters = 1;
+    } else if (unit == "km") {
+        meters = 1000;
+    } else if (unit == "mi") {
+        meters = 1609.34;
+    } else if (unit == "ft") {
+        meters = 0.3048;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// geoadd <key> <lon> <lat> <member> [<lon> <lat> <member> ...]
+// members are stored in a sorted set scored by their 52-bit geohash
+static void do_geoadd(std::vector<std::string> &cmd, Response &out) {
+    std::vector<double> scores;
+    for (size_t i = 2; i + 2 < cmd.size(); i += 3) {
+        double lon { 0 };
+        double lat { 0 };
+        if (!str2dbl(cmd[i], lon) || !str2dbl(cmd[i + 1], lat) || !geo_valid(lon, lat)) {
+            return out_err(out, "invalid longitude/latitude");
+        }
+        scores.push_back(static_cast<double>(geo_encode(lon, lat)));
+    }
+
+    ZSet *zset { zset_lookup_key(cmd[1], true, out) };
+    if (!zset) {
+        return;
+    }
+
+    size_t added { 0 };
+    for (size_t i = 2; i + 2 < cmd.size(); i += 3) {
+        added += zset_add(zset, cmd[i + 2], scores[(i - 2) / 3]);
+    }
+    notify(NOTIFY_SET, cmd[1]);
+
+    std::string reply { std::to_string(added) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// finds the position of a member, sets the reply if it is missing
+static bool geo_member_pos(std::string &key, const std::string &member,
+    double &lon, double &lat, Response &out)
+{
+    ZSet *zset { zset_lookup_key(key, false, out) };
+    double score { 0 };
+    if (!zset) {
+        return false;
+    }
+    if (!zset_lookup(zset, member, score)) {
+        out.status = RES_NX;
+        return false;
+    }
+    geo_decode(static_cast<uint64_t>(score), lon, lat);
+    return true;
+}
+
+// geopos <key> <member>
+// replies with [lon, lat]
+static void do_geopos(std::vector<std::string> &cmd, Response &out) {
+    double lon { 0 };
+    double lat { 0 };
+    if (!geo_member_pos(cmd[1], cmd[2], lon, lat, out)) {
+        return;
+    }
+
+    out.status = RES_ARR;
+    out_arr(out.data, 2);
+    out_dbl(out.data, lon);
+    out_dbl(out.data, lat);
+}
+
+// geodist <key> <member1> <member2> [m|km|mi|ft]
+static void do_geodist(std::vector<std::string> &cmd, Response &out) {
+    double unit { 1 };
+    if (cmd.size() == 5 && !parse_geo_unit(cmd[4], unit)) {
+        return out_err(out, "unsupported unit");
+    }
+
+    double lon1 { 0 };
+    double lat1 { 0 };
+    double lon2 { 0 };
+    double lat2 { 0 };
+    if (!geo_member_pos(cmd[1], cmd[2], lon1, lat1, out)
+        || !geo_member_pos(cmd[1], cmd[3], lon2, lat2, out)) {
+        return;
+    }
+
+    std::string reply { dbl2str(geo_distance(lon1, lat1, lon2, lat2) / unit) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// state of one geosearch while scanning score ranges
+struct GeoSearch {
+    double lon { 0 };
+    double lat { 0 };
+    bool by_box { false };
+    double radius { 0 }; // meters
+    double half_width { 0 };
+    double half_height { 0 };
+    std::vector<std::pair<double, const std::string *>> found; // (distance, member)
+};
+
+static bool geo_search_cb(const std::string &name, double score, void *arg) {
+    GeoSearch &search { *static_cast<GeoSearch *>(arg) };
+
+    double lon { 0 };
+    double lat { 0 };
+    geo_decode(static_cast<uint64_t>(score), lon, lat);
+
+    double dist { geo_distance(search.lon, search.lat, lon, lat) };
+    if (search.by_box) {
+        // north-south and east-west offsets from the center
+        double dy { geo_distance(search.lon, search.lat, search.lon, lat) };
+        double dx { geo_distance(search.lon, lat, lon, lat) };
+        if (dy > search.half_height || dx > search.half_width) {
+            return true;
+        }
+    } else if (dist > search.radius) {
+        return true;
+    }
+
+    search.found.emplace_back(dist, &name);
+    return true;
+}
+
+// geosearch <key> (frommember <member> | fromlonlat <lon> <lat>)
+//     (byradius <radius> <unit> | bybox <width> <height> <unit>) [asc|desc] [count <n>]
+// replies with [[member, distance], ...], nearest first unless desc
+static void do_geosearch(std::vector<std::string> &cmd, Response &out) {
+    GeoSearch search;
+    double unit { 1 };
+    bool desc { false };
+    uint64_t count { UINT64_MAX };
+
+    size_t pos { 2 };
+    if (pos + 1 < cmd.size() && cmd[pos] == "frommember") {
+        if (!geo_member_pos(cmd[1], cmd[pos + 1], search.lon, search.lat, out)) {
+            return;
+        }
+        pos += 2;
+    } else if (pos + 2 < cmd.size() && cmd[pos] == "fromlonlat") {
+        if (!str2dbl(cmd[pos + 1], search.lon) || !str2dbl(cmd[pos + 2], search.lat)
+            || !geo_valid(search.lon, search.lat)) {
+            return out_err(out, "invalid longitude/latitude");
+        }
+        pos += 3;
+    } else {
+        return out_err(out, "syntax error");
+    }
+
+    if (pos + 2 < cmd.size() && cmd[pos] == "byradius") {
+        if (!str2dbl(cmd[pos + 1], search.radius) || !parse_geo_unit(cmd[pos + 2], unit)) {
+            return out_err(out, "syntax error");
+        }
+        search.radius *= unit;
+        search.half_width = search.half_height = search.radius;
+        pos += 3;
+    } else if (pos + 3 < cmd.size() && cmd[pos] == "bybox") {
+        double width { 0 };
+        double height { 0 };
+        if (!str2dbl(cmd[pos + 1], width) || !str2dbl(cmd[pos + 2], height)
+            || !parse_geo_unit(cmd[pos + 3], unit)) {
+            return out_err(out, "syntax error");
+        }
+        search.by_box = true;
+        search.half_width = width * unit / 2;
+        search.half_height = height * unit / 2;
+        pos += 4;
+    } else {
+        return out_err(out, "syntax error");
+    }
+
+    for (; pos < cmd.size(); ++pos) {
+        if (cmd[pos] == "asc" || cmd[pos] == "desc") {
+            desc = cmd[pos] == "desc";
+        } else if (cmd[pos] == "count" && pos + 1 < cmd.size() && str2u64(cmd[pos + 1], count)) {
+            pos++;
+        } else {
+            return out_err(out, "syntax error");
+        }
+    }
+
+    ZSet *zset { zset_lookup_key(cmd[1], false, out) };
+    if (!zset) {
+        return;
+    }
+
+    // one score range scan per group of neighbouring cells
+    std::vector<GeoRange> ranges;
+    geo_ranges(search.lon, search.lat, search.half_width, search.half_height, ranges);
+    for (const GeoRange &r : ranges) {
+        zset_range(zset, static_cast<double>(r.min), static_cast<double>(r.max - 1),
+            SIZE_MAX, &geo_search_cb, &search);
+    }
+
+    std::sort(search.found.begin(), search.found.end());
+    if (desc) {
+        std::reverse(search.found.begin(), search.found.end());
+    }
+    if (search.found.size() > count) {
+        search.found.resize(count);
+    }
+
+    out.status = RES_ARR;
+    out_arr(out.data, static_cast<uint32_t>(search.found.size()));
+    for (auto &[dist, name] : search.found) {
+        out_arr(out.data, 2);
+        out_str(out.data, *name);
+        out_dbl(out.data, dist / unit);
+    }
+}
+
+// finds the vector set at key, sets the reply if it is missing or holds another type
+static VecIndex *vec_lookup_key(std::string &key, Response &out) {
+    bool found { false };
+    Entry *ent { lookup_typed(key, T_VECSET, out, found) };
+    if (ent) {
+        return ent->vec;
+    }
+    if (!found) {
+        out.status = RES_NX;
+    }
+    return nullptr;
+}
+
+// adds an empty vector set at key
+static VecIndex *vec_create_key(std::string &key, uint32_t dim, uint32_t metric) {
+    std::string name { key };
+    Entry *ent { entry_create(name) };
+    ent->type = T_VECSET;
+    ent->vec = new VecIndex();
+    vec_init(ent->vec, dim, metric);
+    return ent->vec;
+}
+
+// parses the vector in cmd[pos..], either one number per argument
+// or "fp32 <blob>" with the floats in host byte order
+static bool parse_vector(std::vector<std::string> &cmd, size_t pos, std::vector<float> &out) {
+    if (cmd.size() == pos + 2 && cmd[pos] == "fp32") {
+        const std::string &blob { cmd[pos + 1] };
+        if (blob.empty() || blob.size() % sizeof(float) != 0) {
+            return false;
+        }
+        out.resize(blob.size() / sizeof(float));
+        memcpy(out.data(), blob.data(), blob.size());
+    } else {
+        for (size_t i = pos; i < cmd.size(); ++i) {
+            double x { 0 };
+            if (!str2dbl(cmd[i], x)) {
+                return false;
+            }
+            out.push_back(static_cast<float>(x));
+        }
+    }
+
+    for (float x : out) {
+        if (!isfinite(x)) {
+            return false;
+        }
+    }
+    return !out.empty();
+}
+
+// vcreate <key> <dim> [l2|cosine|dot]
+static void do_vcreate(std::vector<std::string> &cmd, Response &out) {
+    uint64_t dim { 0 };
+    uint32_t metric { VEC_L2 };
+    if (!str2u64(cmd[2], dim) || dim == 0 || dim > K_VEC_MAX_DIM) {
+        return out_err(out, "invalid dimension");
+    }
+    if (cmd.size() == 4 && !vec_parse_metric(cmd[3], metric)) {
+        return out_err(out, "unknown metric");
+    }
+    if (entry_lookup(cmd[1])) {
+        return out_err(out, "key exists");
+    }
+
+    vec_create_key(cmd[1], static_cast<uint32_t>(dim), metric);
+    notify(NOTIFY_SET, cmd[1]);
+}
+
+// vadd <key> <name> (<x1> <x2> ... | fp32 <blob>)
+// creates an l2 vector set with the vector's dimension if key is missing
+// replies 1 if name is new, 0 if its vector was replaced
+static void do_vadd(std::vector<std::string> &cmd, Response &out) {
+    std::vector<float> v;
+    if (!parse_vector(cmd, 3, v)) {
+        return out_err(out, "invalid vector");
+    }
+
+    VecIndex *index { vec_lookup_key(cmd[1], out) };
+    if (!index) {
+        if (out.status != RES_NX) {
+            return;
+        }
+        out.status = RES_OK;
+        index = vec_create_key(cmd[1], static_cast<uint32_t>(v.size()), VEC_L2);
+    }
+    if (v.size() != index->dim) {
+        return out_err(out, "dimension mismatch");
+    }
+
+    bool added { vec_add(index, cmd[2], v.data()) };
+    notify(NOTIFY_SET, cmd[1]);
+    out.data.push_back(added ? '1' : '0');
+}
+
+// vdel <key> <name>
+static void do_vdel(std::vector<std::string> &cmd, Response &out) {
+    VecIndex *index { vec_lookup_key(cmd[1], out) };
+    if (!index) {
+        return;
+    }
+
+    bool removed { vec_del(index, cmd[2]) };
+    if (removed) {
+        notify(NOTIFY_SET, cmd[1]);
+    }
+    out.data.push_back(removed ? '1' : '0');
+}
+
+// vcard <key>
+static void do_vcard(std::vector<std::string> &cmd, Response &out) {
+    VecIndex *index { vec_lookup_key(cmd[1], out) };
+    if (!index) {
+        return;
+    }
+
+    std::string reply { std::to_string(vec_size(index)) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// vsearch <key> <k> (<x1> <x2> ... | fp32 <blob>)
+// replies with the approximately k nearest [[name, distance], ...], nearest first
+static void do_vsearch(std::vector<std::string> &cmd, Response &out) {
+    uint64_t k { 0 };
+    std::vector<float> q;
+    if (!str2u64(cmd[2], k)) {
+        return out_err(out, "expect an integer");
+    }
+    if (!parse_vector(cmd, 3, q)) {
+        return out_err(out, "invalid vector");
+    }
+
+    VecIndex *index { vec_lookup_key(cmd[1], out) };
+    if (!index) {
+        return;
+    }
+    if (q.size() != index->dim) {
+        return out_err(out, "dimension mismatch");
+    }
+
+    std::vector<std::pair<float, uint32_t>> found;
+    vec_search(index, q.data(), std::min<uint64_t>(k, vec_size(index)), g_config.vector_ef, found);
+
+    out.status = RES_ARR;
+    out_arr(out.data, static_cast<uint32_t>(found.size()));
+    for (auto &[dist, id] : found) {
+        out_arr(out.data, 2);
+        out_str(out.data, index->nodes[id].name);
+        out_dbl(out.data, dist);
+    }
+}
+
+// ft.create <index> <prefix>
+// indexes the string values of keys starting with prefix, existing keys in the background
+static void do_ft_create(std::vector<std::string> &cmd, Response &out) {
+    if (g_text_indexes.count(cmd[1])) {
+        return out_err(out, "index exists");
+    }
+
+    TextIndex *ti { new TextIndex() };
+    ti->ft.prefix = cmd[2];
+    g_text_indexes[cmd[1]] = ti;
+}
+
+// ft.drop <index>
+static void do_ft_drop(std::vector<std::string> &cmd, Response &out) {
+    auto it { g_text_indexes.find(cmd[1]) };
+    if (it == g_text_indexes.end()) {
+        out.status = RES_NX;
+        return;
+    }
+    delete it->second;
+    g_text_indexes.erase(it);
+}
+
+// ft.search <index> <query> [limit <n>]
+// the query is groups of words separated by "|", a key matches if its value
+// has all words of any group; replies with the matching keys, oldest write first
+static void do_ft_search(std::vector<std::string> &cmd, Response &out) {
+    uint64_t limit { UINT64_MAX };
+    if (cmd.size() == 5 && (cmd[3] != "limit" || !str2u64(cmd[4], limit))) {
+        return out_err(out, "syntax error");
+    }
+
+    auto it { g_text_indexes.find(cmd[1]) };
+    if (it == g_text_indexes.end()) {
+        out.status = RES_NX;
+        return;
+    }
+    FtIndex *ft { &it->second->ft };
+
+    std::vector<std::vector<std::string>> query;
+    size_t start { 0 };
+    while (start <= cmd[2].size()) {
+        size_t end { std::min(cmd[2].find('|', start), cmd[2].size()) };
+        query.emplace_back();
+        ft_tokenize(cmd[2].substr(start, end - start), query.back());
+        start = end + 1;
+    }
+
+    std::vector<uint32_t> ids;
+    ft_search(ft, query, limit, ids);
+
+    out.status = RES_ARR;
+    out_arr(out.data, static_cast<uint32_t>(ids.size()));
+    for (uint32_t id : ids) {
+        out_str(out.data, ft->doc_keys[id]);
+    }
+}
+
+// ft.info <index>
+// replies with [name1, value1, name2, value2, ...]
+static void do_ft_info(std::vector<std::string> &cmd, Response &out) {
+    auto it { g_text_indexes.find(cmd[1]) };
+    if (it == g_text_indexes.end()) {
+        out.status = RES_NX;
+        return;
+    }
+    TextIndex *ti { it->second };
+
+    out.status = RES_ARR;
+    out_arr(out.data, 12);
+    out_str(out.data, "prefix");
+    out_str(out.data, ti->ft.prefix);
+    out_str(out.data, "docs");
+    out_int(out.data, static_cast<int64_t>(ti->ft.key_docs.size()));
+    out_str(out.data, "terms");
+    out_int(out.data, static_cast<int64_t>(ti->ft.terms.size()));
+    out_str(out.data, "postings_bytes");
+    out_int(out.data, static_cast<int64_t>(ft_postings_bytes(&ti->ft)));
+    out_str(out.data, "pending");
+    out_int(out.data, static_cast<int64_t>(ti->pending.size()));
+    out_str(out.data, "scanning");
+    out_int(out.data, ti->scanning);
+}
+
+// finds the time series at key, or creates it if create is set
+// returns null and sets the reply if it is missing or key holds another type
+static TimeSeries *ts_lookup_key(std::string &key, bool create, Response &out) {
+    bool found { false };
+    Entry *ent { lookup_typed(key, T_TS, out, found) };
+    if (ent) {
+        return ent->ts;
+    }
+    if (found) {
+        return nullptr;
+    }
+    if (!create) {
+        out.status = RES_NX;
+        return nullptr;
+    }
+
+    std::string name { key };
+    ent = entry_create(name);
+    ent->type = T_TS;
+    ent->ts = new TimeSeries();
+    return ent->ts;
+}
+
+// parses a range bound in milliseconds, "-" and "+" being the extremes
+static bool parse_ts_bound(const std::string &s, uint64_t &out) {
+    if (s == "-") {
+        out = 0;
+    } else if (s == "+") {
+        out = UINT64_MAX;
+    } else {
+        return str2u64(s, out);
+    }
+    return true;
+}
+
+// ts.add <key> <timestamp_ms|*> <value>
+// "*" stamps the sample with the current time, replies with the timestamp
+static void do_ts_add(std::vector<std::string> &cmd, Response &out) {
+    uint64_t time { 0 };
+    double value { 0 };
+    if (cmd[2] == "*") {
+        time = get_realtime_msec();
+    } else if (!str2u64(cmd[2], time)) {
+        return out_err(out, "expect an integer");
+    }
+    if (!str2dbl(cmd[3], value)) {
+        return out_err(out, "expect a number");
+    }
+
+    TimeSeries *ts { ts_lookup_key(cmd[1], true, out) };
+    if (!ts) {
+        return;
+    }
+    if (!ts_add(ts, time, value)) {
+        return out_err(out, "timestamp must increase");
+    }
+    notify(NOTIFY_SET, cmd[1]);
+
+    std::string reply { std::to_string(time) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// ts.get <key>
+// replies with the last sample as [timestamp, value]
+static void do_ts_get(std::vector<std::string> &cmd, Response &out) {
+    TimeSeries *ts { ts_lookup_key(cmd[1], false, out) };
+    if (!ts) {
+        return;
+    }
+    uint64_t time { 0 };
+    double value { 0 };
+    if (!ts_last(ts, time, value)) {
+        out.status = RES_NX;
+        return;
+    }
+
+    out.status = RES_ARR;
+    out_arr(out.data, 2);
+    out_int(out.data, static_cast<int64_t>(time));
+    out_dbl(out.data, value);
+}
+
+// appends [timestamp, value] pairs while counting them
+struct TsOut {
+    std::vector<uint8_t> *buf { nullptr };
+    uint32_t n { 0 };
+};
+
+static void out_ts_sample(uint64_t time, double value, void *arg) {
+    TsOut &tout { *static_cast<TsOut *>(arg) };
+    out_arr(*tout.buf, 2);
+    out_int(*tout.buf, static_cast<int64_t>(time));
+    out_dbl(*tout.buf, value);
+    tout.n++;
+}
+
+// ts.range <key> <from> <to> [aggregation <type> <bucket_ms>] [count <n>]
+// replies with [[timestamp, value], ...], one per bucket when aggregating
+// aggregates are computed while the chunks are decoded
+static void do_ts_range(std::vector<std::string> &cmd, Response &out) {
+    uint64_t from { 0 };
+    uint64_t to { 0 };
+    if (!parse_ts_bound(cmd[2], from) || !parse_ts_bound(cmd[3], to)) {
+        return out_err(out, "expect an integer");
+    }
+
+    uint32_t agg { TS_AGG_NONE };
+    uint64_t bucket { 0 };
+    uint64_t count { UINT64_MAX };
+    for (size_t pos = 4; pos < cmd.size();) {
+        if (cmd[pos] == "aggregation" && pos + 2 < cmd.size()) {
+            if (!ts_parse_agg(cmd[pos + 1], agg) || !str2u64(cmd[pos + 2], bucket) || bucket == 0) {
+                return out_err(out, "invalid aggregation");
+            }
+            pos += 3;
+        } else if (cmd[pos] == "count" && pos + 1 < cmd.size() && str2u64(cmd[pos + 1], count)) {
+            pos += 2;
+        } else {
+            return out_err(out, "syntax error");
+        }
+    }
+
+    TimeSeries *ts { ts_lookup_key(cmd[1], false, out) };
+    if (!ts) {
+        return;
+    }
+
+    out.status = RES_ARR;
+    TsOut tout { &out.data, 0 };
+    size_t ctx { out_begin_arr(out.data) };
+    ts_range(ts, from, to, agg, bucket, count, &out_ts_sample, &tout);
+    out_end_arr(out.data, ctx, tout.n);
+}
+
+// ts.info <key>
+// replies with [name1, value1, name2, value2, ...]
+static void do_ts_info(std::vector<std::string> &cmd, Response &out) {
+    TimeSeries *ts { ts_lookup_key(cmd[1], false, out) };
+    if (!ts) {
+        return;
+    }
+
+    out.status = RES_ARR;
+    out_arr(out.data, 10);
+    out_str(out.data, "samples");
+    out_int(out.data, static_cast<int64_t>(ts->count));
+    out_str(out.data, "chunks");
+    out_int(out.data, static_cast<int64_t>(ts->chunks.size()));
+    out_str(out.data, "bytes");
+    out_int(out.data, static_cast<int64_t>(ts_bytes(ts)));
+    out_str(out.data, "first_timestamp");
+    out_int(out.data, ts->chunks.empty() ? 0 : static_cast<int64_t>(ts->chunks.front().first_ts));
+    out_str(out.data, "last_timestamp");
+    out_int(out.data, ts->chunks.empty() ? 0 : static_cast<int64_t>(ts->chunks.back().last_ts));
+}
+
+// finds the json document at key, sets the reply if it is missing or holds another type
+static JsonNode *json_lookup_key(std::string &key, Response &out) {
+    bool found { false };
+    Entry *ent { lookup_typed(key, T_JSON, out, found) };
+    if (ent) {
+        return ent->json;
+    }
+    if (!found) {
+        out.status = RES_NX;
+    }
+    return nullptr;
+}
+
+// json.set <key> <path> <json>
+// parses the value once and stores it in the document's tree, creating the
+// document if path is "$"; replies nx if the parent of path does not exist
+static void do_json_set(std::vector<std::string> &cmd, Response &out) {
+    std::vector<JsonStep> path;
+    if (!json_parse_path(cmd[2], path)) {
+        return out_err(out, "invalid path");
+    }
+    JsonNode value;
+    if (!json_parse(cmd[3], K_JSON_MAX_DEPTH - static_cast<uint32_t>(path.size()), value)) {
+        return out_err(out, "invalid json");
+    }
+
+    bool found { false };
+    Entry *ent { lookup_typed(cmd[1], T_JSON, out, found) };
+    if (!ent && found) {
+        json_free(value);
+        return;
+    }
+    if (!ent) {
+        if (!path.empty()) {
+            json_free(value);
+            return out_err(out, "new documents must be set at $");
+        }
+        std::string name { cmd[1] };
+        ent = entry_create(name);
+        ent->type = T_JSON;
+        ent->json = new JsonNode();
+    }
+
+    if (!json_set(ent->json, path, value)) {
+        json_free(value);
+        out.status = RES_NX;
+        return;
+    }
+    notify(NOTIFY_SET, cmd[1]);
+}
+
+// json.get <key> [<path>]
+// replies with the text of the value at path, only that subtree is serialized
+static void do_json_get(std::vector<std::string> &cmd, Response &out) {
+    std::vector<JsonStep> path;
+    if (cmd.size() == 3 && !json_parse_path(cmd[2], path)) {
+        return out_err(out, "invalid path");
+    }
+    JsonNode *root { json_lookup_key(cmd[1], out) };
+    if (!root) {
+        return;
+    }
+    JsonNode *node { json_find(root, path) };
+    if (!node) {
+        out.status = RES_NX;
+        return;
+    }
+
+    std::string reply;
+    json_serialize(*node, reply);
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// json.del <key> <path>
+// removes the value at path, "$" deletes the key
+static void do_json_del(std::vector<std::string> &cmd, Response &out) {
+    std::vector<JsonStep> path;
+    if (!json_parse_path(cmd[2], path)) {
+        return out_err(out, "invalid path");
+    }
+    JsonNode *root { json_lookup_key(cmd[1], out) };
+    if (!root) {
+        return;
+    }
+
+    if (path.empty()) {
+        Entry *ent { entry_lookup(cmd[1]) };
+        notify(NOTIFY_DEL, ent->key);
+        entry_remove(ent);
+        out.data.push_back('1');
+        return;
+    }
+    bool removed { json_del(root, path) };
+    if (removed) {
+        notify(NOTIFY_SET, cmd[1]);
+    }
+    out.data.push_back(removed ? '1' : '0');
+}
+
+// json.type <key> [<path>]
+static void do_json_type(std::vector<std::string> &cmd, Response &out) {
+    std::vector<JsonStep> path;
+    if (cmd.size() == 3 && !json_parse_path(cmd[2], path)) {
+        return out_err(out, "invalid path");
+    }
+    JsonNode *root { json_lookup_key(cmd[1], out) };
+    if (!root) {
+        return;
+    }
+    JsonNode *node { json_find(root, path) };
+    if (!node) {
+        out.status = RES_NX;
+        return;
+    }
+
+    std::string reply { json_type_name(*node) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// counters of one sketch, 256MB of count-min counters
+const uint64_t K_SKETCH_MAX_COUNTERS = 1 << 26;
+
+// parses the width and depth of a sketch
+static bool parse_sketch_dims(const std::string &w, const std::string &d, uint32_t &width, uint32_t &depth) {
+    uint64_t width64 { 0 };
+    uint64_t depth64 { 0 };
+    if (!str2u64(w, width64) || !str2u64(d, depth64)) {
+        return false;
+    }
+    if (width64 == 0 || depth64 == 0 || depth64 > K_SKETCH_MAX_DEPTH || width64 * depth64 > K_SKETCH_MAX_COUNTERS) {
+        return false;
+    }
+    width = static_cast<uint32_t>(width64);
+    depth = static_cast<uint32_t>(depth64);
+    return true;
+}
+
+// finds the count-min sketch at key, sets the reply if it is missing or holds another type
+static CmsSketch *cms_lookup_key(std::string &key, Response &out) {
+    bool found { false };
+    Entry *ent { lookup_typed(key, T_CMS, out, found) };
+    if (ent) {
+        return ent->cms;
+    }
+    if (!found) {
+        out.status = RES_NX;
+    }
+    return nullptr;
+}
+
+// cms.init <key> <width> <depth>
+// the estimate of an item exceeds its count by at most about e/width of
+// all increments, with probability 1 - e^-depth
+static void do_cms_init(std::vector<std::string> &cmd, Response &out) {
+    uint32_t width { 0 };
+    uint32_t depth { 0 };
+    if (!parse_sketch_dims(cmd[2], cmd[3], width, depth)) {
+        return out_err(out, "invalid width or depth");
+    }
+    if (entry_lookup(cmd[1])) {
+        return out_err(out, "key exists");
+    }
+
+    std::string name { cmd[1] };
+    Entry *ent { entry_create(name) };
+    ent->type = T_CMS;
+    ent->cms = new CmsSketch();
+    cms_init(ent->cms, width, depth);
+    notify(NOTIFY_SET, cmd[1]);
+}
+
+// cms.incrby <key> <item> <n> [<item> <n> ...]
+// replies with the estimated count of each item after its increment
+static void do_cms_incrby(std::vector<std::string> &cmd, Response &out) {
+    size_t n { (cmd.size() - 2) / 2 };
+    std::vector<std::string> items(n);
+    std::vector<uint64_t> incs(n);
+    for (size_t i = 0; i < n; ++i) {
+        if (!str2u64(cmd[3 + 2 * i], incs[i])) {
+            return out_err(out, "expect an integer");
+        }
+        items[i].swap(cmd[2 + 2 * i]);
+    }
+    CmsSketch *cms { cms_lookup_key(cmd[1], out) };
+    if (!cms) {
+        return;
+    }
+
+    std::vector<uint64_t> counts(n);
+    cms_incrby(cms, items.data(), incs.data(), n, counts.data());
+    notify(NOTIFY_SET, cmd[1]);
+
+    out.status = RES_ARR;
+    out_arr(out.data, static_cast<uint32_t>(n));
+    for (uint64_t count : counts) {
+        out_int(out.data, static_cast<int64_t>(count));
+    }
+}
+
+// cms.query <key> <item> [<item> ...]
+// replies with the estimated count of each item
+static void do_cms_query(std::vector<std::string> &cmd, Response &out) {
+    CmsSketch *cms { cms_lookup_key(cmd[1], out) };
+    if (!cms) {
+        return;
+    }
+
+    size_t n { cmd.size() - 2 };
+    std::vector<uint64_t> counts(n);
+    cms_query(cms, cmd.data() + 2, n, counts.data());
+
+    out.status = RES_ARR;
+    out_arr(out.data, static_cast<uint32_t>(n));
+    for (uint64_t count : counts) {
+        out_int(out.data, static_cast<int64_t>(count));
+    }
+}
+
+// finds the top-k sketch at key, sets the reply if it is missing or holds another type
+static TopK *topk_lookup_key(std::string &key, Response &out) {
+    bool found { false };
+    Entry *ent { lookup_typed(key, T_TOPK, out, found) };
+    if (ent) {
+        return ent->topk;
+    }
+    if (!found) {
+        out.status = RES_NX;
+    }
+    return nullptr;
+}
+
+// topk.reserve <key> <k> [<width> <depth> <decay>]
+// defaults to 8 * k counters per row, 4 rows and a decay of 0.9
+static void do_topk_reserve(std::vector<std::string> &cmd, Response &out) {
+    uint64_t k { 0 };
+    if (!str2u64(cmd[2], k) || k == 0 || k > K_SKETCH_MAX_COUNTERS / 8) {
+        return out_err(out, "invalid k");
+    }
+    uint32_t width { static_cast<uint32_t>(k * 8) };
+    uint32_t depth { 4 };
+    double decay { 0.9 };
+    if (cmd.size() == 6) {
+        if (!parse_sketch_dims(cmd[3], cmd[4], width, depth)) {
+            return out_err(out, "invalid width or depth");
+        }
+        if (!str2dbl(cmd[5], decay) || !(decay > 0 && decay < 1)) {
+            return out_err(out, "decay must be between 0 and 1");
+        }
+    }
+    if (entry_lookup(cmd[1])) {
+        return out_err(out, "key exists");
+    }
+
+    std::string name { cmd[1] };
+    Entry *ent { entry_create(name) };
+    ent->type = T_TOPK;
+    ent->topk = new TopK();
+    topk_init(ent->topk, static_cast<uint32_t>(k), width, depth, decay);
+    notify(NOTIFY_SET, cmd[1]);
+}
+
+// topk.add <key> <item> [<item> ...]
+// replies with the items pushed out of the top k by these additions
+static void do_topk_add(std::vector<std::string> &cmd, Response &out) {
+    TopK *topk { topk_lookup_key(cmd[1], out) };
+    if (!topk) {
+        return;
+    }
+
+    std::vector<std::string> expelled;
+    topk_add(topk, cmd.data() + 2, cmd.size() - 2, expelled);
+    notify(NOTIFY_SET, cmd[1]);
+
+    out.status = RES_ARR;
+    out_arr(out.data, static_cast<uint32_t>(expelled.size()));
+    for (const std::string &name : expelled) {
+        out_str(out.data, name);
+    }
+}
+
+// topk.list <key> [withcount]
+// replies with the top items, largest first, as [name1, count1, ...] with withcount
+static void do_topk_list(std::vector<std::string> &cmd, Response &out) {
+    bool withcount { cmd.size() == 3 };
+    if (withcount && cmd[2] != "withcount") {
+        return out_err(out, "syntax error");
+    }
+    TopK *topk { topk_lookup_key(cmd[1], out) };
+    if (!topk) {
+        return;
+    }
+
+    std::vector<const TopKItem *> items;
+    topk_list(topk, items);
+    out.status = RES_ARR;
+    out_arr(out.data, static_cast<uint32_t>(items.size() * (withcount ? 2 : 1)));
+    for (const TopKItem *item : items) {
+        out_str(out.data, item->name);
+        if (withcount) {
+            out_int(out.data, static_cast<int64_t>(item->count));
+        }
+    }
+}
+
+// starts a background deletion task, replying with its id
+static void start_delete_task(const std::string &pattern, bool is_prefix, Response &out) {
+    DeleteTask *task { new DeleteTask() };
+    task->pattern = pattern;
+    task->is_prefix = is_prefix;
+    uint64_t id { g_next_delete_task++ };
+    g_delete_tasks[id] = task;
+
+    std::string reply { std::to_string(id) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// delprefix <prefix>
+// deletes the keys starting with prefix in the background, replies with a task id
+static void do_delprefix(std::vector<std::string> &cmd, Response &out) {
+    start_delete_task(cmd[1], true, out);
+}
+
+// delpattern <pattern>
+// deletes the keys matching a glob pattern in the background, replies with a task id
+static void do_delpattern(std::vector<std::string> &cmd, Response &out) {
+    start_delete_task(cmd[1], false, out);
+}
+
+// finds a deletion task by the id in s, sets the reply if there is none
+static DeleteTask *delete_task_lookup(const std::string &s, Response &out) {
+    uint64_t id { 0 };
+    if (!str2u64(s, id)) {
+        out_err(out, "expect an integer");
+        return nullptr;
+    }
+    auto it { g_delete_tasks.find(id) };
+    if (it == g_delete_tasks.end()) {
+        out.status = RES_NX;
+        return nullptr;
+    }
+    return it->second;
+}
+
+// delstatus <id>
+// replies with [name1, value1, name2, value2, ...]
+static void do_delstatus(std::vector<std::string> &cmd, Response &out) {
+    DeleteTask *task { delete_task_lookup(cmd[1], out) };
+    if (!task) {
+        return;
+    }
+
+    out.status = RES_ARR;
+    out_arr(out.data, 8);
+    out_str(out.data, task->is_prefix ? "prefix" : "pattern");
+    out_str(out.data, task->pattern);
+    out_str(out.data, "state");
+    out_str(out.data, task->running ? "running" : task->cancelled ? "cancelled" : "done");
+    out_str(out.data, "scanned");
+    out_int(out.data, static_cast<int64_t>(task->scanned));
+    out_str(out.data, "deleted");
+    out_int(out.data, static_cast<int64_t>(task->deleted));
+}
+
+// delcancel <id>
+// stops a running deletion task, keys already deleted stay deleted
+static void do_delcancel(std::vector<std::string> &cmd, Response &out) {
+    DeleteTask *task { delete_task_lookup(cmd[1], out) };
+    if (!task) {
+        return;
+    }
+
+    bool cancelled { task->running };
+    if (cancelled) {
+        task->running = false;
+        task->cancelled = true;
+        delete_tasks_trim();
+    }
+    out.data.push_back(cancelled ? '1' : '0');
+}
+
+// finished import tasks whose progress can still be read
+const size_t K_IMPORT_TASKS_KEPT = 16;
+// bytes read from an import file at once
+const size_t K_IMPORT_READ = 1 << 20;
+
+// whether an import task has work left for the next iteration
+static bool import_tasks_busy() {
+    for (auto &[id, task] : g_import_tasks) {
+        if (task->running) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// drops the oldest finished tasks beyond K_IMPORT_TASKS_KEPT
+static void import_tasks_trim() {
+    size_t finished { 0 };
+    for (auto &[id, task] : g_import_tasks) {
+        finished += !task->running;
+    }
+    for (auto it = g_import_tasks.begin(); it != g_import_tasks.end() && finished > K_IMPORT_TASKS_KEPT;) {
+        if (it->second->running) {
+            ++it;
+            continue;
+        }
+        delete it->second;
+        it = g_import_tasks.erase(it);
+        finished--;
+    }
+}
+
+// stops an import task, with an error message unless it completed
+static void import_finish(ImportTask *task, const char *error) {
+    task->running = false;
+    if (error) {
+        task->error = error;
+    }
+    close(task->fd);
+    task->fd = -1;
+    std::vector<uint8_t>().swap(task->buf);
+}
+
+// reads the next part of an import file behind the unloaded bytes
+static bool import_fill(ImportTask *task) {
+    task->buf.erase(task->buf.begin(), task->buf.begin() + task->buf_pos);
+    task->buf_pos = 0;
+    size_t used { task->buf.size() };
+    task->buf.resize(used + K_IMPORT_READ);
+    ssize_t rv { read(task->fd, task->buf.data() + used, K_IMPORT_READ) };
+    while (rv < 0 && errno == EINTR) {
+        rv = read(task->fd, task->buf.data() + used, K_IMPORT_READ);
+    }
+    task->buf.resize(used + (rv > 0 ? static_cast<size_t>(rv) : 0));
+    task->eof = rv == 0;
+    return rv >= 0;
+}
+
+// parses the record at the read position, returns false if it is incomplete
+static bool import_record(ImportTask *task, std::string &key, std::string &value) {
+    const uint8_t *cur { task->buf.data() + task->buf_pos };
+    const uint8_t *end { task->buf.data() + task->buf.size() };
+    const uint8_t *start { cur };
+    if (!read_lstr(cur, end, key) || !read_lstr(cur, end, value)) {
+        return false;
+    }
+    task->buf_pos += static_cast<size_t>(cur - start);
+    task->bytes += static_cast<size_t>(cur - start);
+    return true;
+}
+
+// loads about import-work records per call, shared between the running tasks
+// the keyspace grows by incremental rehashing as for any other writes, a
+// reserve here would rehash it all at once on the event loop
+static void process_import_tasks() {
+    uint64_t work { 0 };
+    bool finished { false };
+    std::string key;
+    std::string value;
+    for (auto &[id, task] : g_import_tasks) {
+        while (task->running && work < g_config.import_work) {
+            if (import_record(task, key, value)) {
+                mvcc_save(key);
+                if (!g_repl.followers.empty()) {
+                    repl_feed({ "set", key, value });
+                }
+                set_value(key, value);
+                task->keys++;
+                work++;
+                continue;
+            }
+            size_t pending { task->buf.size() - task->buf_pos };
+            if (task->eof) {
+                import_finish(task, pending ? "truncated record" : nullptr);
+            } else if (pending > g_config.max_msg) {
+                import_finish(task, "record too large");
+            } else if (!import_fill(task)) {
+                import_finish(task, strerror(errno));
+            }
+            finished |= !task->running;
+        }
+    }
+    if (finished) {
+        import_tasks_trim();
+    }
+}
+
+const char *const K_DATA_PATH_ERROR = "expect a path relative to dir, without ..";
+
+// resolves a path named by a client to a file under the dir parameter, so
+// clients can only read and write where the server keeps its data
+// returns false for absolute paths and paths with .. components
+static bool data_path(const std::string &path, std::string &out) {
+    if (path.empty() || path[0] == '/') {
+        return false;
+    }
+    for (size_t pos = 0; pos <= path.size();) {
+        size_t next { std::min(path.find('/', pos), path.size()) };
+        if (path.compare(pos, next - pos, "..") == 0) {
+            return false;
+        }
+        pos = next + 1;
+    }
+    out = g_config.dir + "/" + path;
+    return true;
+}
+
+// import <path>
+// loads the records of a file in dir in the background, as string keys set
+// like mset does, replies with a task id
+static void do_import(std::vector<std::string> &cmd, Response &out) {
+    std::string path;
+    if (!data_path(cmd[1], path)) {
+        return out_err(out, K_DATA_PATH_ERROR);
+    }
+    int fd { open(path.c_str(), O_RDONLY | O_CLOEXEC) };
+    if (fd < 0) {
+        return out_err(out, strerror(errno));
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return out_err(out, "not a regular file");
+    }
+
+    ImportTask *task { new ImportTask() };
+    task->path = path;
+    task->fd = fd;
+    task->file_size = static_cast<uint64_t>(st.st_size);
+    uint64_t id { g_next_import_task++ };
+    g_import_tasks[id] = task;
+
+    std::string reply { std::to_string(id) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// importstatus <id>
+// replies with [name1, value1, name2, value2, ...], the error is empty unless it failed
+static void do_importstatus(std::vector<std::string> &cmd, Response &out) {
+    uint64_t id { 0 };
+    if (!str2u64(cmd[1], id)) {
+        return out_err(out, "expect an integer");
+    }
+    auto it { g_import_tasks.find(id) };
+    if (it == g_import_tasks.end()) {
+        out.status = RES_NX;
+        return;
+    }
+    ImportTask *task { it->second };
+
+    out.status = RES_ARR;
+    out_arr(out.data, 10);
+    out_str(out.data, "path");
+    out_str(out.data, task->path);
+    out_str(out.data, "state");
+    out_str(out.data, task->running ? "running" : task->error.empty() ? "done" : "failed");
+    out_str(out.data, "keys");
+    out_int(out.data, static_cast<int64_t>(task->keys));
+    out_str(out.data, "bytes");
+    out_int(out.data, static_cast<int64_t>(task->bytes));
+    out_str(out.data, "error");
+    out_str(out.data, task->error);
+}
+
+// collects the entries of a keyspace scan the background save has not written
+static void bgsave_scan_cb(HashNode *node, void *arg) {
+    std::vector<Entry *> &found { *static_cast<std::vector<Entry *> *>(arg) };
+    Entry *ent { container_of(node, Entry, node) };
+    if (!ent->deleted && ent->save_epoch != g_bgsave.epoch) {
+        found.push_back(ent);
+    }
+}
+
+// completes the background save once its scan is done: text index
+// definitions go last, then the file is synced and renamed into place and
+// the followers move on to the writes made since the save began
+static void bgsave_finish() {
+    if (g_bgsave.chunk_keys > 0 && !bgsave_end_chunk()) {
+        return;
+    }
+    if (g_bgsave.written != g_bgsave.nkeys) {
+        return bgsave_stop("key count changed");
+    }
+    std::vector<uint8_t> trailer;
+    write_u32(trailer, static_cast<uint32_t>(g_text_indexes.size()));
+    for (auto &[name, ti] : g_text_indexes) {
+        write_str(trailer, name);
+        write_str(trailer, ti->ft.prefix);
+    }
+    if (!bgsave_emit(trailer.data(), trailer.size())) {
+        return;
+    }
+    if (g_bgsave.fd >= 0 && (fdatasync(g_bgsave.fd) != 0
+        || rename((g_bgsave.path + ".tmp").c_str(), g_bgsave.path.c_str()) != 0)) {
+        return bgsave_stop(strerror(errno));
+    }
+    for (Conn *conn : g_repl.followers) {
+        if (conn->repl_state == REPL_SYNC) {
+            conn->repl_state = REPL_STREAM;
+            buf_append(conn->outgoing, conn->repl_backlog.data(), conn->repl_backlog.size());
+            std::vector<uint8_t>().swap(conn->repl_backlog);
+            follower_queued(conn);
+        }
+    }
+    bgsave_stop(nullptr);
+}
+
+// starts a background save to fd, or only to followers if it is -1;
+// the followers waiting for a sync receive a snapshot too
+// a delta has the header: magic version series seq nkeys
+static void bgsave_start(int fd, const std::string &path, uint32_t kind) {
+    g_bgsave.running = true;
+    g_bgsave.kind = kind;
+    g_bgsave.epoch++;
+    g_bgsave.path = path;
+    g_bgsave.fd = fd;
+    g_bgsave.cursor = 0;
+    g_bgsave.nkeys = kind == SAVE_DELTA ? g_checkpoint.keys.size() : hash_map_size(&g_data.db) - g_mvcc.tombstones;
+    g_bgsave.written = 0;
+    g_bgsave.preimages = 0;
+    g_bgsave.chunk_keys = 0;
+    g_bgsave.error.clear();
+
+    std::vector<uint8_t> header;
+    if (kind == SAVE_DELTA) {
+        write_u32(header, K_DELTA_MAGIC);
+        write_u32(header, K_SNAPSHOT_VERSION);
+        write_u64(header, g_checkpoint.series);
+        write_u64(header, g_checkpoint.seq);
+    } else {
+        for (Conn *conn : g_repl.followers) {
+            if (conn->repl_state == REPL_WAIT) {
+                conn->repl_state = REPL_SYNC;
+            }
+        }
+        write_u32(header, K_SNAPSHOT_MAGIC);
+        write_u32(header, K_SNAPSHOT_VERSION);
+    }
+    write_u64(header, g_bgsave.nkeys);
+    bgsave_emit(header.data(), header.size());
+}
+
+// whether a follower waits for the next save pass to sync from
+static bool repl_waiting() {
+    for (Conn *conn : g_repl.followers) {
+        if (conn->repl_state == REPL_WAIT && !conn->want_close) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// whether the save has no one left to write to, or waits for a follower to
+// catch up on its snapshot
+static bool bgsave_paused(bool &orphaned) {
+    bool paused { false };
+    orphaned = g_bgsave.fd < 0;
+    for (Conn *conn : g_repl.followers) {
+        if (conn->repl_state == REPL_SYNC && !conn->want_close) {
+            orphaned = false;
+            paused |= conn->outgoing.size() >= K_REPL_SYNC_WINDOW;
+        }
+    }
+    return paused;
+}
+
+// whether the background save can make progress in the next iteration
+static bool bgsave_busy() {
+    bool orphaned { false };
+    return g_bgsave.running && (!bgsave_paused(orphaned) || orphaned);
+}
+
+// advances the background save by about save-work scanned keys per call,
+// starting one for the waiting followers once repl-sync-delay has passed
+static void process_bgsave() {
+    if (!g_bgsave.running && repl_waiting()
+        && get_monotonic_usec() >= g_repl.wait_since_us + g_config.repl_sync_delay * 1000) {
+        bgsave_start(-1, "", SAVE_FILE);
+    }
+    bool orphaned { false };
+    if (g_bgsave.running && bgsave_paused(orphaned)) {
+        return;
+    }
+    if (g_bgsave.running && orphaned) {
+        return bgsave_stop("no followers left");
+    }
+
+    // a delta goes through its keys instead of scanning the keyspace
+    std::vector<std::string> &keys { g_checkpoint.keys };
+    for (uint64_t work = 0; g_bgsave.running && g_bgsave.kind == SAVE_DELTA && work < g_config.save_work; ++work) {
+        if (g_bgsave.cursor == keys.size()) {
+            bgsave_finish();
+        } else if (g_checkpoint.pending.erase(keys[g_bgsave.cursor++])) {
+            bgsave_write_key(keys[g_bgsave.cursor - 1]);
+        }
+    }
+
+    std::vector<Entry *> found;
+    uint64_t work { 0 };
+    while (g_bgsave.running && g_bgsave.kind != SAVE_DELTA && work < g_config.save_work) {
+        g_bgsave.cursor = hash_map_scan(&g_data.db, g_bgsave.cursor, &bgsave_scan_cb, &found);
+        work += 1 + found.size();
+        for (Entry *ent : found) {
+            // a rehash may show a key twice
+            if (g_bgsave.running && ent->save_epoch != g_bgsave.epoch) {
+                bgsave_write_entry(ent);
+            }
+        }
+        found.clear();
+        if (g_bgsave.running && g_bgsave.cursor == 0) {
+            bgsave_finish();
+        }
+    }
+}
+
+// bgsave <path>
+// saves the keyspace as of now to path in dir without forking, in the
+// background; the file is written to path.tmp and renamed when complete
+// it is in the takeover snapshot format, for server --load <path>
+// followers waiting for a sync share the pass
+static void do_bgsave(std::vector<std::string> &cmd, Response &out) {
+    if (g_bgsave.running) {
+        return out_err(out, "save in progress");
+    }
+    std::string path;
+    if (!data_path(cmd[1], path)) {
+        return out_err(out, K_DATA_PATH_ERROR);
+    }
+    int fd { open((path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) };
+    if (fd < 0) {
+        return out_err(out, strerror(errno));
+    }
+    bgsave_start(fd, path, SAVE_FILE);
+}
+
+// the file of a checkpoint in dir, seq 0 for the base
+static std::string checkpoint_path(const std::string &dir, uint64_t series, uint64_t seq) {
+    std::string path { dir + "/" + std::to_string(series) };
+    return seq ? path + "." + std::to_string(seq) + ".delta" : path + ".base";
+}
+
+// starts the next checkpoint as a background save: a delta of the dirty keys
+// while they are tracked and the series has room for one, else the base of
+// a new series
+static bool checkpoint_start(std::string &path, std::string &error) {
+    bool delta { g_checkpoint.tracking && g_checkpoint.seq < g_config.checkpoint_deltas };
+    uint64_t series { delta ? g_checkpoint.series : get_realtime_msec() };
+    uint64_t seq { delta ? g_checkpoint.seq + 1 : 0 };
+    path = checkpoint_path(g_checkpoint.dir, series, seq);
+    int fd { open((path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) };
+    if (fd < 0) {
+        error = strerror(errno);
+        return false;
+    }
+
+    g_checkpoint.series = series;
+    g_checkpoint.seq = seq;
+    g_checkpoint.last_us = get_monotonic_usec();
+    if (delta) {
+        // the keys written from here on go to the next delta
+        g_checkpoint.pending.swap(g_checkpoint.dirty);
+        g_checkpoint.keys.assign(g_checkpoint.pending.begin(), g_checkpoint.pending.end());
+    } else {
+        g_checkpoint.dirty.clear();
+        g_checkpoint.tracking = true;
+    }
+    bgsave_start(fd, path, delta ? SAVE_DELTA : SAVE_BASE);
+    return true;
+}
+
+// takes a checkpoint once checkpoint-interval seconds passed since the last
+// one, unless no key was written since
+static void process_checkpoint() {
+    uint64_t now_us { get_monotonic_usec() };
+    if (g_checkpoint.dir.empty() || !g_config.checkpoint_interval || g_bgsave.running
+        || now_us < g_checkpoint.last_us + g_config.checkpoint_interval * 1000000) {
+        return;
+    }
+    std::string path;
+    std::string error;
+    if (g_checkpoint.tracking && g_checkpoint.dirty.empty() && g_checkpoint.seq < g_config.checkpoint_deltas) {
+        g_checkpoint.last_us = now_us;
+    } else if (!checkpoint_start(path, error)) {
+        msg(("checkpoint: " + error).c_str());
+        g_checkpoint.last_us = now_us;
+    }
+}
+
+// milliseconds until the next periodic checkpoint, -1 if there is none
+static int checkpoint_timeout_ms(uint64_t now_us) {
+    if (g_checkpoint.dir.empty() || !g_config.checkpoint_interval || g_bgsave.running) {
+        return -1;
+    }
+    uint64_t due_us { g_checkpoint.last_us + g_config.checkpoint_interval * 1000000 };
+    return poll_wait_ms(due_us, now_us);
+}
+
+// checkpoint <dir>
+// writes the next checkpoint to dir, under the dir parameter, in the
+// background like bgsave and replies
+// with its file: a delta with the keys written, changed or deleted, since
+// the previous checkpoint, or the base of a new series if there is none or
+// the series has checkpoint-deltas deltas; more follow every
+// checkpoint-interval seconds
+// server --load <dir> loads the newest base and its deltas
+static void do_checkpoint(std::vector<std::string> &cmd, Response &out) {
+    if (g_bgsave.running) {
+        return out_err(out, "save in progress");
+    }
+    std::string dir;
+    if (!data_path(cmd[1], dir)) {
+        return out_err(out, K_DATA_PATH_ERROR);
+    }
+    if (dir != g_checkpoint.dir) {
+        g_checkpoint.dir = dir;
+        g_checkpoint.tracking = false;
+        g_checkpoint.dirty.clear();
+    }
+    std::string path;
+    std::string error;
+    if (!checkpoint_start(path, error)) {
+        return out_err(out, error);
+    }
+    out.data.assign(path.begin(), path.end());
+}
+
+// checkpointinfo
+// replies with [name1, value1, name2, value2, ...]: the directory, the series
+// and its deltas, and the keys written since the last checkpoint, -1 if the
+// next one is a base
+static void do_checkpointinfo(std::vector<std::string> &, Response &out) {
+    out.status = RES_ARR;
+    out_arr(out.data, 8);
+    out_str(out.data, "dir");
+    out_str(out.data, g_checkpoint.dir);
+    out_str(out.data, "series");
+    out_int(out.data, static_cast<int64_t>(g_checkpoint.series));
+    out_str(out.data, "deltas");
+    out_int(out.data, static_cast<int64_t>(g_checkpoint.seq));
+    out_str(out.data, "dirty");
+    out_int(out.data, g_checkpoint.tracking ? static_cast<int64_t>(g_checkpoint.dirty.size()) : -1);
+}
+
+// bgsavestatus
+// replies with [name1, value1, name2, value2, ...] about the running or last save
+static void do_bgsavestatus(std::vector<std::string> &, Response &out) {
+    const char *state { g_bgsave.running ? "running" : !g_bgsave.error.empty() ? "failed"
+                        : g_bgsave.epoch ? "done" : "none" };
+    out.status = RES_ARR;
+    out_arr(out.data, 12);
+    out_str(out.data, "path");
+    out_str(out.data, g_bgsave.path);
+    out_str(out.data, "state");
+    out_str(out.data, state);
+    out_str(out.data, "keys");
+    out_int(out.data, static_cast<int64_t>(g_bgsave.nkeys));
+    out_str(out.data, "written");
+    out_int(out.data, static_cast<int64_t>(g_bgsave.written));
+    out_str(out.data, "preimages");
+    out_int(out.data, static_cast<int64_t>(g_bgsave.preimages));
+    out_str(out.data, "error");
+    out_str(out.data, g_bgsave.error);
+}
+
+// where the keys a command writes are in its arguments
+enum {
+    KEYS_NONE = 0,
+    KEYS_FIRST = 1,   // cmd[1]
+    KEYS_SECOND = 2,  // cmd[2]
+    KEYS_PAIRS = 3,   // cmd[1], cmd[3], ... before their values
+    KEYS_RESTORE = 4, // as KEYS_PAIRS, after an optional "replace"
+    KEYS_STREAMS = 5, // the first half of the arguments after "streams"
+};
+
+// saves the values of the keys a command is about to write for open snapshots
+// and the background save, and marks them dirty for the next checkpoint
+static void mvcc_before_write(uint32_t keys, std::vector<std::string> &cmd) {
+    size_t pos { 1 };
+    switch (keys) {
+    case KEYS_FIRST:
+        mvcc_save(cmd[1]);
+        break;
+    case KEYS_SECOND:
+        mvcc_save(cmd[2]);
+        break;
+    case KEYS_RESTORE:
+        pos = cmd[1] == "replace" ? 2 : 1;
+        [[fallthrough]];
+    case KEYS_PAIRS:
+        for (size_t i = pos; i < cmd.size(); i += 2) {
+            mvcc_save(cmd[i]);
+        }
+        break;
+    case KEYS_STREAMS:
+        pos = static_cast<size_t>(std::find(cmd.begin(), cmd.end(), "streams") - cmd.begin()) + 1;
+        for (size_t i = pos; i < pos + (cmd.size() - std::min(pos, cmd.size())) / 2; ++i) {
+            mvcc_save(cmd[i]);
+        }
+        break;
+    }
+}
+
+// the version of an entry a snapshot sees: the oldest one saved after the
+// snapshot was opened, or the live value if none was
+// returns false if the key did not exist for the snapshot
+static bool mvcc_view(Entry *ent, uint64_t version, uint32_t &type, std::vector<uint8_t> &value) {
+    EntryVersion *seen { nullptr };
+    for (EntryVersion *v = ent->versions; v && v->saved_at >= version; v = v->next) {
+        seen = v;
+    }
+    if (seen) {
+        type = seen->type;
+        value = seen->value;
+        return seen->existed;
+    }
+    if (ent->deleted) {
+        return false;
+    }
+    type = ent->type;
+    entry_encode_value(ent, value);
+    return true;
+}
+
+// drops the versions no open snapshot sees anymore, and the deleted
+// entries left without versions
+static void mvcc_collect() {
+    std::vector<Entry *> keep;
+    for (Entry *ent : g_mvcc.versioned) {
+        // a version is seen by the snapshots opened after the next older one was saved
+        EntryVersion **link { &ent->versions };
+        while (EntryVersion *v = *link) {
+            uint64_t older { v->next ? v->next->saved_at : 0 };
+            auto it { g_mvcc.open_versions.upper_bound(older) };
+            if (it != g_mvcc.open_versions.end() && *it <= v->saved_at) {
+                link = &v->next;
+            } else {
+                *link = v->next;
+                delete v;
+            }
+        }
+
+        if (ent->versions) {
+            keep.push_back(ent);
+        } else if (ent->deleted && !ent->lease) {
+            hash_map_delete(&g_data.db, &ent->node, &entry_eq);
+            g_mvcc.tombstones--;
+            delete ent;
+        }
+    }
+    g_mvcc.versioned.swap(keep);
+}
+
+// finds the snapshot whose id is in s, sets the reply if there is none
+static bool mvcc_lookup(const std::string &s, uint64_t &id, Response &out) {
+    if (!str2u64(s, id)) {
+        out_err(out, "expect an integer");
+        return false;
+    }
+    if (!g_mvcc.snapshots.count(id)) {
+        out.status = RES_NX;
+        return false;
+    }
+    return true;
+}
+
+static const char *type_name(uint32_t type) {
+    static const char *K_NAMES[] { "string", "stream", "zset", "vectorset", "timeseries", "json", "cms", "topk" };
+    return type < sizeof(K_NAMES) / sizeof(K_NAMES[0]) ? K_NAMES[type] : "unknown";
+}
+
+// appends a key as seen by a snapshot: key, type, then the string value or
+// the serialized form of other types
+static void out_snapshot_value(std::vector<uint8_t> &buf, const std::string &key, uint32_t type,
+    std::vector<uint8_t> &value) {
+    out_str(buf, key);
+    out_str(buf, type_name(type));
+    const uint8_t *data { value.data() };
+    size_t len { value.size() };
+    if (type == T_STR) {
+        data += 4; // strip the length prefix of write_str
+        len -= 4;
+    }
+    out_str(buf, data, len);
+}
+
+// closes an open snapshot, mvcc_collect then drops the versions only it saw
+static void mvcc_close(uint64_t id) {
+    g_mvcc.open_versions.erase(g_mvcc.snapshots[id]);
+    g_mvcc.snapshots.erase(id);
+}
+
+// snapshot open
+// replies with the id of a consistent view of the keyspace as of now,
+// closed when the connection that opened it closes if not before
+static void do_snapshot_open(Conn *conn, std::vector<std::string> &, Response &out) {
+    uint64_t id { g_mvcc.next_id++ };
+    g_mvcc.snapshots[id] = ++g_mvcc.version;
+    g_mvcc.open_versions.insert(g_mvcc.version);
+    conn->snapshots.push_back(id);
+
+    std::string reply { std::to_string(id) };
+    out.data.assign(reply.begin(), reply.end());
+}
+
+// snapshot close <id>
+static void do_snapshot_close(Conn *conn, std::vector<std::string> &cmd, Response &out) {
+    uint64_t id { 0 };
+    if (!mvcc_lookup(cmd[2], id, out)) {
+        return;
+    }
+    mvcc_close(id);
+    mvcc_collect();
+    auto &ids { conn->snapshots };
+    ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+}
+
+// snapshot get <id> <key>
+// replies with [key, type, value] as of when the snapshot was opened
+static void do_snapshot_get(std::vector<std::string> &cmd, Response &out) {
+    uint64_t id { 0 };
+    if (!mvcc_lookup(cmd[2], id, out)) {
+        return;
+    }
+    uint64_t version { g_mvcc.snapshots[id] };
+    Entry *ent { entry_lookup_any(cmd[3]) };
+    uint32_t type { 0 };
+    std::vector<uint8_t> value;
+    if (!ent || !mvcc_view(ent, version, type, value)) {
+        out.status = RES_NX;
+        return;
+    }
+
+    out.status = RES_ARR;
+    out_arr(out.data, 3);
+    out_snapshot_value(out.data, ent->key, type, value);
+}
+
+// collects the entries of a snapshot scan step
+struct MvccScan {
+    std::vector<Entry *> found;
+};
+
+static void mvcc_scan_cb(HashNode *node, void *arg) {
+    static_cast<MvccScan *>(arg)->found.push_back(container_of(node, Entry, node));
+}
+
+// snapshot scan <id> <cursor> [count <n>]
+// replies with [next_cursor, [key1, type1, value1, ...]], start with cursor 0
+// and stop when 0 is returned; keys may repeat if the keyspace was resized
+static void do_snapshot_scan(std::vector<std::string> &cmd, Response &out) {
+    uint64_t id { 0 };
+    uint64_t cursor { 0 };
+    uint64_t count { 10 };
+    if (!str2u64(cmd[3], cursor)) {
+        return out_err(out, "expect an integer");
+    }
+    if (cmd.size() == 6 && (cmd[4] != "count" || !str2u64(cmd[5], count))) {
+        return out_err(out, "syntax error");
+    }
+    if (!mvcc_lookup(cmd[2], id, out)) {
+        return;
+    }
+    uint64_t version { g_mvcc.snapshots[id] };
+
+    // keys deleted after the snapshot was opened are still in the keyspace
+    MvccScan scan;
+    do {
+        cursor = hash_map_scan(&g_data.db, cursor, &mvcc_scan_cb, &scan);
+    } while (cursor != 0 && scan.found.size() < count);
+
+    out.status = RES_ARR;
+    out_arr(out.data, 2);
+    out_int(out.data, static_cast<int64_t>(cursor));
+    size_t ctx { out_begin_arr(out.data) };
+    uint32_t n { 0 };
+    for (Entry *ent : scan.found) {
+        uint32_t type { 0 };
+        std::vector<uint8_t> value;
+        if (mvcc_view(ent, version, type, value)) {
+            out_snapshot_value(out.data, ent->key, type, value);
+            n += 3;
+        }
+    }
+    out_end_arr(out.data, ctx, n);
+}
+
+// format of dump payloads, bumped when any type's encoding changes
+const uint8_t K_DUMP_VERSION = 2;
+
+// serializes a key's value and TTL for restore
+// format: version type ttl_ms value crc32c, the crc covering everything before it
+static void dump_entry(Entry *ent, std::vector<uint8_t> &out) {
+    size_t start { out.size() };
+    out.push_back(K_DUMP_VERSION);
+    write_u32(out, ent->type);
+    write_u64(out, static_cast<uint64_t>(entry_ttl(ent)));
+    entry_encode_value(ent, out);
+    write_u32(out, crc32c(0, out.data() + start, out.size() - start));
+}
+
+// checks a dump payload and decodes its value into a new unlinked entry
+static Entry *dump_decode(const std::string &blob, int64_t &ttl_ms) {
+    const uint8_t *cur { reinterpret_cast<const uint8_t *>(blob.data()) };
+    if (blob.size() < 1 + 4 + 8 + 4 || cur[0] != K_DUMP_VERSION) {
+        return nullptr;
+    }
+    const uint8_t *end { cur + blob.size() - 4 };
+    uint32_t crc { 0 };
+    memcpy(&crc, end, 4);
+    if (crc != crc32c(0, cur, blob.size() - 4)) {
+        return nullptr;
+    }
+
+    cur++;
+    uint32_t type { 0 };
+    uint64_t ttl { 0 };
+    read_u32(cur, end, type);
+    read_u64(cur, end, ttl);
+    if (ttl != UINT64_MAX && ttl > INT64_MAX / 1000) {
+        return nullptr;
+    }
+    Entry *ent { new Entry() };
+    if (!entry_decode_value(cur, end, type, ent) || cur != end) {
+        entry_reset(ent);
+        delete ent;
+        return nullptr;
+    }
+    ttl_ms = static_cast<int64_t>(ttl);
+    return ent;
+}
+
+// links a decoded entry in at key, replacing what is there
+static void restore_entry(const std::string &key, Entry *decoded, int64_t ttl_ms) {
+    if (Entry *old = entry_lookup(key)) {
+        entry_remove(old);
+    }
+    std::string name { key };
+    Entry *ent { entry_create(name) };
+    ent->type = decoded->type;
+    ent->value.swap(decoded->value);
+    ent->stream = decoded->stream; // whichever payload the type selects
+    decoded->type = T_STR;
+    decoded->stream = nullptr;
+    delete decoded;
+
+    entry_set_ttl(ent, ttl_ms);
+    text_touch(ent->key);
+    notify(NOTIFY_SET, ent->key);
+}
+
+// dump <key>
+// replies with the serialized value and TTL of a key, of any type
+static void do_dump(std::vector<std::string> &cmd, Response &out) {
+    Entry *ent { entry_lookup(cmd[1]) };
+    if (!ent) {
+        out.status = RES_NX;
+        return;
+    }
+    dump_entry(ent, out.data);
+}
+
+// restore <key> <ttl_ms|keep> <payload> [replace]
+// recreates a dumped key; a TTL of 0 means none, keep uses the dumped one
+static void do_restore(std::vector<std::string> &cmd, Response &out) {
+    uint64_t ttl { 0 };
+    bool keep_ttl { cmd[2] == "keep" };
+    if (!keep_ttl && (!str2u64(cmd[2], ttl) || ttl > INT64_MAX / 1000)) {
+        return out_err(out, "expect a TTL in milliseconds");
+    }
+    bool replace { cmd.size() == 5 };
+    if (replace && cmd[4] != "replace") {
+        return out_err(out, "syntax error");
+    }
+    if (!replace && entry_lookup(cmd[1])) {
+        return out_err(out, "key exists");
+    }
+
+    int64_t dumped_ttl { -1 };
+    Entry *decoded { dump_decode(cmd[3], dumped_ttl) };
+    if (!decoded) {
+        return out_err(out, "invalid payload");
+    }
+    restore_entry(cmd[1], decoded, keep_ttl ? dumped_ttl : ttl ? static_cast<int64_t>(ttl) : -1);
+}
+
+// mdump <key> [<key> ...]
+// replies with the dump payload of each key, empty for missing keys
+static void do_mdump(std::vector<std::string> &cmd, Response &out) {
+    out.status = RES_ARR;
+    out_arr(out.data, static_cast<uint32_t>(cmd.size() - 1));
+    std::vector<uint8_t> payload;
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        payload.clear();
+        if (Entry *ent = entry_lookup(cmd[i])) {
+            dump_entry(ent, payload);
+        }
+        out_str(out.data, payload.data(), payload.size());
+    }
+}
+
+// mrestore [replace] <key> <payload> [<key> <payload> ...]
+// recreates dumped keys with their dumped TTLs, empty payloads are skipped
+// replies with 1 per key restored, 0 if it exists, -1 if its payload is invalid
+static void do_mrestore(std::vector<std::string> &cmd, Response &out) {
+    bool replace { cmd[1] == "replace" };
+    size_t pos { replace ? 2u : 1u };
+    if ((cmd.size() - pos) % 2 != 0) {
+        return out_err(out, "syntax error");
+    }
+
+    size_t n { (cmd.size() - pos) / 2 };
+    out.status = RES_ARR;
+    out_arr(out.data, static_cast<uint32_t>(n));
+    for (size_t i = pos; i < cmd.size(); i += 2) {
+        if (cmd[i + 1].empty() || (!replace && entry_lookup(cmd[i]))) {
+            out_int(out.data, 0);
+            continue;
+        }
+        int64_t ttl_ms { -1 };
+        Entry *decoded { dump_decode(cmd[i + 1], ttl_ms) };
+        if (!decoded) {
+            out_int(out.data, -1);
+            continue;
+        }
+        restore_entry(cmd[i], decoded, ttl_ms);
+        out_int(out.data, 1);
+    }
+}
+
+// chain lengths reported by hashstats, the last one counting longer chains too
+const size_t K_HASHSTATS_CHAINS = 16;
+
+// hashstats
+// replies with [keys, n, buckets, n, chains, [buckets with 0 keys, 1 key, ...],
+// layout, pointer|compact, index_bytes, n, filter_bits, n] to check that keys
+// spread evenly over the keyspace's buckets, what the index costs per key and
+// how many hash bits its bucket filters still have
+static void do_hashstats(std::vector<std::string> &, Response &out) {
+    size_t hist[K_HASHSTATS_CHAINS];
+    hash_map_chains(&g_data.db, hist, K_HASHSTATS_CHAINS);
+    size_t buckets { 0 };
+    for (size_t n : hist) {
+        buckets += n;
+    }
+
+    out.status = RES_ARR;
+    out_arr(out.data, 12);
+    out_str(out.data, "keys");
+    out_int(out.data, static_cast<int64_t>(hash_map_size(&g_data.db)));
+    out_str(out.data, "buckets");
+    out_int(out.data, static_cast<int64_t>(buckets));
+    out_str(out.data, "chains");
+    out_arr(out.data, K_HASHSTATS_CHAINS);
+    for (size_t n : hist) {
+        out_int(out.data, static_cast<int64_t>(n));
+    }
+    out_str(out.data, "layout");
+    out_str(out.data, hash_map_layout());
+    out_str(out.data, "index_bytes");
+    out_int(out.data, static_cast<int64_t>(hash_map_index_bytes(&g_data.db)));
+    out_str(out.data, "filter_bits");
+    out_int(out.data, static_cast<int64_t>(hash_map_filter_bits(&g_data.db)));
+}
+
+// ratelimit <ops/sec> <bytes/sec>
+// sets the limits applied to every connection, 0 disables a limit
+static void do_ratelimit(std::vector<std::string> &cmd, Response &out) {
+    uint64_t ops { 0 };
+    uint64_t bytes { 0 };
+    if (!str2u64(cmd[1], ops) || !str2u64(cmd[2], bytes)) {
+        out.status = RES_ERR;
+        return;
+    }
+
+    g_config.ratelimit_ops = ops;
+    g_config.ratelimit_bytes = bytes;
+}
+
+// config get <name>
+// config set <name> <value>
+static void do_config(std::vector<std::string> &cmd, Response &out) {
+    ConfigParam *param { config_find(&g_config_table, cmd[2]) };
+    if (!param) {
+        return out_err(out, "unknown parameter");
+    }
+
+    if (cmd.size() == 3 && cmd[1] == "get") {
+        std::string val { param->str ? *param->str : std::to_string(*param->value) };
+        out.data.assign(val.begin(), val.end());
+    } else if (cmd.size() == 4 && cmd[1] == "set") {
+        std::string err;
+        if (!config_set(param, cmd[3], false, err)) {
+            return out_err(out, err);
+        }
+    } else {
+        out.status = RES_ERR;
+    }
+}
+
+// sends an executed write on to the followers, with the ids and timestamps
+// picked for * so that followers store the same ones
+static void repl_feed_write(std::vector<std::string> &cmd, const Response &resp) {
+    if (resp.status == RES_ERR) {
+        return;
+    }
+    if ((cmd[0] == "xadd" || cmd[0] == "ts.add") && cmd[2] == "*") {
+        cmd[2].assign(resp.data.begin(), resp.data.end());
+    }
+    if (cmd[0] == "set" && cmd.size() == 4) {
+        cmd.pop_back(); // the lease is the primary's
+    }
+    repl_feed(cmd);
+}
+
+// sync
+// makes the connection a follower: the reply is followed by a snapshot from
+// the next save pass, framed like responses: the header (magic version
+// nkeys), one frame per chunk and the text index definitions, then by the
+// writes executed since the pass began, as requests
+static void do_sync(Conn *conn, std::vector<std::string> &, Response &out) {
+    if (conn->repl_state != REPL_NONE) {
+        return out_err(out, "already a follower");
+    }
+    if (!repl_waiting()) {
+        g_repl.wait_since_us = get_monotonic_usec();
+    }
+    conn->repl_state = REPL_WAIT;
+    g_repl.followers.push_back(conn);
+}
+
+// replicaof <ipv4 address> <port> | replicaof no one
+// follows a primary, replacing the keyspace with its own on each sync, or
+// stops following and keeps the keyspace as it is
+// the address is numeric, a name lookup would stall the event loop
+static void do_replicaof(std::vector<std::string> &cmd, Response &out) {
+    if (cmd[1] == "no" && cmd[2] == "one") {
+        g_repl.host.clear();
+    } else {
+        uint64_t port { 0 };
+        struct in_addr addr;
+        if (inet_pton(AF_INET, cmd[1].c_str(), &addr) != 1) {
+            return out_err(out, "expect an IPv4 address");
+        }
+        if (!str2u64(cmd[2], port) || port == 0 || port > 65535) {
+            return out_err(out, "bad port");
+        }
+        g_repl.host = cmd[1];
+        g_repl.port = port;
+        g_repl.retry_at_us = 0;
+    }
+    if (g_repl.link) {
+        g_repl.link->want_close = true;
+        shutdown(g_repl.link->fd, SHUT_RDWR);
+    }
+}
+
+// replinfo
+// replies with [name1, value1, name2, value2, ...]: the role, the primary and
+// the state of the link to it, syncs completed, and followers by state
+static void do_replinfo(std::vector<std::string> &, Response &out) {
+    static const char *const K_LINK_NAMES[] { "connecting", "sync", "sync", "sync", "up" };
+    int64_t syncing { 0 };
+    for (Conn *conn : g_repl.followers) {
+        syncing += conn->repl_state != REPL_STREAM;
+    }
+    bool follower { !g_repl.host.empty() };
+    out.status = RES_ARR;
+    out_arr(out.data, 12);
+    out_str(out.data, "role");
+    out_str(out.data, follower ? "follower" : "primary");
+    out_str(out.data, "primary");
+    out_str(out.data, follower ? g_repl.host + ":" + std::to_string(g_repl.port) : "");
+    out_str(out.data, "link");
+    out_str(out.data, !follower ? "" : g_repl.link ? K_LINK_NAMES[g_repl.link_state] : "down");
+    out_str(out.data, "syncs");
+    out_int(out.data, static_cast<int64_t>(g_repl.syncs));
+    out_str(out.data, "followers");
+    out_int(out.data, static_cast<int64_t>(g_repl.followers.size()) - syncing);
+    out_str(out.data, "syncing");
+    out_int(out.data, syncing);
+}
+
+// what a command writes: CMD_WRITE changes the keyspace and is sent on to
+// followers once executed, CMD_BACKGROUND starts a task whose deletes and
+// loads reach followers as del and set; followers refuse both from clients
+enum {
+    CMD_WRITE = 1,
+    CMD_BACKGROUND = 2,
+};
+
+// a command, named "<name> <subcommand>" for one with subcommands
+// it takes min_args, min_args + step, ... up to max_args arguments, its name included
+struct Command {
+    const char *name;
+    size_t min_args;
+    size_t max_args;
+    size_t step;
+    void (*run)(std::vector<std::string> &, Response &);
+    void (*run_conn)(Conn *, std::vector<std::string> &, Response &); // for those that need the connection
+    uint32_t flags;
+    uint32_t keys; // KEYS_* of what it writes
+};
+
+static const Command K_COMMANDS[] {
+    { "get",            2, 2, 1, do_get, nullptr, 0, KEYS_NONE },
+    { "set",            3, 4, 1, do_set, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "mset",           3, SIZE_MAX, 2, do_mset, nullptr, CMD_WRITE, KEYS_PAIRS },
+    { "del",            2, 2, 1, do_del, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "pexpire",        3, 3, 1, do_pexpire, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "pttl",           2, 2, 1, do_pttl, nullptr, 0, KEYS_NONE },
+    { "subscribe",      1, 2, 1, nullptr, do_subscribe, 0, KEYS_NONE },
+    { "unsubscribe",    1, 1, 1, nullptr, do_unsubscribe, 0, KEYS_NONE },
+    { "xadd",           5, SIZE_MAX, 2, do_xadd, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "xlen",           2, 2, 1, do_xlen, nullptr, 0, KEYS_NONE },
+    { "xrange",         4, 6, 2, do_xrange, nullptr, 0, KEYS_NONE },
+    { "xread",          4, SIZE_MAX, 1, nullptr, do_xread, 0, KEYS_NONE },
+    { "xgroup",         5, 6, 1, do_xgroup, nullptr, CMD_WRITE, KEYS_SECOND },
+    { "xreadgroup",     7, SIZE_MAX, 1, nullptr, do_xreadgroup, CMD_WRITE, KEYS_STREAMS },
+    { "xack",           4, SIZE_MAX, 1, do_xack, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "xpending",       3, 5, 2, do_xpending, nullptr, 0, KEYS_NONE },
+    { "zadd",           4, SIZE_MAX, 2, do_zadd, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "zscore",         3, 3, 1, do_zscore, nullptr, 0, KEYS_NONE },
+    { "zrem",           3, 3, 1, do_zrem, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "zcard",          2, 2, 1, do_zcard, nullptr, 0, KEYS_NONE },
+    { "zrangebyscore",  4, 6, 2, do_zrangebyscore, nullptr, 0, KEYS_NONE },
+    { "geoadd",         5, SIZE_MAX, 3, do_geoadd, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "geopos",         3, 3, 1, do_geopos, nullptr, 0, KEYS_NONE },
+    { "geodist",        4, 5, 1, do_geodist, nullptr, 0, KEYS_NONE },
+    { "geosearch",      6, SIZE_MAX, 1, do_geosearch, nullptr, 0, KEYS_NONE },
+    { "vcreate",        3, 4, 1, do_vcreate, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "vadd",           4, SIZE_MAX, 1, do_vadd, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "vdel",           3, 3, 1, do_vdel, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "vcard",          2, 2, 1, do_vcard, nullptr, 0, KEYS_NONE },
+    { "vsearch",        4, SIZE_MAX, 1, do_vsearch, nullptr, 0, KEYS_NONE },
+    { "ft.create",      3, 3, 1, do_ft_create, nullptr, CMD_WRITE, KEYS_NONE },
+    { "ft.drop",        2, 2, 1, do_ft_drop, nullptr, CMD_WRITE, KEYS_NONE },
+    { "ft.search",      3, 5, 2, do_ft_search, nullptr, 0, KEYS_NONE },
+    { "ft.info",        2, 2, 1, do_ft_info, nullptr, 0, KEYS_NONE },
+    { "ts.add",         4, 4, 1, do_ts_add, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "ts.get",         2, 2, 1, do_ts_get, nullptr, 0, KEYS_NONE },
+    { "ts.range",       4, SIZE_MAX, 1, do_ts_range, nullptr, 0, KEYS_NONE },
+    { "ts.info",        2, 2, 1, do_ts_info, nullptr, 0, KEYS_NONE },
+    { "json.set",       4, 4, 1, do_json_set, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "json.get",       2, 3, 1, do_json_get, nullptr, 0, KEYS_NONE },
+    { "json.del",       3, 3, 1, do_json_del, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "json.type",      2, 3, 1, do_json_type, nullptr, 0, KEYS_NONE },
+    { "cms.init",       4, 4, 1, do_cms_init, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "cms.incrby",     4, SIZE_MAX, 2, do_cms_incrby, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "cms.query",      3, SIZE_MAX, 1, do_cms_query, nullptr, 0, KEYS_NONE },
+    { "topk.reserve",   3, 6, 3, do_topk_reserve, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "topk.add",       3, SIZE_MAX, 1, do_topk_add, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "topk.list",      2, 3, 1, do_topk_list, nullptr, 0, KEYS_NONE },
+    { "delprefix",      2, 2, 1, do_delprefix, nullptr, CMD_BACKGROUND, KEYS_NONE },
+    { "delpattern",     2, 2, 1, do_delpattern, nullptr, CMD_BACKGROUND, KEYS_NONE },
+    { "delstatus",      2, 2, 1, do_delstatus, nullptr, 0, KEYS_NONE },
+    { "delcancel",      2, 2, 1, do_delcancel, nullptr, 0, KEYS_NONE },
+    { "import",         2, 2, 1, do_import, nullptr, CMD_BACKGROUND, KEYS_NONE },
+    { "importstatus",   2, 2, 1, do_importstatus, nullptr, 0, KEYS_NONE },
+    { "bgsave",         2, 2, 1, do_bgsave, nullptr, 0, KEYS_NONE },
+    { "bgsavestatus",   1, 1, 1, do_bgsavestatus, nullptr, 0, KEYS_NONE },
+    { "checkpoint",     2, 2, 1, do_checkpoint, nullptr, 0, KEYS_NONE },
+    { "checkpointinfo", 1, 1, 1, do_checkpointinfo, nullptr, 0, KEYS_NONE },
+    { "sync",           1, 1, 1, nullptr, do_sync, 0, KEYS_NONE },
+    { "replicaof",      3, 3, 1, do_replicaof, nullptr, 0, KEYS_NONE },
+    { "replinfo",       1, 1, 1, do_replinfo, nullptr, 0, KEYS_NONE },
+    { "snapshot open",  2, 2, 1, nullptr, do_snapshot_open, 0, KEYS_NONE },
+    { "snapshot close", 3, 3, 1, nullptr, do_snapshot_close, 0, KEYS_NONE },
+    { "snapshot get",   4, 4, 1, do_snapshot_get, nullptr, 0, KEYS_NONE },
+    { "snapshot scan",  4, 6, 2, do_snapshot_scan, nullptr, 0, KEYS_NONE },
+    { "dump",           2, 2, 1, do_dump, nullptr, 0, KEYS_NONE },
+    { "restore",        4, 5, 1, do_restore, nullptr, CMD_WRITE, KEYS_FIRST },
+    { "mdump",          2, SIZE_MAX, 1, do_mdump, nullptr, 0, KEYS_NONE },
+    { "mrestore",       3, SIZE_MAX, 1, do_mrestore, nullptr, CMD_WRITE, KEYS_RESTORE },
+    { "hashstats",      1, 1, 1, do_hashstats, nullptr, 0, KEYS_NONE },
+    { "ratelimit",      3, 3, 1, do_ratelimit, nullptr, 0, KEYS_NONE },
+    { "config",         3, 4, 1, do_config, nullptr, 0, KEYS_NONE },
+};
+
+// finds the command a request runs, null if there is none or its argument
+// count doesn't fit
+static const Command *command_find(const std::vector<std::string> &cmd) {
+    static const std::unordered_map<std::string, const Command *> K_BY_NAME = [] {
+        std::unordered_map<std::string, const Command *> by_name;
+        for (const Command &c : K_COMMANDS) {
+            by_name[c.name] = &c;
+        }
+        return by_name;
+    }();
+
+    if (cmd.empty()) {
+        return nullptr;
+    }
+    auto it { K_BY_NAME.find(cmd[0]) };
+    if (it == K_BY_NAME.end() && cmd.size() > 1) {
+        it = K_BY_NAME.find(cmd[0] + " " + cmd[1]);
+    }
+    if (it == K_BY_NAME.end()) {
+        return nullptr;
+    }
+    const Command *c { it->second };
+    if (cmd.size() < c->min_args || cmd.size() > c->max_args || (cmd.size() - c->min_args) % c->step) {
+        return nullptr;
+    }
+    return c;
+}
+
+// handles a single database request from conn and stores into out
+static void do_request(Conn *conn, std::vector<std::string> &cmd, Response &out) {
+    const Command *c { command_find(cmd) };
+    if (!c) {
+        out.status = RES_ERR; // unrecognized command
+        return;
+    }
+    if (c->flags && !g_repl.host.empty() && conn != g_repl.link) {
+        return out_err(out, "read-only follower");
+    }
+    if (c->keys != KEYS_NONE && (!g_mvcc.snapshots.empty() || g_bgsave.running || g_checkpoint.tracking)) {
+        mvcc_before_write(c->keys, cmd);
+    }
+
+    if (c->run_conn) {
+        c->run_conn(conn, cmd, out);
+    } else {
+        c->run(cmd, out);
+    }
+}
+
+// serialize the response
+static void make_response(const Response &resp, std::vector<uint8_t> &out) {
+    uint32_t resp_len { 4 + static_cast<uint32_t>(resp.data.size())};
+    buf_append(out, reinterpret_cast<const uint8_t *>(&resp_len), 4);
+    buf_append(out, reinterpret_cast<const uint8_t *>(&resp.status), 4);
+    buf_append(out, resp.data.data(), resp.data.size());
+}
+
+// scheduling cost of a request with a body of len bytes
+static size_t request_cost(uint32_t len) {
+    return 1 + len / g_config.sched_unit_bytes;
+}
+
+// returns the body length of the next request if it is fully buffered, else -1
+static int64_t next_request_len(Conn *conn) {
+    if (conn->incoming.size() < 4) {
+        return -1;
+    }
+
+    uint32_t len { 0 };
+    memcpy(&len, conn->incoming.data(), 4);
+
+    if (4 + static_cast<size_t>(len) > conn->incoming.size()) {
+        return -1;
+    }
+
+    return len;
+}
+
+// handles one client request, adding its cost to spent
+static bool try_one_request(Conn *conn, size_t &spent) {
+    // grab the length
+    if (conn->incoming.size() < 4) {
+        return false;
+    }
+
+    uint32_t len { 0 };
+    memcpy(&len, conn->incoming.data(), 4);
+
+    if (len > g_config.max_msg) {
+        msg("too long");
+        conn->want_close = true;
+        return false;
+    }
+
+    // grab the request body
+    if (4 + len > conn->incoming.size()) {
+        return false;
+    }
+
+    // over quota, leave the request buffered and pause the connection
+    // both buckets are charged only once both let the request through, and
+    // a request that blocked was charged when it first ran
+    if (!conn->block_deadline_us) {
+        uint64_t now_us { get_monotonic_usec() };
+        uint64_t wait_us { std::max(
+            bucket_wait(conn->ops_bucket, g_config.ratelimit_ops, now_us),
+            bucket_wait(conn->bytes_bucket, g_config.ratelimit_bytes, now_us)
+        ) };
+        if (wait_us > 0) {
+            conn->throttled_until_us = now_us + wait_us;
+            return false;
+        }
+        bucket_take(conn->ops_bucket, g_config.ratelimit_ops, 1);
+        bucket_take(conn->bytes_bucket, g_config.ratelimit_bytes, 4 + len);
+    }
+
+    const uint8_t *request { &conn->incoming[4] };
+
+    // parse the request
+    std::vector<std::string> cmd;
+    if (parse_req(request, len, cmd) < 0) {
+        conn->want_close = true;
+        return false;
+    }
+
+    // a request that blocked runs again in the form it was resolved to
+    if (!conn->block_cmd.empty()) {
+        cmd.swap(conn->block_cmd);
+        conn->block_cmd.clear();
+    }
+
+    // the handlers may consume their arguments, a write is copied for followers
+    std::vector<std::string> write;
+    if (!g_repl.followers.empty()) {
+        const Command *c { command_find(cmd) };
+        if (c && (c->flags & CMD_WRITE)) {
+            write = cmd;
+        }
+    }
+
+    // execute the request
+    Response resp;
+    do_request(conn, cmd, resp);
+
+    // a blocking command found nothing, keep the request until woken
+    if (conn->blocked) {
+        return false;
+    }
+    conn->block_timed_out = false;
+    conn->block_deadline_us = 0;
+    if (!write.empty()) {
+        repl_feed_write(write, resp);
+    }
+
+    // serialize the response
+    make_response(resp, conn->outgoing);
+
+    buf_consume(conn->incoming, 4 + len);
+    spent += request_cost(len);
+
+    return true;
+}
+
+// accepts a new client connection on given file descriptor
+// sets the fd to non-blocking mode and creates the Conn object
+static Conn *handle_accept(int fd) {
+    struct sockaddr_in client_addr { {} };
+    socklen_t addrlen { sizeof(client_addr) };
+    
+    int connfd = accept(fd, reinterpret_cast<struct sockaddr *>(&client_addr), &addrlen);
+    if (connfd < 0) {
+        msg_errno("accept() error");
+        return NULL;
+    }
+
+    // just for debugging
+    uint32_t ip { client_addr.sin_addr.s_addr };
+    fprintf(stderr, "new client from %u.%u.%u.%u:%u\n",
+        ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
+        ntohs(client_addr.sin_port)
+    );
+
+    fd_set_nb(connfd);
+
+    Conn *conn { new Conn() };
+    conn->fd = connfd;
+    conn->want_read = true; 
+    return conn;
+}
+
+// handles writing responses
+static void handle_write(Conn *conn) {
+    assert(conn->outgoing.size() > 0);
+    ssize_t rv { write(conn->fd, conn->outgoing.data(), conn->outgoing.size()) };
+    
+    // a partial write
+    if (rv < 0 && errno == EAGAIN) {
+        return;
+    }
+    
+    if (rv < 0) {
+        msg_errno("write() error");
+        conn->want_close = true;
+        return;
+    }
+
+    buf_consume(conn->outgoing, static_cast<size_t>(rv));
+
+    if (conn->outgoing.size() == 0) { 
+        conn->want_read = true;
+        conn->want_write = false;
+    }
+}
+
+// closes the connection and removes it from the fd map
+static void conn_destroy(std::vector<Conn *> &fd2conn, Conn *conn) {
+    if (conn->subscribed) {
+        g_notify.subscribers--;
+    }
+    if (conn->blocked) {
+        conn_unblock(conn);
+    }
+    if (conn->repl_state != REPL_NONE) {
+        auto &followers { g_repl.followers };
+        followers.erase(std::find(followers.begin(), followers.end(), conn));
+    }
+    if (conn == g_repl.link) {
+        msg("lost the link to the primary");
+        g_repl.link = nullptr;
+    }
+    // snapshots closed by another connection or a sync are gone already
+    if (!conn->snapshots.empty()) {
+        for (uint64_t id : conn->snapshots) {
+            if (g_mvcc.snapshots.count(id)) {
+                mvcc_close(id);
+            }
+        }
+        mvcc_collect();
+    }
+    static_cast<void>(close(conn->fd));
+    fd2conn[conn->fd] = NULL;
+    delete conn;
+}
+
+// executes buffered requests until the connection runs out of budget,
+// leftover requests are picked up again in the next event loop iteration
+// returns the units spent
+static size_t run_requests(Conn *conn, size_t budget) {
+    size_t spent { 0 };
+    while (spent < budget && try_one_request(conn, spent)) {}
+
+    conn->has_pending = !conn->want_close && next_request_len(conn) >= 0;
+
+    if (conn->outgoing.size() > 0) {
+        conn->want_read = false;
+        conn->want_write = true;
+
+        handle_write(conn);
+    }
+    return spent;
+}
+
+// reads what the socket has into incoming, returns false if the
+// connection is to be closed or nothing was read
+static bool read_incoming(Conn *conn) {
+    static std::vector<uint8_t> buf;
+    buf.resize(g_config.read_buffer);
+    ssize_t rv { read(conn->fd, buf.data(), buf.size()) };
+    
+    // partial read
+    if (rv < 0 && errno == EAGAIN) {
+        return false;
+    }
+    
+    if (rv < 0) {
+        msg_errno("read() error");
+        conn->want_close = true;
+        return false;
+    }
+
+    if (rv == 0) {
+        if (conn->incoming.size() == 0) {
+            msg("client closed");
+        } else {
+            msg("unexpected EOF");
+        }
+        conn->want_close = true;
+        return false;
+    }
+
+    buf_append(conn->incoming, buf.data(), static_cast<size_t>(rv));
+
+    return true;
+}
+
+// handles reading requests
+static void handle_read(Conn *conn) {
+    if (read_incoming(conn)) {
+        run_requests(conn, g_config.sched_budget);
+    }
+}
+
+// true if the connection is held back by its rate limit
+static bool conn_throttled(Conn *conn, uint64_t now_us) {
+    return conn->throttled_until_us > now_us;
+}
+
+// true if the connection has leftover requests and is not blocked on writing
+static bool conn_runnable(Conn *conn, uint64_t now_us) {
+    return conn->has_pending && conn->want_read && !conn->want_close
+        && !conn->blocked && !conn_throttled(conn, now_us);
+}
+
+// serves connections with leftover requests, one budget each per iteration
+static void run_pending(std::vector<Conn *> &fd2conn) {
+    static size_t rr_start { 0 };
+
+    uint64_t now_us { get_monotonic_usec() };
+    std::vector<Conn *> runnable;
+    for (size_t i = 0; i < fd2conn.size(); ++i) {
+        // rotate the starting point so no connection always goes first
+        Conn *conn { fd2conn[(rr_start + i) % fd2conn.size()] };
+        if (conn && conn_runnable(conn, now_us)) {
+            runnable.push_back(conn);
+        }
+    }
+    rr_start++;
+
+    // smallest first, the connections share one budget of sched-budget units
+    // each, so those with small requests may spend what bulk ones would have;
+    // a connection still serves a request when the budget has run out
+    size_t shared { g_config.sched_budget * runnable.size() };
+    if (g_config.sched_mode == SCHED_SMALL_FIRST) {
+        std::stable_sort(runnable.begin(), runnable.end(), [](Conn *a, Conn *b) {
+            return next_request_len(a) < next_request_len(b);
+        });
+    }
+
+    for (Conn *conn : runnable) {
+        if (g_config.sched_mode == SCHED_SMALL_FIRST) {
+            shared -= std::min(shared, run_requests(conn, std::max<size_t>(shared, 1)));
+        } else {
+            run_requests(conn, g_config.sched_budget);
+        }
+        if (conn->want_close) {
+            conn_destroy(fd2conn, conn);
+        }
+    }
+}
+
+// a snapshot being written to a file, a chunk at a time
+struct SnapshotSave {
+    int fd { -1 };
+    std::vector<uint8_t> buf; // the chunk being written, behind its header
+    uint64_t chunk_keys { 0 };
+    bool ok { true };
+};
+
+// fills in the header of the chunk being written and writes it out
+static void snapshot_end_chunk(SnapshotSave &save) {
+    uint64_t len { save.buf.size() - 16 };
+    memcpy(save.buf.data(), &len, 8);
+    memcpy(save.buf.data() + 8, &save.chunk_keys, 8);
+    save.chunk_keys = 0;
+    save.ok = write_all(save.fd, save.buf.data(), save.buf.size());
+    save.buf.clear();
+}
+
+static bool snapshot_save_entry(HashNode *node, void *arg) {
+    SnapshotSave &save { *static_cast<SnapshotSave *>(arg) };
+    Entry *ent { container_of(node, Entry, node) };
+    if (ent->deleted) {
+        return true;
+    }
+    if (save.chunk_keys == 0) {
+        save.buf.resize(16);
+    }
+    snapshot_write_entry(save.buf, ent);
+    if (++save.chunk_keys == K_SNAPSHOT_CHUNK_KEYS || save.buf.size() >= K_BGSAVE_BUFFER) {
+        snapshot_end_chunk(save);
+    }
+    return save.ok;
+}
+
+// writes the keyspace and the text index definitions to fd, indexes are rebuilt on load
+// format: magic version nkeys chunk... nindexes (name prefix)...
+// a chunk is (nbytes nkeys (klen key expire_at_ms type value)...) and holds at most
+// K_SNAPSHOT_CHUNK_KEYS keys or about K_BGSAVE_BUFFER bytes, so it can be
+// written out before the total is known; returns false on a write error
+static bool snapshot_save(int fd) {
+    SnapshotSave save;
+    save.fd = fd;
+    write_u32(save.buf, K_SNAPSHOT_MAGIC);
+    write_u32(save.buf, K_SNAPSHOT_VERSION);
+    write_u64(save.buf, hash_map_size(&g_data.db) - g_mvcc.tombstones);
+    if (!write_all(fd, save.buf.data(), save.buf.size())) {
+        return false;
+    }
+    save.buf.clear();
+    hash_map_foreach(&g_data.db, &snapshot_save_entry, &save);
+    if (save.ok && save.chunk_keys > 0) {
+        snapshot_end_chunk(save);
+    }
+
+    std::vector<uint8_t> trailer;
+    write_u32(trailer, static_cast<uint32_t>(g_text_indexes.size()));
+    for (auto &[name, ti] : g_text_indexes) {
+        write_str(trailer, name);
+        write_str(trailer, ti->ft.prefix);
+    }
+    return save.ok && write_all(fd, trailer.data(), trailer.size());
+}
+
+// a chunk of a snapshot, decoded by one of the loading threads
+struct SnapshotChunk {
+    const uint8_t *begin { nullptr };
+    const uint8_t *end { nullptr };
+    uint64_t nkeys { 0 };
+    HashNode **nodes { nullptr }; // where its entries go
+    std::vector<std::pair<Entry *, int64_t>> ttls; // entries that expire
+    bool ok { false };
+};
+
+// decodes the entries of a chunk, which must use up its bytes
+static void snapshot_decode_chunk(SnapshotChunk &chunk) {
+    const uint8_t *cur { chunk.begin };
+    for (uint64_t i = 0; i < chunk.nkeys; ++i) {
+        Entry *ent { new Entry() };
+        uint64_t expire_at_ms { 0 };
+        uint32_t type { 0 };
+        if (!read_lstr(cur, chunk.end, ent->key) || !read_u64(cur, chunk.end, expire_at_ms)
+            || !read_u32(cur, chunk.end, type) || !entry_decode_value(cur, chunk.end, type, ent)) {
+            entry_reset(ent);
+            delete ent;
+            return;
+        }
+        ent->node.hash_code = key_hash(ent->key);
+        chunk.nodes[i] = &ent->node;
+        if (int64_t ttl_ms = expire_at_to_ttl(expire_at_ms); ttl_ms >= 0) {
+            chunk.ttls.emplace_back(ent, ttl_ms);
+        }
+    }
+    chunk.ok = cur == chunk.end;
+}
+
+// decodes the chunks of a snapshot on load-threads threads
+static bool snapshot_decode(std::vector<SnapshotChunk> &chunks, size_t threads) {
+    std::atomic<size_t> next { 0 };
+    auto work = [&chunks, &next] {
+        for (size_t i = next++; i < chunks.size(); i = next++) {
+            snapshot_decode_chunk(chunks[i]);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; ++t) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (std::thread &thread : pool) {
+        thread.join();
+    }
+
+    bool ok { true };
+    for (SnapshotChunk &chunk : chunks) {
+        ok &= chunk.ok;
+    }
+    return ok;
+}
+
+// frees the decoded entries of a snapshot that failed to load
+static void snapshot_free_nodes(std::vector<HashNode *> &nodes) {
+    for (HashNode *node : nodes) {
+        if (node) {
+            Entry *ent { container_of(node, Entry, node) };
+            entry_reset(ent);
+            delete ent;
+        }
+    }
+}
+
+// reads the text index definitions at the end of a snapshot, the indexes
+// are rebuilt by their keyspace scans
+static bool snapshot_read_indexes(const uint8_t *&cur, const uint8_t *end) {
+    uint32_t nindexes { 0 };
+    if (!read_u32(cur, end, nindexes)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < nindexes; ++i) {
+        std::string name;
+        TextIndex *ti { new TextIndex() };
+        if (!read_lstr(cur, end, name) || !read_lstr(cur, end, ti->ft.prefix)) {
+            delete ti;
+            return false;
+        }
+        g_text_indexes[name] = ti;
+    }
+    return true;
+}
+
+// reads the header of a snapshot chunk, which must fit in what remains
+static bool snapshot_read_chunk(const uint8_t *&cur, const uint8_t *end, uint64_t keys_left, SnapshotChunk &chunk) {
+    uint64_t len { 0 };
+    if (!read_u64(cur, end, len) || !read_u64(cur, end, chunk.nkeys) || len > static_cast<uint64_t>(end - cur)) {
+        return false;
+    }
+    if (chunk.nkeys == 0 || chunk.nkeys > keys_left || chunk.nkeys > len / K_SNAPSHOT_MIN_ENTRY) {
+        return false;
+    }
+    chunk.begin = cur;
+    chunk.end = cur + len;
+    cur += len;
+    return true;
+}
+
+// loads a serialized keyspace into an empty database
+// the chunks are decoded in parallel, then inserted in parallel by bucket range
+static bool snapshot_load(const uint8_t *&cur, const uint8_t *end) {
+    uint32_t magic { 0 };
+    uint32_t version { 0 };
+    uint64_t nkeys { 0 };
+    if (!read_u32(cur, end, magic) || !read_u32(cur, end, version) || !read_u64(cur, end, nkeys)) {
+        return false;
+    }
+    if (magic != K_SNAPSHOT_MAGIC || version != K_SNAPSHOT_VERSION) {
+        return false;
+    }
+
+    // the count is bounded by what the remaining bytes can hold in case it is corrupt
+    if (nkeys > static_cast<size_t>(end - cur) / K_SNAPSHOT_MIN_ENTRY) {
+        return false;
+    }
+    std::vector<HashNode *> nodes(nkeys);
+    std::vector<SnapshotChunk> chunks;
+    for (uint64_t loaded = 0; loaded < nkeys; loaded += chunks.back().nkeys) {
+        chunks.emplace_back();
+        if (!snapshot_read_chunk(cur, end, nkeys - loaded, chunks.back())) {
+            return false;
+        }
+        chunks.back().nodes = nodes.data() + loaded;
+    }
+
+    size_t threads { g_config.load_threads ? g_config.load_threads : std::thread::hardware_concurrency() };
+    threads = std::max<size_t>(1, std::min(threads, chunks.size()));
+    if (!snapshot_decode(chunks, threads)) {
+        snapshot_free_nodes(nodes);
+        return false;
+    }
+
+    hash_map_insert_parallel(&g_data.db, nodes.data(), nodes.size(), threads);
+    for (SnapshotChunk &chunk : chunks) {
+        for (auto &[ent, ttl_ms] : chunk.ttls) {
+            entry_set_ttl(ent, ttl_ms);
+        }
+    }
+    return snapshot_read_indexes(cur, end);
+}
+
+// adds a connection to the fd map
+static void conn_add(std::vector<Conn *> &fd2conn, Conn *conn) {
+    if (fd2conn.size() <= static_cast<size_t>(conn->fd)) {
+        fd2conn.resize(conn->fd + 1);
+    }
+    assert(!fd2conn[conn->fd]);
+    fd2conn[conn->fd] = conn;
+}
+
+// directory of the unix sockets new server processes connect to on restart,
+// private to this user so no one else can take over the keyspace
+static std::string handoff_dir_path() {
+    return "/tmp/monkeydb-" + std::to_string(geteuid());
+}
+
+// path of the unix socket a new server process connects to on restart
+static std::string handoff_path() {
+    return handoff_dir_path() + "/" + std::to_string(g_config.port) + ".sock";
+}
+
+// a handoff sent to a new process, waiting for it to confirm
+// the new process owns the keyspace and clients as of the snapshot, so the
+// event loop serves nothing meanwhile; there is no timeout, as resuming while
+// the new process still loads would leave both serving the same sockets
+static struct {
+    int sock { -1 };
+    size_t nconns { 0 };
+} g_handoff;
+
+// hands the listening socket, the keyspace, and optionally all client
+// connections over to a new process connected to the handoff socket
+// its confirmation is awaited by the event loop, see g_handoff
+static void handle_handoff(int handoff_fd, int listen_fd, std::vector<Conn *> &fd2conn) {
+    int sock { accept(handoff_fd, NULL, NULL) };
+    if (sock < 0) {
+        msg_errno("handoff accept() error");
+        return;
+    }
+    if (!handoff_peer_ok(sock)) {
+        msg("handoff refused, the new process runs as another user");
+        close(sock);
+        return;
+    }
+
+    // the snapshots a connection opened cannot be carried over, so it is
+    // left to be closed when this process exits; so are followers and the
+    // link to the primary, which sync again with the new process
+    std::vector<Conn *> conns;
+    if (g_config.handoff_clients) {
+        for (Conn *conn : fd2conn) {
+            if (conn && !conn->want_close && conn->snapshots.empty()
+                && conn->repl_state == REPL_NONE && conn != g_repl.link) {
+                conns.push_back(conn);
+            }
+        }
+    }
+
+    // the keyspace, the connections and the leases are written straight into a memfd
+    // format: snapshot nconns (want_read want_write subscribed prefix incoming outgoing
+    // ops_bucket bytes_bucket throttled_until block_deadline)... next_lease
+    // nleases (key token until has_stale stale)... primary_host primary_port
+    // a blocked request is still buffered in incoming and blocks again there
+    int memfd { memfd_create("monkeydb-handoff", MFD_CLOEXEC) };
+    bool ok { memfd >= 0 && snapshot_save(memfd) };
+    std::vector<uint8_t> buf;
+    write_u32(buf, static_cast<uint32_t>(conns.size()));
+    ok = ok && write_all(memfd, buf.data(), buf.size());
+    for (size_t i = 0; ok && i < conns.size(); ++i) {
+        Conn *conn { conns[i] };
+        buf.clear();
+        write_u32(buf, conn->want_read);
+        write_u32(buf, conn->want_write);
+        write_u32(buf, conn->subscribed);
+        write_str(buf, conn->sub_prefix);
+        write_str(buf, conn->incoming.data(), conn->incoming.size());
+        write_str(buf, conn->outgoing.data(), conn->outgoing.size());
+        for (TokenBucket *bucket : { &conn->ops_bucket, &conn->bytes_bucket }) {
+            write_dbl(buf, bucket->tokens);
+            write_u64(buf, bucket->last_us);
+        }
+        write_u64(buf, conn->throttled_until_us);
+        write_u64(buf, conn->blocked ? conn->block_deadline_us : 0);
+        ok = write_all(memfd, buf.data(), buf.size());
+    }
+    buf.clear();
+    write_u64(buf, g_next_lease);
+    write_u32(buf, static_cast<uint32_t>(g_leases.size()));
+    for (const HeapItem &item : g_leases) {
+        Lease *lease { container_of(item.ref, Lease, heap_idx) };
+        write_str(buf, lease->ent->key);
+        write_u64(buf, lease->token);
+        write_u64(buf, lease->until_us);
+        write_u32(buf, lease->has_stale);
+        write_str(buf, lease->stale);
+    }
+    write_str(buf, g_repl.host);
+    write_u64(buf, g_repl.port);
+    ok = ok && write_all(memfd, buf.data(), buf.size());
+
+    // the first message carries the listening socket and the snapshot,
+    // followed by the client sockets in batches
+    int fds[2] { listen_fd, memfd };
+    ok = ok && handoff_send_fds(sock, fds, 2, static_cast<uint32_t>(conns.size()));
+
+    std::vector<int> client_fds;
+    for (Conn *conn : conns) {
+        client_fds.push_back(conn->fd);
+    }
+    for (size_t i = 0; ok && i < client_fds.size(); i += K_HANDOFF_MAX_FDS) {
+        size_t n { std::min(K_HANDOFF_MAX_FDS, client_fds.size() - i) };
+        ok = handoff_send_fds(sock, &client_fds[i], n, static_cast<uint32_t>(n));
+    }
+
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    if (!ok) {
+        close(sock);
+        msg("handoff failed, still serving");
+        return;
+    }
+    g_handoff.sock = sock;
+    g_handoff.nconns = conns.size();
+}
+
+// ends the handoff once the new process confirms, exiting, or goes away,
+// serving on
+static void handoff_finish() {
+    char ack { 0 };
+    bool ok { read(g_handoff.sock, &ack, 1) == 1 };
+    close(g_handoff.sock);
+    g_handoff.sock = -1;
+
+    if (!ok) {
+        msg("handoff failed, still serving");
+        return;
+    }
+
+    fprintf(stderr, "handed over %zu keys and %zu clients\n",
+        hash_map_size(&g_data.db), g_handoff.nconns);
+    exit(0);
+}
+
+// takes over the listening socket, keyspace and clients of a running server
+// returns the listening fd, or -1 if there is no server to take over from
+static int takeover(std::vector<Conn *> &fd2conn) {
+    int sock { handoff_connect(handoff_path().c_str()) };
+    if (sock < 0) {
+        return -1;
+    }
+    if (!handoff_peer_ok(sock)) {
+        die("handoff: the running server is another user's");
+    }
+
+    std::vector<int> fds;
+    uint32_t nconns { 0 };
+    if (!handoff_recv_fds(sock, fds, nconns) || fds.size() != 2) {
+        die("handoff: bad message");
+    }
+
+    while (fds.size() < 2 + nconns) {
+        uint32_t n { 0 };
+        if (!handoff_recv_fds(sock, fds, n)) {
+            die("handoff: bad message");
+        }
+    }
+
+    struct stat st;
+    if (fstat(fds[1], &st)) {
+        die("handoff: fstat()");
+    }
+
+    size_t size { static_cast<size_t>(st.st_size) };
+    void *data { mmap(NULL, size, PROT_READ, MAP_PRIVATE, fds[1], 0) };
+    if (data == MAP_FAILED) {
+        die("handoff: mmap()");
+    }
+
+    const uint8_t *cur { static_cast<const uint8_t *>(data) };
+    const uint8_t *end { cur + size };
+    uint32_t n { 0 };
+    uint64_t load_start_us { get_monotonic_usec() };
+    if (!snapshot_load(cur, end) || !read_u32(cur, end, n) || n != nconns) {
+        die("handoff: bad snapshot");
+    }
+    uint64_t load_us { get_monotonic_usec() - load_start_us };
+
+    for (uint32_t i = 0; i < nconns; ++i) {
+        Conn *conn { new Conn() };
+        conn->fd = fds[2 + i];
+
+        uint32_t want_read { 0 };
+        uint32_t want_write { 0 };
+        uint32_t subscribed { 0 };
+        std::string incoming;
+        std::string outgoing;
+        if (!read_u32(cur, end, want_read) || !read_u32(cur, end, want_write)
+            || !read_u32(cur, end, subscribed) || !read_lstr(cur, end, conn->sub_prefix)
+            || !read_lstr(cur, end, incoming) || !read_lstr(cur, end, outgoing)) {
+            die("handoff: bad snapshot");
+        }
+
+        conn->want_read = want_read;
+        conn->want_write = want_write;
+        conn->subscribed = subscribed;
+        g_notify.subscribers += conn->subscribed;
+        conn->incoming.assign(incoming.begin(), incoming.end());
+        conn->outgoing.assign(outgoing.begin(), outgoing.end());
+        for (TokenBucket *bucket : { &conn->ops_bucket, &conn->bytes_bucket }) {
+            if (!read_dbl(cur, end, bucket->tokens) || !read_u64(cur, end, bucket->last_us)) {
+                die("handoff: bad snapshot");
+            }
+        }
+        if (!read_u64(cur, end, conn->throttled_until_us) || !read_u64(cur, end, conn->block_deadline_us)) {
+            die("handoff: bad snapshot");
+        }
+        conn->has_pending = next_request_len(conn) >= 0;
+        conn_add(fd2conn, conn);
+    }
+
+    uint32_t nleases { 0 };
+    if (!read_u64(cur, end, g_next_lease) || !read_u32(cur, end, nleases)) {
+        die("handoff: bad snapshot");
+    }
+    for (uint32_t i = 0; i < nleases; ++i) {
+        std::string key;
+        uint64_t token { 0 };
+        uint64_t until_us { 0 };
+        uint32_t has_stale { 0 };
+        std::string stale;
+        if (!read_lstr(cur, end, key) || !read_u64(cur, end, token) || !read_u64(cur, end, until_us)
+            || !read_u32(cur, end, has_stale) || !read_lstr(cur, end, stale)) {
+            die("handoff: bad snapshot");
+        }
+        Entry *ent { entry_lookup_any(key) };
+        if (!ent) {
+            ent = entry_create_deleted(key);
+        }
+        if (!ent->lease) {
+            ent->lease = new Lease();
+        }
+        ent->lease->token = token;
+        ent->lease->has_stale = has_stale;
+        ent->lease->stale.swap(stale);
+        lease_queue(ent, until_us);
+    }
+
+    // a follower's new process connects to the primary and syncs
+    if (!read_lstr(cur, end, g_repl.host) || !read_u64(cur, end, g_repl.port)) {
+        die("handoff: bad snapshot");
+    }
+
+    munmap(data, size);
+    close(fds[1]);
+
+    // let the old process exit
+    char ack { 1 };
+    if (write(sock, &ack, 1) != 1) {
+        die("handoff: write()");
+    }
+    close(sock);
+
+    fprintf(stderr, "took over %zu keys and %u clients, loaded in %.3fs\n",
+        hash_map_size(&g_data.db), nconns, static_cast<double>(load_us) / 1e6);
+    return fds[0];
+}
+
+// maps a file for reading, returns null if it cannot be read or is empty
+static const uint8_t *map_file(const std::string &path, size_t &size) {
+    int fd { open(path.c_str(), O_RDONLY | O_CLOEXEC) };
+    if (fd < 0) {
+        msg_errno(("load: " + path).c_str());
+        return nullptr;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        msg(("load: " + path + " is empty").c_str());
+        return nullptr;
+    }
+    size = static_cast<size_t>(st.st_size);
+    void *data { mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) };
+    close(fd);
+    if (data == MAP_FAILED) {
+        msg_errno("load: mmap()");
+        return nullptr;
+    }
+    return static_cast<const uint8_t *>(data);
+}
+
+// loads a snapshot file written by bgsave into the empty keyspace
+static bool load_snapshot(const std::string &path) {
+    size_t size { 0 };
+    const uint8_t *data { map_file(path, size) };
+    if (!data) {
+        return false;
+    }
+    const uint8_t *cur { data };
+    bool ok { snapshot_load(cur, data + size) && cur == data + size };
+    munmap(const_cast<uint8_t *>(data), size);
+    if (!ok) {
+        msg(("load: bad snapshot " + path).c_str());
+    }
+    return ok;
+}
+
+// applies a delta checkpoint: each record replaces its key, or deletes it,
+// and the text index definitions replace those loaded before
+static bool delta_apply(const uint8_t *&cur, const uint8_t *end, uint64_t series, uint64_t seq) {
+    uint32_t magic { 0 };
+    uint32_t version { 0 };
+    uint64_t delta_series { 0 };
+    uint64_t delta_seq { 0 };
+    uint64_t nkeys { 0 };
+    if (!read_u32(cur, end, magic) || !read_u32(cur, end, version) || !read_u64(cur, end, delta_series)
+        || !read_u64(cur, end, delta_seq) || !read_u64(cur, end, nkeys)) {
+        return false;
+    }
+    if (magic != K_DELTA_MAGIC || version != K_SNAPSHOT_VERSION || delta_series != series || delta_seq != seq) {
+        return false;
+    }
+
+    SnapshotChunk chunk;
+    for (uint64_t left = nkeys; left > 0; left -= chunk.nkeys) {
+        if (!snapshot_read_chunk(cur, end, left, chunk)) {
+            return false;
+        }
+        const uint8_t *rec { chunk.begin };
+        for (uint64_t i = 0; i < chunk.nkeys; ++i) {
+            std::string key;
+            uint64_t expire_at_ms { 0 };
+            uint32_t type { 0 };
+            if (!read_lstr(rec, chunk.end, key) || !read_u64(rec, chunk.end, expire_at_ms) || !read_u32(rec, chunk.end, type)) {
+                return false;
+            }
+            if (Entry *old = entry_peek(key)) {
+                entry_remove(old);
+            }
+            if (Entry *old = entry_lookup_any(key)) {
+                lease_drop(old); // no snapshots are open while loading
+            }
+            if (type == K_DELTA_DELETED) {
+                continue;
+            }
+            Entry *ent { new Entry() };
+            if (!entry_decode_value(rec, chunk.end, type, ent)) {
+                entry_reset(ent);
+                delete ent;
+                return false;
+            }
+            ent->key.swap(key);
+            ent->node.hash_code = key_hash(ent->key);
+            hash_map_insert(&g_data.db, &ent->node);
+            entry_set_ttl(ent, expire_at_to_ttl(expire_at_ms));
+        }
+        if (rec != chunk.end) {
+            return false;
+        }
+    }
+
+    for (auto &[name, ti] : g_text_indexes) {
+        delete ti;
+    }
+    g_text_indexes.clear();
+    return snapshot_read_indexes(cur, end);
+}
+
+// loads the newest series of checkpoints in dir: its base, then its deltas
+// in order up to the first one missing; later checkpoints continue the series
+static bool load_checkpoint(const std::string &dir) {
+    DIR *d { opendir(dir.c_str()) };
+    if (!d) {
+        msg_errno("load: opendir()");
+        return false;
+    }
+    uint64_t series { 0 };
+    while (struct dirent *de = readdir(d)) {
+        std::string name { de->d_name };
+        uint64_t n { 0 };
+        if (name.size() > 5 && name.compare(name.size() - 5, 5, ".base") == 0
+            && str2u64(name.substr(0, name.size() - 5), n)) {
+            series = std::max(series, n);
+        }
+    }
+    closedir(d);
+    if (!series || !load_snapshot(checkpoint_path(dir, series, 0))) {
+        msg("load: no base checkpoint");
+        return false;
+    }
+
+    uint64_t seq { 0 };
+    struct stat st {};
+    while (stat(checkpoint_path(dir, series, seq + 1).c_str(), &st) == 0) {
+        std::string path { checkpoint_path(dir, series, ++seq) };
+        size_t size { 0 };
+        const uint8_t *data { map_file(path, size) };
+        if (!data) {
+            return false;
+        }
+        const uint8_t *cur { data };
+        bool ok { delta_apply(cur, data + size, series, seq) && cur == data + size };
+        munmap(const_cast<uint8_t *>(data), size);
+        if (!ok) {
+            msg(("load: bad delta " + path).c_str());
+            return false;
+        }
+    }
+
+    g_checkpoint.dir = dir;
+    g_checkpoint.series = series;
+    g_checkpoint.seq = seq;
+    g_checkpoint.tracking = true;
+    g_checkpoint.last_us = get_monotonic_usec();
+    fprintf(stderr, "checkpoint %llu: base and %llu deltas\n",
+        static_cast<unsigned long long>(series), static_cast<unsigned long long>(seq));
+    return true;
+}
+
+// loads a snapshot file written by bgsave, or the checkpoints in a directory,
+// into the empty keyspace
+static bool load_file(const char *path) {
+    uint64_t load_start_us { get_monotonic_usec() };
+    struct stat st {};
+    bool is_dir { stat(path, &st) == 0 && S_ISDIR(st.st_mode) };
+    if (!(is_dir ? load_checkpoint(path) : load_snapshot(path))) {
+        return false;
+    }
+    fprintf(stderr, "loaded %zu keys in %.3fs\n", hash_map_size(&g_data.db),
+        static_cast<double>(get_monotonic_usec() - load_start_us) / 1e6);
+    return true;
+}
+
+// writes the loaded keyspace to path as one snapshot, or into a directory as
+// the base of a new series of checkpoints, for --merge
+static bool merge_to(const char *path) {
+    std::string out { path };
+    struct stat st {};
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        out = checkpoint_path(out, get_realtime_msec(), 0);
+    }
+    int fd { open((out + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) };
+    if (fd < 0) {
+        msg_errno("merge: open()");
+        return false;
+    }
+    bgsave_start(fd, out, SAVE_FILE);
+    while (g_bgsave.running) {
+        process_bgsave();
+    }
+    if (!g_bgsave.error.empty()) {
+        msg(("merge: " + g_bgsave.error).c_str());
+        return false;
+    }
+    fprintf(stderr, "merged %zu keys into %s\n", hash_map_size(&g_data.db), out.c_str());
+    return true;
+}
+
+// interval between attempts to reach the primary
+const uint64_t K_REPL_RETRY_US = 1000 * 1000;
+
+// connects a follower to its primary and asks it for a sync, unless a link
+// is up or the last attempt was too recent
+static void repl_connect(std::vector<Conn *> &fd2conn) {
+    uint64_t now_us { get_monotonic_usec() };
+    if (g_repl.host.empty() || g_repl.link || now_us < g_repl.retry_at_us) {
+        return;
+    }
+    g_repl.retry_at_us = now_us + K_REPL_RETRY_US;
+
+    // the host is an address checked by replicaof, nothing to resolve
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(g_repl.port));
+    if (inet_pton(AF_INET, g_repl.host.c_str(), &addr.sin_addr) != 1) {
+        msg("bad primary address");
+        return;
+    }
+    int fd { socket(AF_INET, SOCK_STREAM, 0) };
+    if (fd < 0) {
+        msg_errno("socket()");
+        return;
+    }
+    fd_set_nb(fd);
+    int rv { connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) };
+    if (rv < 0 && errno != EINPROGRESS) {
+        msg_errno("connect() to the primary");
+        close(fd);
+        return;
+    }
+
+    // the request goes out once the connection is established
+    Conn *conn { new Conn() };
+    conn->fd = fd;
+    conn->want_write = true;
+    write_u32(conn->outgoing, 4 + 4 + 4);
+    write_u32(conn->outgoing, 1);
+    write_str(conn->outgoing, "sync");
+    conn_add(fd2conn, conn);
+    g_repl.link = conn;
+    g_repl.link_state = LINK_ACK;
+}
+
+static bool collect_entry(HashNode *node, void *arg) {
+    static_cast<std::vector<Entry *> *>(arg)->push_back(container_of(node, Entry, node));
+    return true;
+}
+
+// empties the keyspace for a sync: open snapshots are closed, text indexes
+// dropped and imports stopped, a background save still sees the old keys
+// and the next checkpoint is a base
+// followers of this server are dropped, they have the old keyspace and
+// must sync the new one
+static void keyspace_clear() {
+    for (Conn *conn : g_repl.followers) {
+        if (!conn->want_close) {
+            conn->want_close = true;
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    g_mvcc.snapshots.clear();
+    g_mvcc.open_versions.clear();
+    mvcc_collect();
+    for (auto &[name, ti] : g_text_indexes) {
+        delete ti;
+    }
+    g_text_indexes.clear();
+    for (auto &[id, task] : g_import_tasks) {
+        if (task->running) {
+            import_finish(task, "replaced by a sync");
+        }
+    }
+    g_checkpoint.tracking = false;
+
+    std::vector<Entry *> entries;
+    hash_map_foreach(&g_data.db, &collect_entry, &entries);
+    for (Entry *ent : entries) {
+        if (!ent->deleted) {
+            entry_remove(ent);
+        }
+    }
+    // what is left is kept for leases, the synced keys take their place
+    entries.clear();
+    hash_map_foreach(&g_data.db, &collect_entry, &entries);
+    for (Entry *ent : entries) {
+        lease_drop(ent);
+    }
+}
+
+// loads a chunk of the snapshot being received from the primary
+static bool repl_load_chunk(const uint8_t *cur, const uint8_t *end) {
+    SnapshotChunk chunk;
+    if (!snapshot_read_chunk(cur, end, g_repl.keys_left, chunk) || cur != end) {
+        return false;
+    }
+    std::vector<HashNode *> nodes(chunk.nkeys);
+    chunk.nodes = nodes.data();
+    snapshot_decode_chunk(chunk);
+    if (!chunk.ok) {
+        snapshot_free_nodes(nodes);
+        return false;
+    }
+
+    // reserved as chunks arrive, the key count of the header is only the
+    // primary's word, while a chunk's is bounded by the bytes it came in
+    hash_map_reserve(&g_data.db, hash_map_size(&g_data.db) + nodes.size());
+
+    // new to a background save of the follower
+    for (HashNode *node : nodes) {
+        container_of(node, Entry, node)->save_epoch = g_bgsave.epoch;
+        hash_map_insert(&g_data.db, node);
+    }
+    for (auto &[ent, ttl_ms] : chunk.ttls) {
+        entry_set_ttl(ent, ttl_ms);
+    }
+    g_repl.keys_left -= chunk.nkeys;
+    return true;
+}
+
+// handles a frame from the primary: the snapshot as responses to sync,
+// then writes as requests, executed like a client's but without replies
+static bool repl_link_frame(Conn *conn, const uint8_t *cur, const uint8_t *end) {
+    if (g_repl.link_state == LINK_STREAM) {
+        std::vector<std::string> cmd;
+        if (parse_req(cur, static_cast<size_t>(end - cur), cmd) < 0) {
+            return false;
+        }
+        // chained followers get the write too
+        std::vector<std::string> write;
+        if (!g_repl.followers.empty()) {
+            write = cmd;
+        }
+        Response resp;
+        do_request(conn, cmd, resp);
+        if (conn->blocked) {
+            conn_unblock(conn);
+            conn->block_cmd.clear();
+        }
+        if (!write.empty()) {
+            repl_feed_write(write, resp);
+        }
+        return true;
+    }
+
+    uint32_t status { 0 };
+    if (!read_u32(cur, end, status)) {
+        return false;
+    }
+    if (status != RES_OK) {
+        std::string err(cur, end);
+        msg(("sync refused: " + err).c_str());
+        return false;
+    }
+
+    uint32_t magic { 0 };
+    uint32_t version { 0 };
+    uint64_t nkeys { 0 };
+    switch (g_repl.link_state) {
+    case LINK_ACK:
+        g_repl.link_state = LINK_HEADER;
+        return cur == end;
+    case LINK_HEADER:
+        if (!read_u32(cur, end, magic) || !read_u32(cur, end, version) || !read_u64(cur, end, nkeys)
+            || magic != K_SNAPSHOT_MAGIC || version != K_SNAPSHOT_VERSION || cur != end) {
+            return false;
+        }
+        keyspace_clear();
+        g_repl.keys_left = nkeys;
+        g_repl.link_state = nkeys ? LINK_CHUNKS : LINK_TRAILER;
+        fprintf(stderr, "syncing %llu keys from the primary\n", static_cast<unsigned long long>(nkeys));
+        return true;
+    case LINK_CHUNKS:
+        if (!repl_load_chunk(cur, end)) {
+            return false;
+        }
+        if (g_repl.keys_left == 0) {
+            g_repl.link_state = LINK_TRAILER;
+        }
+        return true;
+    case LINK_TRAILER:
+        if (!snapshot_read_indexes(cur, end) || cur != end) {
+            return false;
+        }
+        g_repl.link_state = LINK_STREAM;
+        g_repl.syncs++;
+        fprintf(stderr, "synced %zu keys from the primary\n", hash_map_size(&g_data.db));
+        return true;
+    }
+    return false;
+}
+
+// reads from the link to the primary and handles the complete frames,
+// loading the snapshot chunk by chunk as it arrives
+static void repl_link_read(Conn *conn) {
+    if (!read_incoming(conn)) {
+        return;
+    }
+    size_t pos { 0 };
+    while (!conn->want_close && conn->incoming.size() - pos >= 4) {
+        uint32_t len { 0 };
+        memcpy(&len, conn->incoming.data() + pos, 4);
+        if (conn->incoming.size() - pos - 4 < len) {
+            break;
+        }
+        const uint8_t *frame { conn->incoming.data() + pos + 4 };
+        if (!repl_link_frame(conn, frame, frame + len)) {
+            msg("bad frame from the primary");
+            conn->want_close = true;
+        }
+        pos += 4 + len;
+    }
+    buf_consume(conn->incoming, pos);
+}
+
+// milliseconds until replication has work to do, -1 if it has none
+static int repl_timeout_ms(uint64_t now_us) {
+    uint64_t wake_us { 0 };
+    if (!g_repl.host.empty() && !g_repl.link) {
+        wake_us = g_repl.retry_at_us;
+    } else if (!g_bgsave.running && repl_waiting()) {
+        wake_us = g_repl.wait_since_us + g_config.repl_sync_delay * 1000;
+    } else {
+        return -1;
+    }
+    return poll_wait_ms(wake_us, now_us);
+}
+
+// creates the listening socket for clients
+static int listen_socket() {
+    int fd { socket(AF_INET, SOCK_STREAM, 0) };
+    if (fd < 0) {
+        die("socket()");
+    }
+    int val { 1 };
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+    // bind
+    struct sockaddr_in addr { {} };
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(static_cast<uint16_t>(g_config.port));
+    addr.sin_addr.s_addr = ntohl(0);
+    int rv { bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) };
+    if (rv) {
+        die("bind()");
+    }
+
+    // set the listen fd to nonblocking mode
+    fd_set_nb(fd);
+
+    rv = listen(fd, SOMAXCONN);
+    if (rv) {
+        die("listen()");
+    }
+    return fd;
+}
+
+// lets blocked connections whose timeout passed reply with nothing
+static void process_block_timeouts(std::vector<Conn *> &fd2conn) {
+    uint64_t now_us { get_monotonic_usec() };
+    for (Conn *conn : fd2conn) {
+        if (conn && conn->blocked && conn->block_deadline_us <= now_us) {
+            conn_unblock(conn);
+            conn->block_timed_out = true;
+        }
+    }
+}
+
+// delivers the keyspace events of this iteration, one batch per subscriber
+static void notify_flush(std::vector<Conn *> &fd2conn) {
+    if (g_notify.events.empty()) {
+        return;
+    }
+
+    for (Conn *conn : fd2conn) {
+        if (!conn || !conn->subscribed || conn->want_close) {
+            continue;
+        }
+
+        // [event1, key1, event2, key2, ...]
+        Response push;
+        push.status = RES_PUSH;
+        size_t ctx { out_begin_arr(push.data) };
+        uint32_t n { 0 };
+        for (auto &[event, key] : g_notify.events) {
+            if (key.compare(0, conn->sub_prefix.size(), conn->sub_prefix) == 0) {
+                out_str(push.data, notify_name(event));
+                out_str(push.data, key);
+                n += 2;
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        out_end_arr(push.data, ctx, n);
+        make_response(push, conn->outgoing);
+
+        // drop subscribers that don't keep up
+        if (conn->outgoing.size() > g_config.notify_max_buffer) {
+            msg("subscriber too slow");
+            conn->want_close = true;
+            continue;
+        }
+
+        conn->want_read = false;
+        conn->want_write = true;
+    }
+
+    g_notify.events.clear();
+    g_notify.last.clear();
+
+    for (Conn *conn : fd2conn) {
+        if (conn && conn->want_close) {
+            conn_destroy(fd2conn, conn);
+        }
+    }
+}
+
+// usage: server [config-file] [--takeover] [--load <path> [--merge <path>]]
+// --takeover restarts in place of a running server on the same port
+// --load starts from a bgsave file or a directory of checkpoints
+// --merge writes what --load loaded as one snapshot and exits
+int main(int argc, char **argv) {
+    bool want_takeover { false };
+    const char *load_path { nullptr };
+    const char *merge_path { nullptr };
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--takeover") == 0) {
+            want_takeover = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            load_path = argv[++i];
+            continue;
+        }
+        if (strcmp(argv[i], "--merge") == 0 && i + 1 < argc) {
+            merge_path = argv[++i];
+            continue;
+        }
+
+        // optional config file
+        std::string err;
+        if (!config_load_file(&g_config_table, argv[i], err)) {
+            msg(err.c_str());
+            return 1;
+        }
+    }
+
+    if (merge_path) {
+        return load_path && load_file(load_path) && merge_to(merge_path) ? 0 : 1;
+    }
+
+    // a peer that went away shows up as a write error instead of a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    // map of all client connections indexed by their fd
     std::vector<Conn*> fd2conn;
 
+    int fd { -1 };
+    if (want_takeover) {
+        fd = takeover(fd2conn);
+        if (fd < 0) {
+            msg("no server to take over from, starting fresh");
+        }
+    }
+    if (fd < 0) {
+        // a file written by bgsave, unless the keyspace was taken over
+        if (load_path && !load_file(load_path)) {
+            return 1;
+        }
+        fd = listen_socket();
+    }
+
+    // a later restart connects here
+    int handoff_fd { handoff_dir(handoff_dir_path().c_str()) ? handoff_listen(handoff_path().c_str()) : -1 };
+    if (handoff_fd < 0) {
+        msg_errno("handoff socket unavailable, restarts will drop state");
+    } else {
+        fd_set_nb(handoff_fd);
+    }
+
     // event loop
     std::vector<struct pollfd> poll_args;
     while (true) {
+        // nothing is served until a new process taking over confirms
+        if (g_handoff.sock >= 0) {
+            struct pollfd pfd { g_handoff.sock, POLLIN, 0 };
+            if (poll(&pfd, 1, -1) > 0) {
+                handoff_finish();
+            }
+            continue;
+        }
+
         poll_args.clear();
 
-        // put listening socket in first
+        // put listening socket in first, then the handoff socket
+        // (poll ignores it if it is -1)
         struct pollfd pfd { fd, POLLIN, 0 };
         poll_args.push_back(pfd);
+        poll_args.push_back({ handoff_fd, POLLIN, 0 });
+
+        uint64_t now_us { get_monotonic_usec() };
         
         for (Conn *conn : fd2conn) {
             if (!conn) continue;
 
             struct pollfd pfd { conn->fd, POLLERR, 0 };
 
-            if (conn->want_read) {
+            // stop reading from connections that still have work buffered
+            // or are over their rate limit
+            if (conn->want_read && !conn->has_pending && !conn_throttled(conn, now_us)) {
                 pfd.events |= POLLIN;
             }
+            // a blocked connection keeps its request buffered, so watch for
+            // the client going away without reading what it sends next
+            if (conn->blocked) {
+                pfd.events |= POLLRDHUP;
+            }
             if (conn->want_write) {
                 pfd.events |= POLLOUT;
             }
@@ -389,7 +5686,43 @@ int main() {
             poll_args.push_back(pfd);
         }
 
-        int rv { poll(poll_args.data(), static_cast<nfds_t>(poll_args.size()), -1) };
+        // don't block if leftover requests are waiting to be served,
+        // and wake up when the next throttled connection may continue
+        int timeout_ms { -1 };
+        if (!g_data.heap.empty() && g_repl.host.empty()) {
+            uint64_t expire_at { g_data.heap[0].val };
+            timeout_ms = poll_wait_ms(expire_at, now_us);
+        }
+        for (int wait_ms : { repl_timeout_ms(now_us), checkpoint_timeout_ms(now_us), lease_timeout_ms(now_us) }) {
+            if (wait_ms >= 0 && (timeout_ms < 0 || wait_ms < timeout_ms)) {
+                timeout_ms = wait_ms;
+            }
+        }
+        if (text_indexes_busy() || delete_tasks_busy() || import_tasks_busy() || bgsave_busy()) {
+            timeout_ms = 0;
+        }
+        for (Conn *conn : fd2conn) {
+            if (!conn) continue;
+
+            if (conn_runnable(conn, now_us)) {
+                timeout_ms = 0;
+                break;
+            }
+            uint64_t wake_us { 0 };
+            if (conn_throttled(conn, now_us)) {
+                wake_us = conn->throttled_until_us;
+            } else if (conn->blocked && conn->block_deadline_us != UINT64_MAX) {
+                wake_us = conn->block_deadline_us;
+            }
+            if (wake_us) {
+                int wait_ms = poll_wait_ms(wake_us, now_us);
+                if (timeout_ms < 0 || wait_ms < timeout_ms) {
+                    timeout_ms = wait_ms;
+                }
+            }
+        }
+
+        int rv { poll(poll_args.data(), static_cast<nfds_t>(poll_args.size()), timeout_ms) };
         if (rv < 0 && errno == EINTR) {
             continue;
         }
@@ -401,20 +5734,31 @@ int main() {
         // accept, create a connection representation, and store in the map 
         if (poll_args[0].revents) {
             if (Conn *conn {handle_accept(fd)}) {
-                if (fd2conn.size() <= static_cast<size_t>(conn->fd)) {
-                    fd2conn.resize(conn->fd + 1);
-                }
-                assert(!fd2conn[conn->fd]);
-                fd2conn[conn->fd] = conn;
+                conn_add(fd2conn, conn);
             }
         }
 
+        // a new process is taking over
+        if (poll_args[1].revents) {
+            handle_handoff(handoff_fd, fd, fd2conn);
+        }
+        // the keyspace and clients sent are the new process's now, touching
+        // either before it confirms would lose writes or consume its requests
+        if (g_handoff.sock >= 0) {
+            continue;
+        }
+
         // handle operations for connections that are ready
-        for (size_t i = 1; i < poll_args.size(); ++i) {
+        for (size_t i = 2; i < poll_args.size(); ++i) {
             uint32_t ready { poll_args[i].revents };
             Conn *conn { fd2conn[poll_args[i].fd] };
 
-            if (ready & POLLIN) {
+            if (conn->blocked && (ready & (POLLRDHUP | POLLHUP))) {
+                msg("blocked client closed");
+                conn->want_close = true;
+            } else if ((ready & POLLIN) && conn == g_repl.link) {
+                repl_link_read(conn);
+            } else if (ready & POLLIN) {
                 handle_read(conn);
             }
             if (ready & POLLOUT) {
@@ -422,11 +5766,21 @@ int main() {
             }
 
             if ((ready & POLLERR) || (conn->want_close)) {
-                static_cast<void>(close(conn->fd));
-                fd2conn[conn->fd] = NULL;
-                delete conn;
+                conn_destroy(fd2conn, conn);
             }
         }
+
+        process_block_timeouts(fd2conn);
+        run_pending(fd2conn);
+        process_expired();
+        process_leases();
+        process_text_indexes();
+        process_delete_tasks();
+        process_import_tasks();
+        process_checkpoint();
+        process_bgsave();
+        repl_connect(fd2conn);
+        notify_flush(fd2conn);
     }
 
     return 0;
@@ -0,0 +1,300 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include "sketch.h"
+#include "buffer.h"
+
+// counts below this use a precomputed decay^count, larger ones never decay
+const size_t K_TOPK_DECAY_TABLE = 256;
+
+static uint64_t mum(uint64_t a, uint64_t b) {
+    __uint128_t r { static_cast<__uint128_t>(a) * b };
+    return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
+// 64-bit hash of an item, 8 bytes per multiply
+static uint64_t item_hash(const std::string &item) {
+    const uint8_t *p { reinterpret_cast<const uint8_t *>(item.data()) };
+    size_t len { item.size() };
+    uint64_t h { 0x2d358dccaa6c78a5 ^ len };
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w { 0 };
+        memcpy(&w, p, 8);
+        h = mum(h ^ w, 0x8bb84b93962eacc9);
+    }
+    uint64_t w { 0 };
+    memcpy(&w, p, len);
+    return mum(mum(h ^ w, 0x4b33a62ed433d4a3), 0x9E3779B97F4A7C15);
+}
+
+// the column of row r, from two 32-bit halves of the hash
+// (Kirsch-Mitzenmacher: h1 + r * h2 behaves like independent hashes)
+static inline uint32_t row_index(uint32_t h1, uint32_t h2, uint32_t r, uint32_t width) {
+    return static_cast<uint32_t>((static_cast<uint64_t>(h1 + r * h2) * width) >> 32);
+}
+
+// hashes a batch of items, then computes every row's counter position
+// of every item and prefetches it, so the cache misses of the batch overlap
+// pos[r * K_SKETCH_BATCH + i] is the column of item i in row r
+static void batch_positions(const std::string *items, size_t n, uint32_t width, uint32_t depth,
+    const void *base, size_t elem, uint32_t *h1, uint32_t *pos) {
+    uint32_t h2[K_SKETCH_BATCH];
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t h { item_hash(items[i]) };
+        h1[i] = static_cast<uint32_t>(h);
+        h2[i] = static_cast<uint32_t>(h >> 32) | 1;
+    }
+    const char *rows { static_cast<const char *>(base) };
+    for (uint32_t r = 0; r < depth; ++r) {
+        uint32_t *row_pos { pos + static_cast<size_t>(r) * K_SKETCH_BATCH };
+        for (size_t i = 0; i < n; ++i) {
+            row_pos[i] = row_index(h1[i], h2[i], r, width);
+        }
+        const char *row { rows + static_cast<size_t>(r) * width * elem };
+        for (size_t i = 0; i < n; ++i) {
+            __builtin_prefetch(row + static_cast<size_t>(row_pos[i]) * elem, 1);
+        }
+    }
+}
+
+void cms_init(CmsSketch *cms, uint32_t width, uint32_t depth) {
+    cms->width = width;
+    cms->depth = depth;
+    cms->total = 0;
+    cms->counts.assign(static_cast<size_t>(width) * depth, 0);
+}
+
+// adds incs[i] to items[i], writing each item's estimate after its increment
+void cms_incrby(CmsSketch *cms, const std::string *items, const uint64_t *incs, size_t n, uint64_t *out) {
+    uint32_t pos[K_SKETCH_MAX_DEPTH * K_SKETCH_BATCH];
+    uint32_t h1[K_SKETCH_BATCH];
+    for (size_t base = 0; base < n; base += K_SKETCH_BATCH) {
+        size_t m { std::min(K_SKETCH_BATCH, n - base) };
+        batch_positions(items + base, m, cms->width, cms->depth, cms->counts.data(), sizeof(uint32_t), h1, pos);
+
+        // item by item, so repeated items in a batch see their earlier increments
+        for (size_t i = 0; i < m; ++i) {
+            uint64_t inc { incs[base + i] };
+            uint64_t est { UINT64_MAX };
+            for (uint32_t r = 0; r < cms->depth; ++r) {
+                uint32_t &c { cms->counts[static_cast<size_t>(r) * cms->width + pos[r * K_SKETCH_BATCH + i]] };
+                uint64_t v { std::min<uint64_t>(static_cast<uint64_t>(c) + inc, UINT32_MAX) };
+                c = static_cast<uint32_t>(v);
+                est = std::min(est, v);
+            }
+            cms->total += inc;
+            out[base + i] = est;
+        }
+    }
+}
+
+// estimates the counts of items, never below the true count
+void cms_query(const CmsSketch *cms, const std::string *items, size_t n, uint64_t *out) {
+    uint32_t pos[K_SKETCH_MAX_DEPTH * K_SKETCH_BATCH];
+    uint32_t h1[K_SKETCH_BATCH];
+    for (size_t base = 0; base < n; base += K_SKETCH_BATCH) {
+        size_t m { std::min(K_SKETCH_BATCH, n - base) };
+        batch_positions(items + base, m, cms->width, cms->depth, cms->counts.data(), sizeof(uint32_t), h1, pos);
+
+        for (size_t i = 0; i < m; ++i) {
+            uint32_t est { UINT32_MAX };
+            for (uint32_t r = 0; r < cms->depth; ++r) {
+                est = std::min(est, cms->counts[static_cast<size_t>(r) * cms->width + pos[r * K_SKETCH_BATCH + i]]);
+            }
+            out[base + i] = est;
+        }
+    }
+}
+
+void cms_encode(const CmsSketch *cms, std::vector<uint8_t> &out) {
+    write_u32(out, cms->width);
+    write_u32(out, cms->depth);
+    write_u64(out, cms->total);
+    buf_append(out, reinterpret_cast<const uint8_t *>(cms->counts.data()), cms->counts.size() * sizeof(uint32_t));
+}
+
+// loads a sketch serialized by cms_encode
+bool cms_decode(const uint8_t *&cur, const uint8_t *end, CmsSketch *cms) {
+    uint32_t width { 0 };
+    uint32_t depth { 0 };
+    uint64_t total { 0 };
+    if (!read_u32(cur, end, width) || !read_u32(cur, end, depth) || !read_u64(cur, end, total)) {
+        return false;
+    }
+    size_t bytes { static_cast<size_t>(width) * depth * sizeof(uint32_t) };
+    if (width == 0 || depth == 0 || depth > K_SKETCH_MAX_DEPTH || static_cast<size_t>(end - cur) < bytes) {
+        return false;
+    }
+
+    cms_init(cms, width, depth);
+    cms->total = total;
+    memcpy(cms->counts.data(), cur, bytes);
+    cur += bytes;
+    return true;
+}
+
+void topk_init(TopK *topk, uint32_t k, uint32_t width, uint32_t depth, double decay) {
+    topk->k = k;
+    topk->width = width;
+    topk->depth = depth;
+    topk->decay = decay;
+    topk->buckets.assign(static_cast<size_t>(width) * depth, TopKBucket());
+    topk->decay_pow.resize(K_TOPK_DECAY_TABLE);
+    for (size_t c = 0; c < K_TOPK_DECAY_TABLE; ++c) {
+        topk->decay_pow[c] = pow(decay, static_cast<double>(c));
+    }
+}
+
+// uniform in [0, 1)
+static double topk_rand(TopK *topk) {
+    topk->rng ^= topk->rng >> 12;
+    topk->rng ^= topk->rng << 25;
+    topk->rng ^= topk->rng >> 27;
+    return static_cast<double>((topk->rng * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+// counts one occurrence in the buckets, returning the largest count the item owns
+static uint32_t topk_count(TopK *topk, uint32_t fp, const uint32_t *pos) {
+    uint32_t max_count { 0 };
+    for (uint32_t r = 0; r < topk->depth; ++r) {
+        TopKBucket &b { topk->buckets[static_cast<size_t>(r) * topk->width + pos[r * K_SKETCH_BATCH]] };
+        if (b.count == 0) {
+            b.fp = fp;
+            b.count = 1;
+        } else if (b.fp == fp) {
+            if (b.count < UINT32_MAX) {
+                b.count++;
+            }
+        } else if (b.count < K_TOPK_DECAY_TABLE && topk_rand(topk) < topk->decay_pow[b.count]) {
+            if (--b.count == 0) {
+                b.fp = fp;
+                b.count = 1;
+            }
+        }
+        if (b.fp == fp) {
+            max_count = std::max(max_count, b.count);
+        }
+    }
+    return max_count;
+}
+
+// keeps the item if its estimate is among the k largest
+// returns true and sets expelled if that pushed another item out
+static bool topk_offer(TopK *topk, const std::string &name, uint64_t count, std::string &expelled) {
+    auto it { topk->by_name.find(name) };
+    if (it != topk->by_name.end()) {
+        TopKItem &item { topk->items[it->second] };
+        item.count = std::max(item.count, count);
+        return false;
+    }
+    if (topk->items.size() < topk->k) {
+        topk->min_count = topk->items.empty() ? count : std::min(topk->min_count, count);
+        topk->by_name.emplace(name, static_cast<uint32_t>(topk->items.size()));
+        topk->items.push_back({ name, count });
+        return false;
+    }
+    if (count <= topk->min_count) {
+        return false;
+    }
+
+    // min_count only trails the counts, which only grow, so rescan before replacing
+    size_t min_pos { 0 };
+    for (size_t i = 1; i < topk->items.size(); ++i) {
+        if (topk->items[i].count < topk->items[min_pos].count) {
+            min_pos = i;
+        }
+    }
+    topk->min_count = topk->items[min_pos].count;
+    if (count <= topk->min_count) {
+        return false;
+    }
+
+    TopKItem &item { topk->items[min_pos] };
+    topk->by_name.erase(item.name);
+    expelled = std::move(item.name);
+    item.name = name;
+    item.count = count;
+    topk->by_name.emplace(name, static_cast<uint32_t>(min_pos));
+    return true;
+}
+
+// counts one occurrence of each item, appending the names pushed out of the top k
+void topk_add(TopK *topk, const std::string *items, size_t n, std::vector<std::string> &expelled) {
+    uint32_t pos[K_SKETCH_MAX_DEPTH * K_SKETCH_BATCH];
+    uint32_t h1[K_SKETCH_BATCH];
+    for (size_t base = 0; base < n; base += K_SKETCH_BATCH) {
+        size_t m { std::min(K_SKETCH_BATCH, n - base) };
+        batch_positions(items + base, m, topk->width, topk->depth, topk->buckets.data(), sizeof(TopKBucket), h1, pos);
+
+        for (size_t i = 0; i < m; ++i) {
+            uint32_t count { topk_count(topk, h1[i], pos + i) };
+            std::string out;
+            if (topk_offer(topk, items[base + i], count, out)) {
+                expelled.push_back(std::move(out));
+            }
+        }
+    }
+}
+
+// the kept items, largest count first
+void topk_list(const TopK *topk, std::vector<const TopKItem *> &out) {
+    for (const TopKItem &item : topk->items) {
+        out.push_back(&item);
+    }
+    std::sort(out.begin(), out.end(), [](const TopKItem *a, const TopKItem *b) {
+        return a->count != b->count ? a->count > b->count : a->name < b->name;
+    });
+}
+
+void topk_encode(const TopK *topk, std::vector<uint8_t> &out) {
+    write_u32(out, topk->k);
+    write_u32(out, topk->width);
+    write_u32(out, topk->depth);
+    write_dbl(out, topk->decay);
+    write_u64(out, topk->rng);
+    buf_append(out, reinterpret_cast<const uint8_t *>(topk->buckets.data()), topk->buckets.size() * sizeof(TopKBucket));
+    write_u32(out, static_cast<uint32_t>(topk->items.size()));
+    for (const TopKItem &item : topk->items) {
+        write_str(out, item.name);
+        write_u64(out, item.count);
+    }
+}
+
+// loads a sketch serialized by topk_encode
+bool topk_decode(const uint8_t *&cur, const uint8_t *end, TopK *topk) {
+    uint32_t k { 0 };
+    uint32_t width { 0 };
+    uint32_t depth { 0 };
+    double decay { 0 };
+    uint64_t rng { 0 };
+    if (!read_u32(cur, end, k) || !read_u32(cur, end, width) || !read_u32(cur, end, depth)
+        || !read_dbl(cur, end, decay) || !read_u64(cur, end, rng)) {
+        return false;
+    }
+    size_t bytes { static_cast<size_t>(width) * depth * sizeof(TopKBucket) };
+    if (k == 0 || width == 0 || depth == 0 || depth > K_SKETCH_MAX_DEPTH || !(decay > 0 && decay < 1) || static_cast<size_t>(end - cur) < bytes) {
+        return false;
+    }
+
+    topk_init(topk, k, width, depth, decay);
+    topk->rng = rng;
+    memcpy(topk->buckets.data(), cur, bytes);
+    cur += bytes;
+
+    uint32_t n { 0 };
+    if (!read_u32(cur, end, n) || n > k) {
+        return false;
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        TopKItem item;
+        if (!read_lstr(cur, end, item.name) || !read_u64(cur, end, item.count)) {
+            return false;
+        }
+        if (!topk->by_name.emplace(item.name, i).second) {
+            return false;
+        }
+        topk->min_count = i == 0 ? item.count : std::min(topk->min_count, item.count);
+        topk->items.push_back(std::move(item));
+    }
+    return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// items hashed and prefetched together by the batch operations
+const size_t K_SKETCH_BATCH = 64;
+// rows of either sketch, bounded so a batch's positions fit on the stack
+const uint32_t K_SKETCH_MAX_DEPTH = 16;
+
+// count-min sketch: depth rows of width saturating counters
+// rows are contiguous so the counters of one row share cache lines
+struct CmsSketch {
+    uint32_t width { 0 };
+    uint32_t depth { 0 };
+    uint64_t total { 0 };
+    std::vector<uint32_t> counts; // row r at counts[r * width]
+};
+
+void cms_init(CmsSketch *cms, uint32_t width, uint32_t depth);
+void cms_incrby(CmsSketch *cms, const std::string *items, const uint64_t *incs, size_t n, uint64_t *out);
+void cms_query(const CmsSketch *cms, const std::string *items, size_t n, uint64_t *out);
+
+void cms_encode(const CmsSketch *cms, std::vector<uint8_t> &out);
+bool cms_decode(const uint8_t *&cur, const uint8_t *end, CmsSketch *cms);
+
+// a counter of the top-k sketch, owned by the item whose fingerprint it holds
+struct TopKBucket {
+    uint32_t fp { 0 };
+    uint32_t count { 0 };
+};
+
+struct TopKItem {
+    std::string name;
+    uint64_t count { 0 };
+};
+
+// heavy hitters by HeavyKeeper: colliding counters decay with probability
+// decay^count, so small flows are evicted while large ones keep their counts
+// the k largest estimates are kept by name, unordered
+struct TopK {
+    uint32_t k { 0 };
+    uint32_t width { 0 };
+    uint32_t depth { 0 };
+    double decay { 0 };
+    std::vector<TopKBucket> buckets; // row r at buckets[r * width]
+    std::vector<TopKItem> items;
+    std::unordered_map<std::string, uint32_t> by_name; // name -> position in items
+    uint64_t min_count { 0 }; // at most the smallest count in items
+    std::vector<double> decay_pow; // decay^count for small counts
+    uint64_t rng { 0x9E3779B97F4A7C15 };
+};
+
+void topk_init(TopK *topk, uint32_t k, uint32_t width, uint32_t depth, double decay);
+void topk_add(TopK *topk, const std::string *items, size_t n, std::vector<std::string> &expelled);
+void topk_list(const TopK *topk, std::vector<const TopKItem *> &out);
+
+void topk_encode(const TopK *topk, std::vector<uint8_t> &out);
+bool topk_decode(const uint8_t *&cur, const uint8_t *end, TopK *topk);
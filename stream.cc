@@ -0,0 +1,306 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "stream.h"
+#include "buffer.h"
+
+// a block is sealed once it reaches either limit
+const size_t K_STREAM_BLOCK_BYTES = 4096;
+const uint32_t K_STREAM_BLOCK_ENTRIES = 128;
+
+// parses "ms-seq" or "ms", in which case seq is seq_default
+bool stream_parse_id(const std::string &s, uint64_t seq_default, StreamID &out) {
+    const char *str { s.c_str() };
+    char *end { nullptr };
+
+    errno = 0;
+    out.ms = strtoull(str, &end, 10);
+    if (errno || end == str || *str == '-') {
+        return false;
+    }
+
+    if (*end == '\0') {
+        out.seq = seq_default;
+        return true;
+    }
+    if (*end != '-') {
+        return false;
+    }
+
+    str = end + 1;
+    out.seq = strtoull(str, &end, 10);
+    return !errno && end != str && *str != '-' && *end == '\0';
+}
+
+std::string stream_format_id(const StreamID &id) {
+    return std::to_string(id.ms) + "-" + std::to_string(id.seq);
+}
+
+static void write_id(std::vector<uint8_t> &buf, const StreamID &id) {
+    write_u64(buf, id.ms);
+    write_u64(buf, id.seq);
+}
+
+static bool read_id(const uint8_t *&cur, const uint8_t *end, StreamID &id) {
+    return read_u64(cur, end, id.ms) && read_u64(cur, end, id.seq);
+}
+
+// decodes one packed entry
+static bool read_entry(const uint8_t *&cur, const uint8_t *end, StreamEntry &out) {
+    uint32_t nfields { 0 };
+    if (!read_id(cur, end, out.id) || !read_u32(cur, end, nfields)) {
+        return false;
+    }
+    // each field and value takes at least its length
+    if (nfields > static_cast<size_t>(end - cur) / 8) {
+        return false;
+    }
+
+    out.fields.resize(nfields);
+    for (auto &[field, value] : out.fields) {
+        if (!read_lstr(cur, end, field) || !read_lstr(cur, end, value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// appends an entry, with the given id or an automatic one if id is null
+// explicit ids must be greater than every id in the stream
+bool stream_add(Stream *stream, const StreamID *id, uint64_t now_ms,
+    const std::vector<std::pair<std::string, std::string>> &fields, StreamID &out)
+{
+    if (id) {
+        if (!(stream->last_id < *id)) {
+            return false;
+        }
+        out = *id;
+    } else if (now_ms > stream->last_id.ms) {
+        out = StreamID { now_ms, 0 };
+    } else {
+        // the clock went backwards or several entries share a millisecond
+        out = StreamID { stream->last_id.ms, stream->last_id.seq + 1 };
+    }
+
+    // append to the last block, or start a new one if it is full
+    StreamBlock *block { nullptr };
+    if (!stream->blocks.empty()) {
+        block = &stream->blocks.rbegin()->second;
+        if (block->data.size() >= K_STREAM_BLOCK_BYTES || block->count >= K_STREAM_BLOCK_ENTRIES) {
+            block = nullptr;
+        }
+    }
+    if (!block) {
+        block = &stream->blocks[out];
+    }
+
+    write_id(block->data, out);
+    write_u32(block->data, static_cast<uint32_t>(fields.size()));
+    for (auto &[field, value] : fields) {
+        write_str(block->data, field);
+        write_str(block->data, value);
+    }
+    block->last = out;
+    block->count++;
+
+    stream->last_id = out;
+    stream->length++;
+    return true;
+}
+
+// collects up to count entries with start <= id <= end
+// whole blocks inside the range are decoded front to back without lookups
+void stream_range(Stream *stream, const StreamID &start, const StreamID &end,
+    size_t count, std::vector<StreamEntry> &out)
+{
+    // the block holding start is the last one beginning at or before it
+    auto it { stream->blocks.upper_bound(start) };
+    if (it != stream->blocks.begin()) {
+        --it;
+    }
+
+    for (; it != stream->blocks.end() && out.size() < count; ++it) {
+        if (end < it->first) {
+            break;
+        }
+
+        StreamBlock &block { it->second };
+        if (block.last < start) {
+            continue;
+        }
+
+        const uint8_t *cur { block.data.data() };
+        const uint8_t *block_end { cur + block.data.size() };
+        StreamEntry ent;
+        while (cur < block_end && out.size() < count && read_entry(cur, block_end, ent)) {
+            if (end < ent.id) {
+                return;
+            }
+            if (!(ent.id < start)) {
+                out.push_back(std::move(ent));
+            }
+        }
+    }
+}
+
+// finds a single entry by id
+bool stream_get(Stream *stream, const StreamID &id, StreamEntry &out) {
+    std::vector<StreamEntry> found;
+    stream_range(stream, id, id, 1, found);
+    if (found.empty()) {
+        return false;
+    }
+    out = std::move(found[0]);
+    return true;
+}
+
+// delivers up to count entries the group has not seen yet to consumer,
+// recording them in the group's pending entries list
+void stream_read_group(Stream *stream, StreamGroup *group, const std::string &consumer,
+    size_t count, uint64_t now_ms, std::vector<StreamEntry> &out)
+{
+    StreamID start { group->last_delivered };
+    if (start.seq == UINT64_MAX) {
+        start = StreamID { start.ms + 1, 0 };
+    } else {
+        start.seq++;
+    }
+
+    size_t first { out.size() };
+    stream_range(stream, start, StreamID { UINT64_MAX, UINT64_MAX }, count, out);
+
+    for (size_t i = first; i < out.size(); ++i) {
+        StreamPending &pending { group->pending[out[i].id] };
+        pending.consumer = consumer;
+        pending.delivered_ms = now_ms;
+        pending.deliveries++;
+        group->last_delivered = out[i].id;
+    }
+}
+
+// re-reads up to count entries pending for consumer with ids after `after`
+void stream_read_pending(Stream *stream, StreamGroup *group, const std::string &consumer,
+    const StreamID &after, size_t count, std::vector<StreamEntry> &out)
+{
+    for (auto it = group->pending.upper_bound(after); it != group->pending.end() && count > 0; ++it) {
+        if (it->second.consumer != consumer) {
+            continue;
+        }
+
+        StreamEntry ent;
+        if (stream_get(stream, it->first, ent)) {
+            out.push_back(std::move(ent));
+            count--;
+        }
+    }
+}
+
+// serializes a stream
+// format: last_id length nblocks (first last count data)... ngroups
+//         (name last_delivered npending (id consumer delivered_ms deliveries)...)...
+void stream_encode(const Stream *stream, std::vector<uint8_t> &out) {
+    write_id(out, stream->last_id);
+    write_u64(out, stream->length);
+
+    write_u32(out, static_cast<uint32_t>(stream->blocks.size()));
+    for (auto &[first, block] : stream->blocks) {
+        write_id(out, first);
+        write_id(out, block.last);
+        write_u32(out, block.count);
+        write_str(out, block.data.data(), block.data.size());
+    }
+
+    write_u32(out, static_cast<uint32_t>(stream->groups.size()));
+    for (auto &[name, group] : stream->groups) {
+        write_str(out, name);
+        write_id(out, group.last_delivered);
+        write_u32(out, static_cast<uint32_t>(group.pending.size()));
+        for (auto &[id, pending] : group.pending) {
+            write_id(out, id);
+            write_str(out, pending.consumer);
+            write_u64(out, pending.delivered_ms);
+            write_u32(out, pending.deliveries);
+        }
+    }
+}
+
+// checks that a block holds count entries from first to last, all after prev
+static bool check_block(const StreamID &first, const StreamBlock &block, StreamID &prev, bool &any) {
+    const uint8_t *cur { block.data.data() };
+    const uint8_t *end { cur + block.data.size() };
+    StreamEntry ent;
+    uint32_t count { 0 };
+    while (cur < end) {
+        if (!read_entry(cur, end, ent) || (any && !(prev < ent.id)) || (count == 0 && !(ent.id == first))) {
+            return false;
+        }
+        prev = ent.id;
+        any = true;
+        count++;
+    }
+    return count > 0 && count == block.count && prev == block.last;
+}
+
+// loads a stream serialized by stream_encode into an empty stream
+bool stream_decode(const uint8_t *&cur, const uint8_t *end, Stream *stream) {
+    uint32_t nblocks { 0 };
+    if (!read_id(cur, end, stream->last_id) || !read_u64(cur, end, stream->length)
+        || !read_u32(cur, end, nblocks)) {
+        return false;
+    }
+
+    // packed entries are copied, once checked so reads can trust them
+    StreamID prev;
+    bool any { false };
+    uint64_t length { 0 };
+    for (uint32_t i = 0; i < nblocks; ++i) {
+        StreamID first;
+        uint32_t len { 0 };
+        if (!read_id(cur, end, first)) {
+            return false;
+        }
+
+        StreamBlock &block { stream->blocks[first] };
+        if (!read_id(cur, end, block.last) || !read_u32(cur, end, block.count)
+            || !read_u32(cur, end, len) || len > static_cast<size_t>(end - cur)) {
+            return false;
+        }
+        block.data.assign(cur, cur + len);
+        cur += len;
+        if (!check_block(first, block, prev, any)) {
+            return false;
+        }
+        length += block.count;
+    }
+    if (length != stream->length || (any && stream->last_id < prev)) {
+        return false;
+    }
+
+    uint32_t ngroups { 0 };
+    if (!read_u32(cur, end, ngroups)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < ngroups; ++i) {
+        std::string name;
+        uint32_t npending { 0 };
+        if (!read_lstr(cur, end, name)) {
+            return false;
+        }
+
+        StreamGroup &group { stream->groups[name] };
+        if (!read_id(cur, end, group.last_delivered) || !read_u32(cur, end, npending)) {
+            return false;
+        }
+
+        for (uint32_t j = 0; j < npending; ++j) {
+            StreamID id;
+            StreamPending pending;
+            if (!read_id(cur, end, id) || !read_lstr(cur, end, pending.consumer)
+                || !read_u64(cur, end, pending.delivered_ms) || !read_u32(cur, end, pending.deliveries)) {
+                return false;
+            }
+            group.pending[id] = std::move(pending);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// stream entry id: milliseconds timestamp and a sequence within that millisecond
+struct StreamID {
+    uint64_t ms { 0 };
+    uint64_t seq { 0 };
+};
+
+inline bool operator<(const StreamID &a, const StreamID &b) {
+    return a.ms < b.ms || (a.ms == b.ms && a.seq < b.seq);
+}
+
+inline bool operator==(const StreamID &a, const StreamID &b) {
+    return a.ms == b.ms && a.seq == b.seq;
+}
+
+// a decoded stream entry
+struct StreamEntry {
+    StreamID id;
+    std::vector<std::pair<std::string, std::string>> fields;
+};
+
+// a run of consecutive entries packed into one buffer
+// entry format: ms seq nfields (flen field vlen value)...
+struct StreamBlock {
+    StreamID last;
+    uint32_t count { 0 };
+    std::vector<uint8_t> data;
+};
+
+// an entry delivered to a consumer but not acknowledged yet
+struct StreamPending {
+    std::string consumer;
+    uint64_t delivered_ms { 0 };
+    uint32_t deliveries { 0 };
+};
+
+// consumer group: a delivery cursor and its pending entries list
+struct StreamGroup {
+    StreamID last_delivered;
+    std::map<StreamID, StreamPending> pending;
+};
+
+// append-only log of entries with strictly increasing ids
+struct Stream {
+    // packed blocks indexed by their first id, appends go to the last block
+    std::map<StreamID, StreamBlock> blocks;
+    StreamID last_id;
+    uint64_t length { 0 };
+    std::map<std::string, StreamGroup> groups;
+};
+
+bool stream_parse_id(const std::string &s, uint64_t seq_default, StreamID &out);
+std::string stream_format_id(const StreamID &id);
+
+bool stream_add(Stream *stream, const StreamID *id, uint64_t now_ms,
+    const std::vector<std::pair<std::string, std::string>> &fields, StreamID &out);
+void stream_range(Stream *stream, const StreamID &start, const StreamID &end,
+    size_t count, std::vector<StreamEntry> &out);
+bool stream_get(Stream *stream, const StreamID &id, StreamEntry &out);
+
+void stream_read_group(Stream *stream, StreamGroup *group, const std::string &consumer,
+    size_t count, uint64_t now_ms, std::vector<StreamEntry> &out);
+void stream_read_pending(Stream *stream, StreamGroup *group, const std::string &consumer,
+    const StreamID &after, size_t count, std::vector<StreamEntry> &out);
+
+void stream_encode(const Stream *stream, std::vector<uint8_t> &out);
+bool stream_decode(const uint8_t *&cur, const uint8_t *end, Stream *stream);
@@ -0,0 +1,272 @@
+# checks views of the keyspace against a model of it, over random writes
+# usage: python3 tests/consistency.py <server-binary> [check...] [--ops n]
+#
+# checks, all by default:
+#   snapshot    snapshots opened between writes see the keyspace as it was
+#   bgsave      a save running under writes loads as the keyspace it was issued at
+#   sync        followers syncing under writes end up equal to their primary
+#   checkpoint  a base and deltas taken between writes load as the last one
+#
+# the model holds strings s0.. and sorted sets z0.., written by set, mset,
+# del, zadd, zrem and pexpire; a server is compared to it key by key
+
+import copy
+import os
+import random
+import sys
+import time
+
+from monkeydb import RES_ARR, RES_NX, RES_OK, Server
+
+STRINGS = ['s%d' % i for i in range(60)]
+ZSETS = ['z%d' % i for i in range(30)]
+TTL_MS = 600000
+
+
+class Model:
+    def __init__(self):
+        self.keys = {}    # key -> bytes for a string, {member: score} for a sorted set
+        self.ttl = set()  # keys with a TTL
+
+    def random_write(self, rnd):
+        """returns a random write, applied to the model"""
+        op = rnd.choice(['set', 'set', 'mset', 'del', 'zadd', 'zadd', 'zrem', 'pexpire'])
+        if op == 'set':
+            key, value = rnd.choice(STRINGS), b'v%d' % rnd.randrange(10 ** 6)
+            self.keys[key] = value
+            self.ttl.discard(key)
+            return ('set', key, value)
+        if op == 'mset':
+            cmd = ['mset']
+            for key in rnd.sample(STRINGS, rnd.randint(1, 4)):
+                value = b'm%d' % rnd.randrange(10 ** 6)
+                self.keys[key] = value
+                self.ttl.discard(key)
+                cmd += [key, value]
+            return tuple(cmd)
+        if op == 'del':
+            key = rnd.choice(STRINGS + ZSETS)
+            self.keys.pop(key, None)
+            self.ttl.discard(key)
+            return ('del', key)
+        if op == 'zadd':
+            key, member, score = rnd.choice(ZSETS), 'm%d' % rnd.randrange(20), rnd.randrange(1000) / 4
+            self.keys.setdefault(key, {})[member.encode()] = score
+            return ('zadd', key, repr(score), member)
+        if op == 'zrem':
+            key, member = rnd.choice(ZSETS), 'm%d' % rnd.randrange(20)
+            if key in self.keys:
+                self.keys[key].pop(member.encode(), None)
+            return ('zrem', key, member)
+        key = rnd.choice(STRINGS + ZSETS)
+        if key in self.keys:
+            self.ttl.add(key)
+        return ('pexpire', key, str(TTL_MS))
+
+    def snapshot(self):
+        return copy.deepcopy(self.keys), set(self.ttl)
+
+
+def write(c, model, rnd, n, first=()):
+    """sends n random writes in one pipeline, after the command first if
+    given, and returns its reply"""
+    commands = [first] if first else []
+    replies = c.pipeline(commands + [model.random_write(rnd) for _ in range(n)])
+    return replies[0] if first else None
+
+
+def diff(c, keys, ttl, what):
+    """compares a server's keyspace to a model state, returns the differences"""
+    errors = []
+    for key in STRINGS:
+        got = c.cmd('get', key)
+        want = (RES_OK, keys[key]) if key in keys else (RES_NX, b'')
+        if got != want:
+            errors.append('%s: %s is %r, expected %r' % (what, key, got, want))
+    for key in ZSETS:
+        status, reply = c.cmd('zrangebyscore', key, '-1e300', '1e300')
+        got = dict(zip(reply[0::2], reply[1::2])) if status == RES_ARR else None
+        if got != keys.get(key):
+            errors.append('%s: %s is %r, expected %r' % (what, key, got, keys.get(key)))
+    for key in STRINGS + ZSETS:
+        status, reply = c.cmd('pttl', key)
+        has_ttl = status == RES_OK and int(reply) >= 0
+        if key in keys and has_ttl != (key in ttl):
+            errors.append('%s: %s has%s a TTL' % (what, key, '' if has_ttl else ' no'))
+    return errors
+
+
+def info(c, *cmd):
+    reply = c.cmd(*cmd)[1]
+    return dict(zip(reply[0::2], reply[1::2]))
+
+
+def wait_for(c, cmd, field, value, timeout=30):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if info(c, *cmd)[field] == value:
+            return
+        time.sleep(0.02)
+    raise RuntimeError('%s: %s never became %r' % (' '.join(cmd), field.decode(), value))
+
+
+def wait_for_save(c):
+    """waits for the running save to end, returns its bgsavestatus"""
+    while True:
+        status = info(c, 'bgsavestatus')
+        if status[b'state'] != b'running':
+            return status
+        time.sleep(0.02)
+
+
+def check_snapshot(binary, rnd, ops):
+    server = Server(binary)
+    c = server.client()
+    model = Model()
+    errors = []
+    opened = {}  # id -> model state when opened
+    for step in range(ops // 10):
+        write(c, model, rnd, 10)
+        if len(opened) < 3 and rnd.random() < 0.1:
+            opened[c.cmd('snapshot', 'open')[1]] = model.snapshot()
+        if opened and rnd.random() < 0.05:
+            sid = rnd.choice(list(opened))
+            keys, _ = opened[sid]
+            for key in STRINGS + ZSETS:
+                status, reply = c.cmd('snapshot', 'get', sid, key)
+                if key not in keys:
+                    ok = status == RES_NX
+                elif isinstance(keys[key], bytes):
+                    ok = status == RES_ARR and reply == [key.encode(), b'string', keys[key]]
+                else:
+                    ok = status == RES_ARR and reply[1] == b'zset'
+                if not ok:
+                    errors.append('snapshot %s: %s is %r' % (sid.decode(), key, (status, reply)))
+            seen, cursor = set(), b'0'
+            while True:
+                cursor, found = c.cmd('snapshot', 'scan', sid, cursor, 'count', '7')[1]
+                seen.update(found[0::3])
+                if cursor == 0:
+                    break
+                cursor = str(cursor)
+            if seen != {k.encode() for k in keys}:
+                errors.append('snapshot %s: scan found %d keys, expected %d' % (sid.decode(), len(seen), len(keys)))
+            if rnd.random() < 0.5:
+                c.cmd('snapshot', 'close', sid)
+                del opened[sid]
+    errors += diff(c, model.keys, model.ttl, 'live keyspace')
+    server.stop()
+    return errors
+
+
+# a save scans a key per event loop iteration and requests run a few per
+# iteration, so the writes pipelined behind the command that starts it
+# interleave with it; keys the model leaves alone make the save longer
+SLOW_SAVE = [('save-work', 1), ('sched-budget', 4)]
+FILLER_KEYS = 20000
+
+
+def fill(c):
+    for i in range(0, FILLER_KEYS, 1000):
+        c.cmd('mset', *[a for j in range(i, i + 1000) for a in ('f%d' % j, 'x')])
+
+
+def check_bgsave(binary, rnd, ops):
+    server = Server(binary, SLOW_SAVE)
+    c = server.client()
+    fill(c)
+    model = Model()
+    write(c, model, rnd, ops // 4)
+    keys, ttl = model.snapshot()
+    assert write(c, model, rnd, ops, ('bgsave', 'save.bin')) == (RES_OK, b'')
+    status = wait_for_save(c)
+    server.stop()
+    if status[b'state'] != b'done':
+        return ['bgsave: %s' % status[b'error'].decode()]
+    if status[b'preimages'] == 0:
+        print('bgsave: the writes did not overlap the save')
+
+    loaded = Server(binary, args=['--load', os.path.join(server.dir, 'save.bin')])
+    errors = diff(loaded.client(), keys, ttl, 'bgsave')
+    loaded.stop()
+    return errors
+
+
+def check_sync(binary, rnd, ops):
+    primary = Server(binary, SLOW_SAVE + [('repl-sync-delay', 200)])
+    c = primary.client()
+    fill(c)
+    model = Model()
+    write(c, model, rnd, ops // 4)
+    followers = [Server(binary) for _ in range(2)]
+    for f in followers:
+        f.client().cmd('replicaof', '127.0.0.1', str(primary.port))
+    wait_for(c, ('replinfo',), b'syncing', 2)
+    deadline = time.time() + 30
+    while info(c, 'replinfo')[b'syncing'] > 0:
+        if time.time() > deadline:
+            primary.stop()
+            return ['sync: the followers never finished syncing']
+        write(c, model, rnd, 100)
+    errors = []
+    for f in followers:
+        fc = f.client()
+        wait_for(fc, ('replinfo',), b'link', b'up')
+        write(c, model, rnd, ops // 4)
+        c.cmd('get', 's0')  # the writes have reached the followers' sockets
+        time.sleep(0.2)
+        errors += diff(fc, model.keys, model.ttl, 'follower on %d' % f.port)
+        f.stop()
+    primary.stop()
+    return errors
+
+
+def check_checkpoint(binary, rnd, ops):
+    server = Server(binary, SLOW_SAVE + [('checkpoint-deltas', 3)])
+    c = server.client()
+    fill(c)
+    os.mkdir(os.path.join(server.dir, 'cp'))
+    model = Model()
+    for _ in range(6):
+        write(c, model, rnd, ops // 6)
+        keys, ttl = model.snapshot()
+        assert write(c, model, rnd, ops // 6, ('checkpoint', 'cp'))[0] == RES_OK
+        status = wait_for_save(c)
+        if status[b'state'] != b'done':
+            server.stop()
+            return ['checkpoint: %s' % status[b'error'].decode()]
+    server.stop()
+
+    loaded = Server(binary, args=['--load', os.path.join(server.dir, 'cp')])
+    errors = diff(loaded.client(), keys, ttl, 'checkpoints')
+    loaded.stop()
+    return errors
+
+
+CHECKS = {
+    'snapshot': check_snapshot,
+    'bgsave': check_bgsave,
+    'sync': check_sync,
+    'checkpoint': check_checkpoint,
+}
+
+
+def main():
+    args = sys.argv[2:]
+    ops = 3000
+    if '--ops' in args:
+        i = args.index('--ops')
+        ops = int(args[i + 1])
+        del args[i:i + 2]
+    failures = 0
+    for name in args or list(CHECKS):
+        errors = CHECKS[name](sys.argv[1], random.Random(name), ops)
+        for e in errors[:10]:
+            print(e)
+        print('%-10s %s' % (name, 'FAIL (%d)' % len(errors) if errors else 'OK'))
+        failures += bool(errors)
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == '__main__':
+    main()
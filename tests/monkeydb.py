@@ -0,0 +1,135 @@
+# helpers shared by the test scripts: starting servers and speaking the
+# binary protocol (requests and responses as length-prefixed frames)
+
+import atexit
+import os
+import socket
+import struct
+import subprocess
+import tempfile
+import time
+
+RES_OK, RES_ERR, RES_NX, RES_ARR, RES_PUSH, RES_STALE = range(6)
+
+
+def encode(*args):
+    body = struct.pack('<I', len(args))
+    for a in args:
+        if isinstance(a, str):
+            a = a.encode()
+        body += struct.pack('<I', len(a)) + a
+    return struct.pack('<I', len(body)) + body
+
+
+def read_exact(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError('server closed the connection')
+        data += chunk
+    return data
+
+
+def read_response(sock):
+    size, = struct.unpack('<I', read_exact(sock, 4))
+    data = read_exact(sock, size)
+    status, = struct.unpack('<I', data[:4])
+    if status in (RES_ARR, RES_PUSH):
+        return status, decode_tagged(data[4:])[0]
+    return status, data[4:]
+
+
+def decode_tagged(data, i=0):
+    tag = data[i]
+    i += 1
+    if tag == 0:
+        return None, i
+    if tag == 1:
+        n, = struct.unpack_from('<I', data, i)
+        i += 4
+        return data[i:i + n], i + n
+    if tag == 2:
+        return struct.unpack_from('<q', data, i)[0], i + 8
+    if tag == 3:
+        return struct.unpack_from('<d', data, i)[0], i + 8
+    n, = struct.unpack_from('<I', data, i)
+    i += 4
+    items = []
+    for _ in range(n):
+        item, i = decode_tagged(data, i)
+        items.append(item)
+    return items, i
+
+
+class Client:
+    def __init__(self, port):
+        self.sock = socket.create_connection(('127.0.0.1', port))
+
+    def cmd(self, *args):
+        self.sock.sendall(encode(*args))
+        return read_response(self.sock)
+
+    def pipeline(self, commands):
+        self.sock.sendall(b''.join(encode(*c) for c in commands))
+        return [read_response(self.sock) for _ in commands]
+
+    def close(self):
+        self.sock.close()
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+
+class Server:
+    """a server process on a free port, configured by name value pairs,
+    keeping its files in a temporary directory"""
+
+    def __init__(self, binary, config=(), args=()):
+        self.port = free_port()
+        self.dir = tempfile.mkdtemp(prefix='monkeydb-test-')
+        conf = os.path.join(self.dir, 'server.conf')
+        with open(conf, 'w') as f:
+            f.write('port %d\n' % self.port)
+            f.write('dir %s\n' % self.dir)
+            for name, value in config:
+                f.write('%s %s\n' % (name, value))
+        self.proc = subprocess.Popen([binary, conf, *args], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        atexit.register(self.stop)  # a failed check doesn't leave it running
+        deadline = time.time() + 10
+        while True:
+            try:
+                socket.create_connection(('127.0.0.1', self.port)).close()
+                break
+            except OSError:
+                if time.time() > deadline or self.proc.poll() is not None:
+                    raise RuntimeError('server did not start')
+                time.sleep(0.05)
+
+    def client(self):
+        return Client(self.port)
+
+    def alive(self):
+        return self.proc.poll() is None
+
+    def stop(self):
+        self.proc.kill()
+        self.proc.wait()
+
+
+_crc_table = []
+for n in range(256):
+    c = n
+    for _ in range(8):
+        c = (c >> 1) ^ 0x82F63B78 if c & 1 else c >> 1
+    _crc_table.append(c)
+
+
+def crc32c(data):
+    crc = 0xFFFFFFFF
+    for b in data:
+        crc = _crc_table[(crc ^ b) & 0xFF] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
@@ -0,0 +1,109 @@
+# feeds damaged dump payloads of every type to restore
+# usage: python3 tests/restore_fuzz.py <server-binary> [rounds]
+#
+# payloads are truncated or have bytes flipped, with the crc recomputed so
+# they reach the type decoders: truncated ones must be refused with
+# "invalid payload", mutated ones either refused or restored into a key the
+# type's read commands can walk, and the server must stay up throughout
+
+import random
+import struct
+import sys
+
+from monkeydb import RES_ERR, RES_OK, Server, crc32c
+
+
+def build(c):
+    c.cmd('set', 'str', 'hello world')
+    for i in range(300):
+        c.cmd('xadd', 'stream', '*', 'f%d' % i, 'v%d' % i, 'g', 'x')
+    c.cmd('xgroup', 'create', 'stream', 'grp', '0')
+    c.cmd('xreadgroup', 'group', 'grp', 'alice', 'count', '5', 'streams', 'stream', '>')
+    for i in range(50):
+        c.cmd('zadd', 'zset', str(i * 1.5), 'm%d' % i)
+    c.cmd('vcreate', 'vec', '4')
+    for i in range(200):
+        c.cmd('vadd', 'vec', 'n%d' % i, *[str(random.random()) for _ in range(4)])
+    c.cmd('vdel', 'vec', 'n7')
+    t = 1000
+    for i in range(600):
+        t += random.choice([1, 10, 1000])
+        c.cmd('ts.add', 'ts', str(t), str(random.random() * random.choice([1, 1e9])))
+    c.cmd('json.set', 'json', '$', '{"a":[1,2,{"b":"c"}],"d":null,"e":true,"f":1.5}')
+    c.cmd('cms.init', 'cms', '64', '4')
+    c.cmd('cms.incrby', 'cms', 'a', '3', 'b', '5')
+    c.cmd('topk.reserve', 'topk', '5')
+    for i in range(100):
+        c.cmd('topk.add', 'topk', 'i%d' % (i % 9))
+
+
+# commands that walk a restored key of each type
+READS = {
+    'str': [('get', 'K')],
+    'stream': [('xrange', 'K', '-', '+'), ('xpending', 'K', 'grp'), ('xadd', 'K', '*', 'f', 'v')],
+    'zset': [('zrangebyscore', 'K', '-inf', '+inf'), ('zadd', 'K', '1', 'new')],
+    'vec': [('vsearch', 'K', '5', '0.5', '0.5', '0.5', '0.5'), ('vadd', 'K', 'new', '1', '2', '3', '4')],
+    'ts': [('ts.range', 'K', '0', '99999999999'), ('ts.range', 'K', '0', '99999999999', 'aggregation', 'avg', '1000'),
+           ('ts.add', 'K', '99999999999', '1.5')],
+    'json': [('json.get', 'K'), ('json.set', 'K', '$.z', '1')],
+    'cms': [('cms.query', 'K', 'a', 'b'), ('cms.incrby', 'K', 'a', '1')],
+    'topk': [('topk.list', 'K', 'withcount'), ('topk.add', 'K', 'x')],
+}
+
+
+def seal(body):
+    return body + struct.pack('<I', crc32c(body))
+
+
+def main():
+    binary = sys.argv[1]
+    rounds = int(sys.argv[2]) if len(sys.argv) > 2 else 300
+    random.seed(1)
+    server = Server(binary)
+    c = server.client()
+    build(c)
+
+    failures = 0
+    for name, reads in READS.items():
+        status, payload = c.cmd('dump', name)
+        assert status == RES_OK, (name, status)
+        body = payload[:-4]
+        assert c.cmd('restore', 'copy', '0', payload, 'replace') == (RES_OK, b''), name
+
+        # every proper prefix of the value is refused
+        cuts = sorted(set(random.randrange(1, len(body)) for _ in range(rounds)) | {1, 13, len(body) - 1})
+        for cut in cuts:
+            reply = c.cmd('restore', 'x', '0', seal(body[:cut]), 'replace')
+            if reply != (RES_ERR, b'invalid payload'):
+                print('%s: prefix of %d bytes gave %r' % (name, cut, reply))
+                failures += 1
+
+        # flipped bytes are refused or restore a usable key
+        restored = 0
+        for _ in range(rounds):
+            damaged = bytearray(body)
+            for _ in range(random.choice([1, 1, 2, 4])):
+                pos = random.randrange(13, len(damaged))
+                damaged[pos] = random.choice([0, 0xFF, damaged[pos] ^ (1 << random.randrange(8)), random.randrange(256)])
+            reply = c.cmd('restore', 'x', '0', seal(bytes(damaged)), 'replace')
+            if reply == (RES_OK, b''):
+                restored += 1
+                for read in reads:
+                    c.cmd(*[a if a != 'K' else 'x' for a in read])
+            elif reply != (RES_ERR, b'invalid payload'):
+                print('%s: mutation gave %r' % (name, reply))
+                failures += 1
+        print('%-6s %5d bytes, %d prefixes refused, %d of %d mutations restored' % (
+            name, len(body), len(cuts), restored, rounds))
+
+    alive = server.alive() and c.cmd('get', 'str') == (RES_OK, b'hello world')
+    server.stop()
+    if not alive:
+        print('server died')
+        failures += 1
+    print('FAIL' if failures else 'OK')
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,449 @@
+#include <string.h>
+#include <algorithm>
+#include "timeseries.h"
+#include "buffer.h"
+
+// a chunk is sealed once its bit stream reaches this size
+const size_t K_TS_CHUNK_BYTES = 4096;
+// serialized size of a chunk with no data
+const size_t K_TS_CHUNK_MIN_BYTES = 88;
+
+bool ts_parse_agg(const std::string &s, uint32_t &agg) {
+    static const char *names[] { "", "avg", "sum", "min", "max", "count", "first", "last", "range" };
+    for (uint32_t i = TS_AGG_AVG; i <= TS_AGG_RANGE; ++i) {
+        if (s == names[i]) {
+            agg = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t dbl_bits(double v) {
+    uint64_t bits { 0 };
+    memcpy(&bits, &v, 8);
+    return bits;
+}
+
+static double bits_dbl(uint64_t bits) {
+    double v { 0 };
+    memcpy(&v, &bits, 8);
+    return v;
+}
+
+// appends the low n bits of v
+static void put_bits(TsChunk &c, uint64_t v, uint32_t n) {
+    while (n > 0) {
+        if (c.nbits % 8 == 0) {
+            c.data.push_back(0);
+        }
+        uint32_t avail { 8 - static_cast<uint32_t>(c.nbits % 8) };
+        uint32_t take { std::min(avail, n) };
+        uint8_t bits { static_cast<uint8_t>((v >> (n - take)) & ((1u << take) - 1)) };
+        c.data.back() |= static_cast<uint8_t>(bits << (avail - take));
+        c.nbits += take;
+        n -= take;
+    }
+}
+
+// delta-of-delta classes: prefix, prefix length, payload bits, offset making the payload unsigned
+static const struct {
+    uint32_t prefix;
+    uint32_t prefix_len;
+    uint32_t bits;
+    int64_t offset;
+} k_dod_classes[] {
+    { 0b10, 2, 7, 63 },       // [-63, 64]
+    { 0b110, 3, 9, 255 },     // [-255, 256]
+    { 0b1110, 4, 12, 2047 },  // [-2047, 2048]
+    { 0b11110, 5, 32, INT32_MAX }, // [-2^31 + 1, 2^31]
+};
+
+static void put_timestamp(TsChunk &c, uint64_t time) {
+    int64_t delta { static_cast<int64_t>(time - c.last_ts) };
+    int64_t dod { delta - c.last_delta };
+    c.last_delta = delta;
+
+    if (dod == 0) {
+        put_bits(c, 0, 1);
+        return;
+    }
+    for (auto &cls : k_dod_classes) {
+        if (dod >= -cls.offset && dod <= cls.offset + 1) {
+            put_bits(c, cls.prefix, cls.prefix_len);
+            put_bits(c, static_cast<uint64_t>(dod + cls.offset), cls.bits);
+            return;
+        }
+    }
+    put_bits(c, 0b11111, 5);
+    put_bits(c, static_cast<uint64_t>(dod), 64);
+}
+
+// writes the XOR with the previous value: 0 if equal, else 1 and either
+// 0 plus the meaningful bits inside the previous leading/trailing zeros,
+// or 1, 5 bits of leading zeros, 6 bits of length and the meaningful bits
+static void put_value(TsChunk &c, double value) {
+    uint64_t bits { dbl_bits(value) };
+    uint64_t x { bits ^ c.last_bits };
+    c.last_bits = bits;
+
+    if (x == 0) {
+        put_bits(c, 0, 1);
+        return;
+    }
+
+    uint32_t lead { std::min(static_cast<uint32_t>(__builtin_clzll(x)), 31u) };
+    uint32_t trail { static_cast<uint32_t>(__builtin_ctzll(x)) };
+    if (lead >= c.lead && trail >= c.trail) {
+        put_bits(c, 0b10, 2);
+        put_bits(c, x >> c.trail, 64 - c.lead - c.trail);
+        return;
+    }
+
+    uint32_t len { 64 - lead - trail };
+    put_bits(c, 0b11, 2);
+    put_bits(c, lead, 5);
+    put_bits(c, len & 63, 6); // 64 is written as 0
+    put_bits(c, x >> trail, len);
+    c.lead = static_cast<uint8_t>(lead);
+    c.trail = static_cast<uint8_t>(trail);
+}
+
+// appends a sample, time must be after the last one
+bool ts_add(TimeSeries *ts, uint64_t time, double value) {
+    if (!ts->chunks.empty() && time <= ts->chunks.back().last_ts) {
+        return false;
+    }
+    if (ts->chunks.empty() || ts->chunks.back().data.size() >= K_TS_CHUNK_BYTES) {
+        if (!ts->chunks.empty()) {
+            ts->chunks.back().data.shrink_to_fit();
+        }
+        ts->chunks.emplace_back();
+    }
+
+    TsChunk &c { ts->chunks.back() };
+    if (c.count == 0) {
+        c.first_ts = time;
+        c.last_bits = dbl_bits(value);
+        put_bits(c, c.last_bits, 64);
+        c.lead = 64; // no XOR block to reuse yet
+        c.first = c.min = c.max = value;
+    } else {
+        put_timestamp(c, time);
+        put_value(c, value);
+        c.min = std::min(c.min, value);
+        c.max = std::max(c.max, value);
+    }
+    c.sum += value;
+    c.last_ts = time;
+    c.count++;
+    ts->count++;
+    return true;
+}
+
+bool ts_last(const TimeSeries *ts, uint64_t &time, double &value) {
+    if (ts->chunks.empty()) {
+        return false;
+    }
+    time = ts->chunks.back().last_ts;
+    value = bits_dbl(ts->chunks.back().last_bits);
+    return true;
+}
+
+// memory held by chunks
+size_t ts_bytes(const TimeSeries *ts) {
+    size_t bytes { 0 };
+    for (const TsChunk &c : ts->chunks) {
+        bytes += sizeof(TsChunk) + c.data.capacity();
+    }
+    return bytes;
+}
+
+// decodes a chunk one sample at a time
+struct TsIter {
+    const uint8_t *data { nullptr };
+    size_t size { 0 };
+    uint64_t nbits { 0 };
+    uint64_t pos { 0 }; // bit position
+    uint32_t left { 0 };
+    bool started { false };
+    uint64_t time { 0 };
+    int64_t delta { 0 };
+    uint64_t bits { 0 };
+    uint32_t lead { 0 };
+    uint32_t trail { 0 };
+};
+
+// the next n <= 56 bits without consuming them, with one unaligned load
+// unless near the end of the chunk, past which bits read as 0
+static uint64_t peek_bits(const TsIter &it, uint32_t n) {
+    size_t byte { it.pos / 8 };
+    uint32_t shift { static_cast<uint32_t>(it.pos % 8) };
+    uint64_t w { 0 };
+    if (byte + 8 <= it.size) {
+        memcpy(&w, it.data + byte, 8);
+    } else if (byte < it.size) {
+        memcpy(&w, it.data + byte, it.size - byte);
+    }
+    return (__builtin_bswap64(w) << shift) >> (64 - n);
+}
+
+static uint64_t get_bits(TsIter &it, uint32_t n) {
+    if (n > 56) {
+        uint64_t hi { get_bits(it, n - 32) };
+        return (hi << 32) | get_bits(it, 32);
+    }
+    if (n == 0) {
+        return 0;
+    }
+    uint64_t v { peek_bits(it, n) };
+    it.pos += n;
+    return v;
+}
+
+static void iter_init(TsIter &it, const TsChunk *c) {
+    it = TsIter();
+    it.data = c->data.data();
+    it.size = c->data.size();
+    it.nbits = c->nbits;
+    it.left = c->count;
+    it.time = c->first_ts;
+}
+
+// the chunk ends after count samples or at nbits, whichever comes first,
+// so a damaged chunk stops early instead of reading past its bits
+static bool iter_next(TsIter &it, uint64_t &time, double &value) {
+    if (it.left == 0 || it.pos >= it.nbits) {
+        return false;
+    }
+
+    if (!it.started) {
+        it.started = true;
+        it.bits = get_bits(it, 64);
+    } else {
+        // timestamp: the number of leading 1s picks the class
+        uint32_t prefix { static_cast<uint32_t>(peek_bits(it, 5)) };
+        uint32_t ones { static_cast<uint32_t>(__builtin_clz(~(prefix << 27))) };
+        it.pos += ones < 5 ? ones + 1 : 5;
+
+        int64_t dod { 0 };
+        if (ones == 5) {
+            dod = static_cast<int64_t>(get_bits(it, 64));
+        } else if (ones > 0) {
+            auto &cls { k_dod_classes[ones - 1] };
+            dod = static_cast<int64_t>(get_bits(it, cls.bits)) - cls.offset;
+        }
+        it.delta += dod;
+        it.time += static_cast<uint64_t>(it.delta);
+
+        // value: 0, 10 + bits in the previous window, or 11 + new window
+        uint32_t ctrl { static_cast<uint32_t>(peek_bits(it, 2)) };
+        if (ctrl < 2) {
+            it.pos += 1;
+        } else {
+            it.pos += 2;
+            if (ctrl == 3) {
+                uint32_t hdr { static_cast<uint32_t>(get_bits(it, 11)) };
+                uint32_t len { hdr & 63 ? hdr & 63 : 64 };
+                it.lead = hdr >> 6;
+                if (it.lead + len > 64) {
+                    it.left = 0;
+                    return false;
+                }
+                it.trail = 64 - it.lead - len;
+            }
+            it.bits ^= get_bits(it, 64 - it.lead - it.trail) << it.trail;
+        }
+    }
+
+    if (it.pos > it.nbits) {
+        it.left = 0;
+        return false;
+    }
+    it.left--;
+    time = it.time;
+    value = bits_dbl(it.bits);
+    return true;
+}
+
+// running aggregate of one bucket
+struct TsAcc {
+    uint64_t count { 0 };
+    double sum { 0 };
+    double min { 0 };
+    double max { 0 };
+    double first { 0 };
+    double last { 0 };
+};
+
+static void acc_add(TsAcc &acc, double v) {
+    if (acc.count == 0) {
+        acc.first = acc.min = acc.max = v;
+    }
+    acc.count++;
+    acc.sum += v;
+    acc.min = std::min(acc.min, v);
+    acc.max = std::max(acc.max, v);
+    acc.last = v;
+}
+
+// folds in a whole chunk from its summary
+static void acc_add_chunk(TsAcc &acc, const TsChunk &c) {
+    if (acc.count == 0) {
+        acc.first = c.first;
+        acc.min = c.min;
+        acc.max = c.max;
+    }
+    acc.count += c.count;
+    acc.sum += c.sum;
+    acc.min = std::min(acc.min, c.min);
+    acc.max = std::max(acc.max, c.max);
+    acc.last = bits_dbl(c.last_bits);
+}
+
+static double acc_result(const TsAcc &acc, uint32_t agg) {
+    switch (agg) {
+    case TS_AGG_AVG: return acc.sum / static_cast<double>(acc.count);
+    case TS_AGG_SUM: return acc.sum;
+    case TS_AGG_MIN: return acc.min;
+    case TS_AGG_MAX: return acc.max;
+    case TS_AGG_COUNT: return static_cast<double>(acc.count);
+    case TS_AGG_FIRST: return acc.first;
+    case TS_AGG_LAST: return acc.last;
+    case TS_AGG_RANGE: return acc.max - acc.min;
+    }
+    return 0;
+}
+
+// calls f with up to count samples with from <= time <= to, or with the
+// aggregate of every non-empty bucket of that many milliseconds (aligned to 0)
+// samples are decoded straight into the aggregate; chunks that lie within the
+// range and a single bucket are folded in from their summary without decoding
+void ts_range(const TimeSeries *ts, uint64_t from, uint64_t to, uint32_t agg, uint64_t bucket,
+    size_t count, void (*f)(uint64_t, double, void *), void *arg)
+{
+    // the first chunk that may hold from
+    auto chunk { std::lower_bound(ts->chunks.begin(), ts->chunks.end(), from,
+        [](const TsChunk &c, uint64_t t) { return c.last_ts < t; }) };
+
+    TsAcc acc;
+    uint64_t acc_bucket { 0 };
+    size_t emitted { 0 };
+    for (; chunk != ts->chunks.end() && chunk->first_ts <= to && emitted < count; ++chunk) {
+        if (agg != TS_AGG_NONE && chunk->first_ts >= from && chunk->last_ts <= to
+            && chunk->first_ts / bucket == chunk->last_ts / bucket)
+        {
+            uint64_t b { chunk->first_ts - chunk->first_ts % bucket };
+            if (acc.count > 0 && b != acc_bucket) {
+                f(acc_bucket, acc_result(acc, agg), arg);
+                emitted++;
+                acc = TsAcc();
+            }
+            acc_bucket = b;
+            acc_add_chunk(acc, *chunk);
+            continue;
+        }
+
+        TsIter it;
+        iter_init(it, &*chunk);
+        uint64_t time { 0 };
+        double value { 0 };
+        while (emitted < count && iter_next(it, time, value) && time <= to) {
+            if (time < from) {
+                continue;
+            }
+            if (agg == TS_AGG_NONE) {
+                f(time, value, arg);
+                emitted++;
+                continue;
+            }
+
+            uint64_t b { time - time % bucket };
+            if (acc.count > 0 && b != acc_bucket) {
+                f(acc_bucket, acc_result(acc, agg), arg);
+                emitted++;
+                acc = TsAcc();
+            }
+            acc_bucket = b;
+            acc_add(acc, value);
+        }
+    }
+
+    if (acc.count > 0 && emitted < count) {
+        f(acc_bucket, acc_result(acc, agg), arg);
+    }
+}
+
+// serializes a time series
+// format: count nchunks (first_ts last_ts count nbits data last_delta last_bits
+//         lead trail first min max sum)...
+void ts_encode(const TimeSeries *ts, std::vector<uint8_t> &out) {
+    write_u64(out, ts->count);
+    write_u32(out, static_cast<uint32_t>(ts->chunks.size()));
+    for (const TsChunk &c : ts->chunks) {
+        write_u64(out, c.first_ts);
+        write_u64(out, c.last_ts);
+        write_u32(out, c.count);
+        write_u64(out, c.nbits);
+        write_str(out, c.data.data(), c.data.size());
+        write_u64(out, static_cast<uint64_t>(c.last_delta));
+        write_u64(out, c.last_bits);
+        write_u32(out, c.lead);
+        write_u32(out, c.trail);
+        write_dbl(out, c.first);
+        write_dbl(out, c.min);
+        write_dbl(out, c.max);
+        write_dbl(out, c.sum);
+    }
+}
+
+// loads a time series serialized by ts_encode into an empty one
+bool ts_decode(const uint8_t *&cur, const uint8_t *end, TimeSeries *ts) {
+    uint32_t nchunks { 0 };
+    if (!read_u64(cur, end, ts->count) || !read_u32(cur, end, nchunks)) {
+        return false;
+    }
+
+    // a chunk takes at least its fixed fields
+    if (nchunks > static_cast<size_t>(end - cur) / K_TS_CHUNK_MIN_BYTES) {
+        return false;
+    }
+
+    ts->chunks.resize(nchunks);
+    uint64_t count { 0 };
+    for (size_t i = 0; i < ts->chunks.size(); ++i) {
+        TsChunk &c { ts->chunks[i] };
+        uint32_t len { 0 };
+        uint64_t last_delta { 0 };
+        uint32_t lead { 0 };
+        uint32_t trail { 0 };
+        if (!read_u64(cur, end, c.first_ts) || !read_u64(cur, end, c.last_ts)
+            || !read_u32(cur, end, c.count) || !read_u64(cur, end, c.nbits)
+            || !read_u32(cur, end, len) || len > static_cast<size_t>(end - cur) || (c.nbits + 7) / 8 != len) {
+            return false;
+        }
+        // chunks hold samples in order, the first one 64 bits wide
+        if (c.count == 0 || c.nbits < 64 || c.last_ts < c.first_ts
+            || (i > 0 && c.first_ts <= ts->chunks[i - 1].last_ts)) {
+            return false;
+        }
+        c.data.assign(cur, cur + len);
+        cur += len;
+
+        if (!read_u64(cur, end, last_delta) || !read_u64(cur, end, c.last_bits)
+            || !read_u32(cur, end, lead) || !read_u32(cur, end, trail)
+            || !read_dbl(cur, end, c.first) || !read_dbl(cur, end, c.min)
+            || !read_dbl(cur, end, c.max) || !read_dbl(cur, end, c.sum)) {
+            return false;
+        }
+        // appends write 64 - lead - trail bits of the XOR
+        if (lead > 64 || trail > 64 - lead) {
+            return false;
+        }
+        count += c.count;
+        c.last_delta = static_cast<int64_t>(last_delta);
+        c.lead = static_cast<uint8_t>(lead);
+        c.trail = static_cast<uint8_t>(trail);
+    }
+    return count == ts->count;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// downsampling aggregations
+enum {
+    TS_AGG_NONE = 0,
+    TS_AGG_AVG = 1,
+    TS_AGG_SUM = 2,
+    TS_AGG_MIN = 3,
+    TS_AGG_MAX = 4,
+    TS_AGG_COUNT = 5,
+    TS_AGG_FIRST = 6,
+    TS_AGG_LAST = 7,
+    TS_AGG_RANGE = 8,
+};
+
+// a run of samples compressed as in Facebook's Gorilla: timestamps as
+// delta-of-deltas, values as the XOR with the previous value's bits
+// the encoder state of the last sample is kept so the chunk can be appended to
+struct TsChunk {
+    uint64_t first_ts { 0 };
+    uint64_t last_ts { 0 };
+    uint32_t count { 0 };
+    std::vector<uint8_t> data; // bit stream, most significant bit first
+    uint64_t nbits { 0 };
+    int64_t last_delta { 0 };
+    uint64_t last_bits { 0 }; // bits of the last value
+    uint8_t lead { 0 };       // leading and trailing zeros of the last XOR block
+    uint8_t trail { 0 };
+    // summary for aggregating whole chunks without decoding them
+    double first { 0 };
+    double min { 0 };
+    double max { 0 };
+    double sum { 0 };
+};
+
+// samples with strictly increasing timestamps, appended to the last chunk
+struct TimeSeries {
+    std::vector<TsChunk> chunks;
+    uint64_t count { 0 };
+};
+
+bool ts_parse_agg(const std::string &s, uint32_t &agg);
+
+bool ts_add(TimeSeries *ts, uint64_t time, double value);
+bool ts_last(const TimeSeries *ts, uint64_t &time, double &value);
+size_t ts_bytes(const TimeSeries *ts);
+void ts_range(const TimeSeries *ts, uint64_t from, uint64_t to, uint32_t agg, uint64_t bucket,
+    size_t count, void (*f)(uint64_t, double, void *), void *arg);
+
+void ts_encode(const TimeSeries *ts, std::vector<uint8_t> &out);
+bool ts_decode(const uint8_t *&cur, const uint8_t *end, TimeSeries *ts);
@@ -0,0 +1,603 @@
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <queue>
+#include "vector_index.h"
+#include "buffer.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// graph degree on upper levels, level 0 keeps twice as many links
+const size_t K_VEC_M = 16;
+
+// candidates considered while linking a new node
+const size_t K_VEC_EF_CONSTRUCTION = 200;
+
+// deleted nodes are dropped by a rebuild once they outnumber live ones
+const size_t K_VEC_REBUILD_MIN = 1024;
+
+static float dot_scalar(const float *a, const float *b, size_t n) {
+    float s0 { 0 }, s1 { 0 }, s2 { 0 }, s3 { 0 };
+    size_t i { 0 };
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i) {
+        s0 += a[i] * b[i];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+static float l2_scalar(const float *a, const float *b, size_t n) {
+    float s0 { 0 }, s1 { 0 }, s2 { 0 }, s3 { 0 };
+    size_t i { 0 };
+    for (; i + 4 <= n; i += 4) {
+        float d0 { a[i] - b[i] };
+        float d1 { a[i + 1] - b[i + 1] };
+        float d2 { a[i + 2] - b[i + 2] };
+        float d3 { a[i + 3] - b[i + 3] };
+        s0 += d0 * d0;
+        s1 += d1 * d1;
+        s2 += d2 * d2;
+        s3 += d3 * d3;
+    }
+    for (; i < n; ++i) {
+        float d { a[i] - b[i] };
+        s0 += d * d;
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v) {
+    __m128 s { _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)) };
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, size_t n) {
+    __m256 acc0 { _mm256_setzero_ps() };
+    __m256 acc1 { _mm256_setzero_ps() };
+    size_t i { 0 };
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    // the tail stays inline, calling sse code with dirty ymm state is slow
+    float s { hsum_avx2(_mm256_add_ps(acc0, acc1)) };
+    for (; i < n; ++i) {
+        s += a[i] * b[i];
+    }
+    return s;
+}
+
+__attribute__((target("avx2,fma")))
+static float l2_avx2(const float *a, const float *b, size_t n) {
+    __m256 acc0 { _mm256_setzero_ps() };
+    __m256 acc1 { _mm256_setzero_ps() };
+    size_t i { 0 };
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 { _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)) };
+        __m256 d1 { _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)) };
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d { _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)) };
+        acc0 = _mm256_fmadd_ps(d, d, acc0);
+    }
+    float s { hsum_avx2(_mm256_add_ps(acc0, acc1)) };
+    for (; i < n; ++i) {
+        float d { a[i] - b[i] };
+        s += d * d;
+    }
+    return s;
+}
+
+// spills the lanes, gcc 12 warns on the reduce and shuffle intrinsics
+__attribute__((target("avx512f")))
+static float hsum_avx512(__m512 v) {
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, v);
+    float s { 0 };
+    for (float x : lanes) {
+        s += x;
+    }
+    return s;
+}
+
+// the tail is handled with a masked load instead of a scalar loop
+__attribute__((target("avx512f")))
+static float dot_avx512(const float *a, const float *b, size_t n) {
+    __m512 acc0 { _mm512_setzero_ps() };
+    __m512 acc1 { _mm512_setzero_ps() };
+    size_t i { 0 };
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    }
+    if (i < n) {
+        __mmask16 m { static_cast<__mmask16>((1u << (n - i)) - 1) };
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc1);
+    }
+    return hsum_avx512(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+static float l2_avx512(const float *a, const float *b, size_t n) {
+    __m512 acc0 { _mm512_setzero_ps() };
+    __m512 acc1 { _mm512_setzero_ps() };
+    size_t i { 0 };
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0 { _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)) };
+        __m512 d1 { _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16)) };
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m512 d { _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)) };
+        acc0 = _mm512_fmadd_ps(d, d, acc0);
+    }
+    if (i < n) {
+        __mmask16 m { static_cast<__mmask16>((1u << (n - i)) - 1) };
+        __m512 d { _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i)) };
+        acc1 = _mm512_fmadd_ps(d, d, acc1);
+    }
+    return hsum_avx512(_mm512_add_ps(acc0, acc1));
+}
+#endif
+
+struct Kernels {
+    float (*dot)(const float *, const float *, size_t);
+    float (*l2)(const float *, const float *, size_t);
+    const char *name;
+};
+
+static uint64_t kernel_clock_ns() {
+    struct timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return static_cast<uint64_t>(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// picks the fastest kernels the CPU supports, timed rather than assumed:
+// some CPUs split or downclock 512-bit operations and run avx512 slower than avx2
+static Kernels pick_kernels() {
+    std::vector<Kernels> supported { { &dot_scalar, &l2_scalar, "scalar" } };
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        supported.push_back({ &dot_avx2, &l2_avx2, "avx2" });
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        supported.push_back({ &dot_avx512, &l2_avx512, "avx512" });
+    }
+#endif
+
+    const size_t dim { 512 };
+    std::vector<float> a(dim);
+    std::vector<float> b(dim);
+    for (size_t i = 0; i < dim; ++i) {
+        a[i] = static_cast<float>(i % 7);
+        b[i] = static_cast<float>(i % 5);
+    }
+
+    Kernels best { supported[0] };
+    uint64_t best_ns { UINT64_MAX };
+    volatile float sink { 0 };
+    for (int round = 0; round < 2; ++round) {
+        for (const Kernels &k : supported) {
+            uint64_t start { kernel_clock_ns() };
+            for (int i = 0; i < 500; ++i) {
+                sink = sink + k.l2(a.data(), b.data(), dim) + k.dot(a.data(), b.data(), dim);
+            }
+            uint64_t ns { kernel_clock_ns() - start };
+            if (ns < best_ns) {
+                best = k;
+                best_ns = ns;
+            }
+        }
+    }
+    return best;
+}
+
+// distance kernels for the running CPU, picked once at startup
+static const Kernels g_kernels { pick_kernels() };
+
+// name of the distance kernels in use
+const char *vec_kernel_name() {
+    return g_kernels.name;
+}
+
+bool vec_parse_metric(const std::string &s, uint32_t &metric) {
+    if (s == "l2") {
+        metric = VEC_L2;
+    } else if (s == "cosine") {
+        metric = VEC_COSINE;
+    } else if (s == "dot") {
+        metric = VEC_DOT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// distance between two vectors, cosine vectors must be normalized
+float vec_distance(uint32_t metric, const float *a, const float *b, size_t dim) {
+    switch (metric) {
+    case VEC_COSINE:
+        return 1 - g_kernels.dot(a, b, dim);
+    case VEC_DOT:
+        return -g_kernels.dot(a, b, dim);
+    default:
+        return g_kernels.l2(a, b, dim);
+    }
+}
+
+static const float *node_vec(const VecIndex *index, uint32_t id) {
+    return &index->data[static_cast<size_t>(id) * index->dim];
+}
+
+static float node_dist(const VecIndex *index, const float *v, uint32_t id) {
+    return vec_distance(index->metric, v, node_vec(index, id), index->dim);
+}
+
+// copies a vector, normalizing it for the cosine metric
+static void prepare_vec(const VecIndex *index, const float *v, std::vector<float> &out) {
+    out.assign(v, v + index->dim);
+    if (index->metric == VEC_COSINE) {
+        float norm { sqrtf(g_kernels.dot(v, v, index->dim)) };
+        if (norm > 0) {
+            for (float &x : out) {
+                x /= norm;
+            }
+        }
+    }
+}
+
+// level of a new node, geometrically distributed with ratio 1/M
+static int random_level(VecIndex *index) {
+    index->rng ^= index->rng >> 12;
+    index->rng ^= index->rng << 25;
+    index->rng ^= index->rng >> 27;
+    uint64_t r { index->rng * 0x2545F4914F6CDD1DULL };
+
+    double u { static_cast<double>((r >> 11) + 1) / 9007199254740993.0 }; // (0, 1]
+    return static_cast<int>(-log(u) / log(static_cast<double>(K_VEC_M)));
+}
+
+typedef std::pair<float, uint32_t> DistId;
+
+// best-first search of one level from the entry points,
+// returns up to ef nodes closest to v in ascending distance
+static void search_level(VecIndex *index, const float *v, const std::vector<DistId> &entry,
+    size_t ef, int level, std::vector<DistId> &out)
+{
+    index->visited.resize(index->nodes.size(), 0);
+    if (++index->visit_epoch == 0) {
+        std::fill(index->visited.begin(), index->visited.end(), 0);
+        index->visit_epoch = 1;
+    }
+
+    std::priority_queue<DistId, std::vector<DistId>, std::greater<DistId>> candidates;
+    std::priority_queue<DistId> results; // farthest on top
+
+    for (const DistId &ep : entry) {
+        index->visited[ep.second] = index->visit_epoch;
+        candidates.push(ep);
+        results.push(ep);
+    }
+    while (results.size() > ef) {
+        results.pop();
+    }
+
+    while (!candidates.empty()) {
+        DistId c { candidates.top() };
+        if (results.size() >= ef && c.first > results.top().first) {
+            break;
+        }
+        candidates.pop();
+
+        for (uint32_t nb : index->nodes[c.second].links[level]) {
+            if (index->visited[nb] == index->visit_epoch) {
+                continue;
+            }
+            index->visited[nb] = index->visit_epoch;
+
+            float d { node_dist(index, v, nb) };
+            if (results.size() < ef || d < results.top().first) {
+                candidates.push({ d, nb });
+                results.push({ d, nb });
+                if (results.size() > ef) {
+                    results.pop();
+                }
+            }
+        }
+    }
+
+    out.resize(results.size());
+    for (size_t i = out.size(); i > 0; --i) {
+        out[i - 1] = results.top();
+        results.pop();
+    }
+}
+
+// picks up to m neighbours from candidates sorted by distance, skipping
+// ones closer to an already picked neighbour than to the new node so links
+// spread out in different directions, then fills up with the skipped ones
+static void select_neighbors(const VecIndex *index, const std::vector<DistId> &candidates,
+    size_t m, std::vector<uint32_t> &out)
+{
+    out.clear();
+    std::vector<uint32_t> skipped;
+    for (const DistId &c : candidates) {
+        if (out.size() >= m) {
+            break;
+        }
+
+        bool keep { true };
+        for (uint32_t r : out) {
+            if (node_dist(index, node_vec(index, c.second), r) < c.first) {
+                keep = false;
+                break;
+            }
+        }
+        if (keep) {
+            out.push_back(c.second);
+        } else {
+            skipped.push_back(c.second);
+        }
+    }
+
+    for (size_t i = 0; i < skipped.size() && out.size() < m; ++i) {
+        out.push_back(skipped[i]);
+    }
+}
+
+// descends from the top level to the given one, following the closest node
+static DistId greedy_descend(VecIndex *index, const float *v, int level) {
+    std::vector<DistId> ep { { node_dist(index, v, index->entry), index->entry } };
+    std::vector<DistId> found;
+    for (int l = index->max_level; l > level; --l) {
+        search_level(index, v, ep, 1, l, found);
+        ep.assign(found.begin(), found.begin() + 1);
+    }
+    return ep[0];
+}
+
+void vec_init(VecIndex *index, uint32_t dim, uint32_t metric) {
+    *index = VecIndex();
+    index->dim = dim;
+    index->metric = metric;
+}
+
+// rebuilds the graph without deleted nodes once they outnumber live ones
+static void maybe_rebuild(VecIndex *index) {
+    size_t deleted { index->nodes.size() - index->by_name.size() };
+    if (deleted < K_VEC_REBUILD_MIN || deleted < index->by_name.size()) {
+        return;
+    }
+
+    VecIndex fresh;
+    vec_init(&fresh, index->dim, index->metric);
+    for (uint32_t id = 0; id < index->nodes.size(); ++id) {
+        if (!index->nodes[id].deleted) {
+            vec_add(&fresh, index->nodes[id].name, node_vec(index, id));
+        }
+    }
+    *index = std::move(fresh);
+}
+
+// adds a vector under name, replacing an existing one
+// returns true if the name is new
+bool vec_add(VecIndex *index, const std::string &name, const float *v) {
+    bool replaced { vec_del(index, name) };
+
+    std::vector<float> vec;
+    prepare_vec(index, v, vec);
+
+    uint32_t id { static_cast<uint32_t>(index->nodes.size()) };
+    int level { random_level(index) };
+    index->data.insert(index->data.end(), vec.begin(), vec.end());
+    index->nodes.emplace_back();
+    index->nodes[id].name = name;
+    index->nodes[id].links.resize(level + 1);
+    index->by_name[name] = id;
+
+    if (index->max_level < 0) {
+        index->entry = id;
+        index->max_level = level;
+        return !replaced;
+    }
+
+    std::vector<DistId> ep { greedy_descend(index, vec.data(), level) };
+    std::vector<DistId> found;
+    std::vector<uint32_t> picked;
+    for (int l = std::min(level, index->max_level); l >= 0; --l) {
+        search_level(index, vec.data(), ep, K_VEC_EF_CONSTRUCTION, l, found);
+        select_neighbors(index, found, K_VEC_M, picked);
+        index->nodes[id].links[l] = picked;
+
+        // link back, pruning neighbours that now have too many links
+        size_t max_links { l == 0 ? 2 * K_VEC_M : K_VEC_M };
+        for (uint32_t nb : picked) {
+            std::vector<uint32_t> &links { index->nodes[nb].links[l] };
+            links.push_back(id);
+            if (links.size() <= max_links) {
+                continue;
+            }
+
+            std::vector<DistId> dists;
+            for (uint32_t x : links) {
+                dists.push_back({ node_dist(index, node_vec(index, nb), x), x });
+            }
+            std::sort(dists.begin(), dists.end());
+            select_neighbors(index, dists, max_links, links);
+        }
+        ep = found;
+    }
+
+    if (level > index->max_level) {
+        index->entry = id;
+        index->max_level = level;
+    }
+
+    maybe_rebuild(index);
+    return !replaced;
+}
+
+// removes a vector, its node stays in the graph for routing
+bool vec_del(VecIndex *index, const std::string &name) {
+    auto it { index->by_name.find(name) };
+    if (it == index->by_name.end()) {
+        return false;
+    }
+    index->nodes[it->second].deleted = true;
+    index->by_name.erase(it);
+    return true;
+}
+
+size_t vec_size(const VecIndex *index) {
+    return index->by_name.size();
+}
+
+// finds the approximately k nearest live vectors, ef >= k trades speed for recall
+void vec_search(VecIndex *index, const float *query, size_t k, size_t ef,
+    std::vector<DistId> &out)
+{
+    out.clear();
+    if (index->max_level < 0 || k == 0) {
+        return;
+    }
+
+    std::vector<float> q;
+    prepare_vec(index, query, q);
+
+    std::vector<DistId> ep { greedy_descend(index, q.data(), 0) };
+    std::vector<DistId> found;
+    search_level(index, q.data(), ep, std::max(ef, k), 0, found);
+
+    for (const DistId &d : found) {
+        if (out.size() == k) {
+            break;
+        }
+        if (!index->nodes[d.second].deleted) {
+            out.push_back(d);
+        }
+    }
+}
+
+// serializes the index including its graph, so loading needs no rebuild
+// format: dim metric entry max_level rng n (name deleted vector nlevels (nlinks links...)...)...
+// the level generator's state is kept so a copy picks the same levels for later adds
+void vec_encode(const VecIndex *index, std::vector<uint8_t> &out) {
+    write_u32(out, index->dim);
+    write_u32(out, index->metric);
+    write_u32(out, index->entry);
+    write_u32(out, static_cast<uint32_t>(index->max_level));
+    write_u64(out, index->rng);
+    write_u32(out, static_cast<uint32_t>(index->nodes.size()));
+
+    for (uint32_t id = 0; id < index->nodes.size(); ++id) {
+        const VecNode &node { index->nodes[id] };
+        write_str(out, node.name);
+        write_u32(out, node.deleted);
+        buf_append(out, reinterpret_cast<const uint8_t *>(node_vec(index, id)), index->dim * sizeof(float));
+
+        write_u32(out, static_cast<uint32_t>(node.links.size()));
+        for (const std::vector<uint32_t> &links : node.links) {
+            write_u32(out, static_cast<uint32_t>(links.size()));
+            buf_append(out, reinterpret_cast<const uint8_t *>(links.data()), links.size() * sizeof(uint32_t));
+        }
+    }
+}
+
+// loads an index serialized by vec_encode
+// the graph is checked so searches can follow it without bounds checks:
+// links point at nodes present on their level, and the entry node is on
+// the top level
+bool vec_decode(const uint8_t *&cur, const uint8_t *end, VecIndex *index) {
+    uint32_t dim { 0 };
+    uint32_t metric { 0 };
+    uint32_t entry { 0 };
+    uint32_t max_level { 0 };
+    uint64_t rng { 0 };
+    uint32_t n { 0 };
+    if (!read_u32(cur, end, dim) || !read_u32(cur, end, metric) || !read_u32(cur, end, entry)
+        || !read_u32(cur, end, max_level) || !read_u64(cur, end, rng) || !read_u32(cur, end, n)) {
+        return false;
+    }
+    // a node takes at least its name length, deleted flag, vector and level count
+    size_t vec_bytes { dim * sizeof(float) };
+    if (dim == 0 || dim > K_VEC_MAX_DIM || metric > VEC_DOT || rng == 0
+        || n > static_cast<size_t>(end - cur) / (12 + vec_bytes)) {
+        return false;
+    }
+    if (n == 0 ? max_level != UINT32_MAX : entry >= n || max_level > INT32_MAX) {
+        return false;
+    }
+
+    vec_init(index, dim, metric);
+    index->entry = entry;
+    index->max_level = static_cast<int32_t>(max_level);
+    index->rng = rng;
+    index->nodes.resize(n);
+    index->data.resize(static_cast<size_t>(n) * dim);
+
+    for (uint32_t id = 0; id < n; ++id) {
+        VecNode &node { index->nodes[id] };
+        uint32_t deleted { 0 };
+        uint32_t nlevels { 0 };
+        if (!read_lstr(cur, end, node.name) || !read_u32(cur, end, deleted)
+            || vec_bytes > static_cast<size_t>(end - cur)) {
+            return false;
+        }
+        memcpy(&index->data[static_cast<size_t>(id) * dim], cur, vec_bytes);
+        cur += vec_bytes;
+
+        // every node is on level 0, and each level takes at least its link count
+        if (!read_u32(cur, end, nlevels) || nlevels == 0 || nlevels > static_cast<size_t>(end - cur) / 4) {
+            return false;
+        }
+        node.links.resize(nlevels);
+        for (std::vector<uint32_t> &links : node.links) {
+            uint32_t nlinks { 0 };
+            if (!read_u32(cur, end, nlinks) || nlinks > static_cast<size_t>(end - cur) / sizeof(uint32_t)) {
+                return false;
+            }
+            links.resize(nlinks);
+            memcpy(links.data(), cur, nlinks * sizeof(uint32_t));
+            cur += nlinks * sizeof(uint32_t);
+        }
+
+        node.deleted = deleted;
+        if (!node.deleted && !index->by_name.emplace(node.name, id).second) {
+            return false;
+        }
+    }
+
+    for (const VecNode &node : index->nodes) {
+        for (size_t l = 0; l < node.links.size(); ++l) {
+            for (uint32_t x : node.links[l]) {
+                if (x >= n || index->nodes[x].links.size() <= l) {
+                    return false;
+                }
+            }
+        }
+    }
+    return n == 0 || index->nodes[entry].links.size() == static_cast<size_t>(max_level) + 1;
+}
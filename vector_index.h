@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// largest dimension of an index
+const uint32_t K_VEC_MAX_DIM = 65536;
+
+// distance metrics, smaller is closer for all of them
+enum {
+    VEC_L2 = 0,     // squared euclidean distance
+    VEC_COSINE = 1, // 1 - cosine similarity, vectors are normalized on insert
+    VEC_DOT = 2,    // negated inner product
+};
+
+// a vector in the graph, deleted ones are kept for routing until a rebuild
+struct VecNode {
+    std::string name;
+    bool deleted { false };
+    // neighbours on each level the node is part of
+    std::vector<std::vector<uint32_t>> links;
+};
+
+// approximate nearest neighbour index over fixed-dimension float vectors,
+// a hierarchical navigable small world graph (HNSW)
+struct VecIndex {
+    uint32_t dim { 0 };
+    uint32_t metric { VEC_L2 };
+    // vectors of all nodes back to back, indexed by node id
+    std::vector<float> data;
+    std::vector<VecNode> nodes;
+    std::unordered_map<std::string, uint32_t> by_name; // live nodes only
+    uint32_t entry { 0 };
+    int max_level { -1 };
+    uint64_t rng { 0x9E3779B97F4A7C15 };
+    // visit marks for searches, a node is visited if its mark equals visit_epoch
+    std::vector<uint32_t> visited;
+    uint32_t visit_epoch { 0 };
+};
+
+bool vec_parse_metric(const std::string &s, uint32_t &metric);
+float vec_distance(uint32_t metric, const float *a, const float *b, size_t dim);
+const char *vec_kernel_name();
+
+void vec_init(VecIndex *index, uint32_t dim, uint32_t metric);
+bool vec_add(VecIndex *index, const std::string &name, const float *v);
+bool vec_del(VecIndex *index, const std::string &name);
+size_t vec_size(const VecIndex *index);
+void vec_search(VecIndex *index, const float *query, size_t k, size_t ef,
+    std::vector<std::pair<float, uint32_t>> &out);
+
+void vec_encode(const VecIndex *index, std::vector<uint8_t> &out);
+bool vec_decode(const uint8_t *&cur, const uint8_t *end, VecIndex *index);
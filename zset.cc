@@ -0,0 +1,89 @@
+#include <math.h>
+#include "zset.h"
+#include "buffer.h"
+
+// adds a name or updates its score
+// returns true if the name was added, false if it was updated
+bool zset_add(ZSet *zset, const std::string &name, double score) {
+    auto [it, added] { zset->by_name.emplace(name, score) };
+    if (!added) {
+        if (it->second == score) {
+            return false;
+        }
+        zset->by_score.erase({ it->second, name });
+        it->second = score;
+    }
+    zset->by_score.emplace(score, name);
+    return added;
+}
+
+// finds the score of a name
+bool zset_lookup(ZSet *zset, const std::string &name, double &score) {
+    auto it { zset->by_name.find(name) };
+    if (it == zset->by_name.end()) {
+        return false;
+    }
+    score = it->second;
+    return true;
+}
+
+// removes a name, returns false if it was not in the set
+bool zset_del(ZSet *zset, const std::string &name) {
+    auto it { zset->by_name.find(name) };
+    if (it == zset->by_name.end()) {
+        return false;
+    }
+    zset->by_score.erase({ it->second, name });
+    zset->by_name.erase(it);
+    return true;
+}
+
+size_t zset_size(ZSet *zset) {
+    return zset->by_name.size();
+}
+
+// calls f on up to count names with min <= score <= max in score order,
+// stopping early if f returns false
+void zset_range(ZSet *zset, double min, double max, size_t count,
+    bool (*f)(const std::string &, double, void *), void *arg)
+{
+    // the empty name sorts first among equal scores
+    auto it { zset->by_score.lower_bound({ min, std::string() }) };
+    for (; it != zset->by_score.end() && count > 0 && it->first <= max; ++it, --count) {
+        if (!f(it->second, it->first, arg)) {
+            break;
+        }
+    }
+}
+
+// serializes a sorted set
+// format: n (name score)...
+void zset_encode(const ZSet *zset, std::vector<uint8_t> &out) {
+    write_u64(out, zset->by_score.size());
+    for (auto &[score, name] : zset->by_score) {
+        write_str(out, name);
+        write_dbl(out, score);
+    }
+}
+
+// loads a sorted set serialized by zset_encode into an empty set
+bool zset_decode(const uint8_t *&cur, const uint8_t *end, ZSet *zset) {
+    uint64_t n { 0 };
+    if (!read_u64(cur, end, n)) {
+        return false;
+    }
+
+    // names come in order, so each insert lands at the end
+    for (uint64_t i = 0; i < n; ++i) {
+        std::string name;
+        double score { 0 };
+        if (!read_lstr(cur, end, name) || !read_dbl(cur, end, score) || isnan(score)) {
+            return false;
+        }
+        if (!zset->by_name.emplace(name, score).second) {
+            return false;
+        }
+        zset->by_score.emplace_hint(zset->by_score.end(), score, std::move(name));
+    }
+    return true;
+}
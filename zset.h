@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// sorted set: names ordered by (score, name), with a name index for lookups
+struct ZSet {
+    std::set<std::pair<double, std::string>> by_score;
+    std::unordered_map<std::string, double> by_name;
+};
+
+bool zset_add(ZSet *zset, const std::string &name, double score);
+bool zset_lookup(ZSet *zset, const std::string &name, double &score);
+bool zset_del(ZSet *zset, const std::string &name);
+size_t zset_size(ZSet *zset);
+void zset_range(ZSet *zset, double min, double max, size_t count,
+    bool (*f)(const std::string &, double, void *), void *arg);
+
+void zset_encode(const ZSet *zset, std::vector<uint8_t> &out);
+bool zset_decode(const uint8_t *&cur, const uint8_t *end, ZSet *zset);